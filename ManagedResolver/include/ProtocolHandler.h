@@ -14,19 +14,46 @@
 #include <Dbghelp.h>
 #include <memory>
 #include <future>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <map>
+#include <tuple>
+#include <string>
+#include <vector>
 
 #include "ManagedResolver.h"
 #include "ipc/SyncSHMDriver.h"
+#include "ipc/RingSHMDriver.h"
 
 namespace msr {
 	/** Handles the communication protocol of Drace and MSR */
 	class ProtocolHandler {
 	public:
 		using SyncSHMDriver = std::shared_ptr<ipc::SyncSHMDriver<false, false>>;
+		using RingSHMDriver = ipc::RingSHMDriver<false, false>;
 	private:
 		ManagedResolver _resolver;
 		SyncSHMDriver   _shmdriver;
-		bool _keep_running{ true };
+		std::atomic<bool> _keep_running{ true };
+
+		/// Pipelined requests from multiple DRace threads
+		std::unique_ptr<RingSHMDriver> _ring;
+		std::thread     _ring_worker;
+		/**
+		* Serializes the handling of control and ring requests.
+		* DbgHelp is single threaded, hence ring requests are pipelined
+		* but not processed concurrently.
+		*/
+		std::mutex      _mx;
+		/// Slot of the currently processed ring request, nullptr for control channel
+		ipc::SMSlot *   _slot{ nullptr };
+
+		/// module base, full search, pattern
+		using SearchKey = std::tuple<uint64_t, bool, std::string>;
+		static constexpr size_t max_search_results = 64;
+		/// Matches of searches where not all pages are fetched yet
+		std::map<SearchKey, std::vector<uint64_t>> _search_results;
 
 		HMODULE _dbghelp_dll;
 		int    _pid;
@@ -63,6 +90,8 @@ namespace msr {
 		void getCurrentStack();
 		/** Resolve single instruction pointer */
 		void resolveIP();
+		/** Resolve a batch of instruction pointers */
+		void resolveIPBatch();
 		/** Initialize symbol resolver */
 		void init_symbols();
 		/** Download Symbols from SymServer */
@@ -75,6 +104,30 @@ namespace msr {
 		template<typename T>
 		void waitHeartbeat(const std::future<T> & fut);
 
+		/** Process requests of the request ring */
+		void process_ring();
+
+		/** Gets the request of the currently processed message */
+		template<typename T>
+		inline const T & request() const {
+			return _slot ? RingSHMDriver::get<T>(_slot) : _shmdriver->get<T>();
+		}
+		/** Constructs the response of the currently processed message */
+		template<typename T>
+		inline T & response(ipc::SMDataID mid) {
+			return _slot ? RingSHMDriver::emplace<T>(_slot, mid) : _shmdriver->emplace<T>(mid);
+		}
+		/** Sets the response id of the currently processed message */
+		inline void response(ipc::SMDataID mid) {
+			if (_slot) _slot->id = mid;
+			else _shmdriver->id(mid);
+		}
+		/** Sends the response of the currently processed message */
+		inline void commit() {
+			if (_slot) _ring->respond(_slot);
+			else _shmdriver->commit();
+		}
+
 	public:
 		explicit ProtocolHandler(SyncSHMDriver);
 		~ProtocolHandler();
@@ -11,40 +11,173 @@
  */
 
 #include <cstdint>
+#include <array>
 #include <chrono>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <utility>
+#include <algorithm>
 
 #include "ipc/ExtsanData.h"
+#include "ipc/SharedMemory.h"
 #include "LoggerTypes.h"
 #include "sparsepp/spp.h"
 
 namespace msr {
+	/**
+	* Consumes the events of the per-thread rings in the event arena.
+	* Each consumer thread polls a fixed subset of the rings and
+	* drains them in batches.
+	*
+	* If workers are used, the consumers only dispatch the events:
+	* memory accesses are routed to the worker which owns the address
+	* shard, allocations to all workers which own a page of the block and
+	* all other events are broadcast to all workers in order.
+	* Each worker keeps its own copy of the thread states and sync objects.
+	*
+	* Acquire and release records are applied in the order of their global
+	* sequence number (see \ref ipc::QueueMetadata::sync_seq). A ring whose
+	* next record is not in turn is skipped until the preceding sync records
+	* of other rings are processed. In worker mode, the consumers forward the
+	* sync records in this order and each worker applies them in this order.
+	*/
 	class QueueHandler {
 		using Queue_t = ipc::queue_t;
-		using Map_t = spp::sparse_hash_map<uint64_t, void*>;
+		/// consumer to worker ring (single producer, single consumer)
+		using WorkerQueue_t = ipc::Ringbuffer<uint64_t, 1 << 16, true, 64>;
+		using State = ipc::QueueMetadata::State;
 
+		/// per application thread state of a consumer
+		struct ThreadState {
+			void*    thr{ nullptr };
+			/// last callstack, base of the delta encoded stacks
+			unsigned stacksize{ 0 };
+			std::array<uint64_t, ipc::event::max_stack_size> stack;
+		};
+		using Map_t = spp::sparse_hash_map<uint64_t, ThreadState>;
+		/// maps the address of a mutex to the id of its sync object
+		using SyncMap_t = spp::sparse_hash_map<uint64_t, uint64_t>;
+
+		/// analysis state of a consumer (direct mode) or worker
+		struct Analyzer {
+			/// tsan thread states
+			Map_t    tids;
+			/// id of the worker, 0 in direct mode
+			unsigned worker{ 0 };
+			/// sync objects of this worker (worker mode)
+			SyncMap_t sync_ids;
+			/// number of sync ids handed out by this worker
+			uint64_t next_sync_id{ 0 };
+			/// sequence number of the next sync record to apply (worker mode)
+			uint64_t sync_turn{ 0 };
+			/// or-ed to the thread ids to separate the tsan threads of workers
+			uint64_t tid_tag{ 0 };
+			uint64_t events{ 0 };
+			uint64_t last_evtcnt{ 0 };
+		};
+
+		/// maximum number of events which are dequeued at once
+		static constexpr size_t batch_size{ 256 };
+		/// idle iterations until the consumer yields
+		static constexpr unsigned spin_rounds{ 64 };
+		/// idle iterations until the consumer parks
+		static constexpr unsigned yield_rounds{ 128 };
+		/// log2 of the address shard granularity (page)
+		static constexpr unsigned shard_shift{ 12 };
+
+	public:
+		using PSHM = std::shared_ptr<ipc::SharedMemory<ipc::QueueMetadata, false>>;
+
+		/// Maximum number of workers
+		static constexpr unsigned max_workers{ 8 };
+		/**
+		* The tsan runtime is shared by all workers, hence each worker uses
+		* its own sync objects. Their ids are taken from a range of the
+		* (32 bit) address space per worker, starting at this address.
+		*/
+		static constexpr uint64_t sync_id_base{ 0xC0000000 };
+		/// size of the sync id range of a worker
+		static constexpr uint64_t sync_id_range{ 0x40000000 / max_workers };
+		/**
+		* The tsan runtime keys threads by their (32 bit) user tid and is
+		* shared by all workers. Hence each worker registers the application
+		* threads with its id in the upper bits of the tid.
+		*/
+		static constexpr unsigned tid_tag_shift{ 29 };
+		static_assert((max_workers - 1) <= (0xFFFFFFFFull >> tid_tag_shift), "worker id does not fit into the tid tag");
+
+	private:
+		PSHM _shm;
 		ipc::QueueMetadata & _qmeta;
+		unsigned _num_consumers;
+		unsigned _num_workers;
+		/// maximum time a parked consumer sleeps without doorbell
+		std::chrono::milliseconds _park_timeout{ 10 };
 
 		// for stats
 		using tp_t = decltype(std::chrono::system_clock::now());
 		tp_t _last_sample;
-		std::array<uint64_t, ipc::QueueMetadata::num_queues> _events{ 0 };
-		std::array<uint64_t, ipc::QueueMetadata::num_queues> _last_evtcnt{ 0 };
+		std::vector<uint64_t> _events;
+		std::vector<uint64_t> _words;
+		std::vector<uint64_t> _last_evtcnt;
+		std::vector<uint64_t> _last_wordcnt;
+
+		/// sequence number of the next sync record to apply (direct mode) or forward (worker mode)
+		std::atomic<uint64_t> _sync_turn{ 0 };
 
-		std::array<Map_t, ipc::QueueMetadata::num_queues> _tids;
+		/// callstack state of the dispatching consumers (worker mode)
+		std::vector<Map_t> _stacks;
+		/// one per consumer (direct mode) or per worker
+		std::vector<Analyzer> _analyzers;
+		/// ring from consumer c to worker w at index c * num_workers + w
+		std::vector<std::unique_ptr<WorkerQueue_t>> _worker_queues;
 
 	public:
-		explicit QueueHandler(ipc::QueueMetadata & qmeta)
-			: _qmeta(qmeta)
+		/**
+		* \param num_workers number of analysis workers, if 0 the
+		*        consumers analyze the events of their rings directly
+		*/
+		QueueHandler(PSHM shm, unsigned num_consumers = 2, unsigned num_workers = 0)
+			: _shm(shm),
+			_qmeta(*(shm->get())),
+			_num_consumers(num_consumers),
+			_num_workers(std::min(num_workers, (unsigned)max_workers)),
+			_events(num_consumers, 0),
+			_words(num_consumers, 0),
+			_last_evtcnt(num_consumers, 0),
+			_last_wordcnt(num_consumers, 0)
 		{
-			logger->debug("ringbuffer size {}MB", 
-				(Queue_t::slots * sizeof(Queue_t::value_type)) / (1024*1024));
+			logger->debug("{} rings of size {}MB, {} consumers, {} workers",
+				_qmeta.num_queues.load(),
+				(Queue_t::slots * sizeof(Queue_t::value_type)) / (1024*1024),
+				_num_consumers, _num_workers);
+
+			if (_num_workers == 0) {
+				_analyzers.resize(_num_consumers);
+			}
+			else {
+				_stacks.resize(_num_consumers);
+				_analyzers.resize(_num_workers);
+				for (unsigned w = 0; w < _num_workers; ++w) {
+					_analyzers[w].worker = w;
+					_analyzers[w].tid_tag = (uint64_t)w << tid_tag_shift;
+				}
+				for (unsigned i = 0; i < _num_consumers * _num_workers; ++i) {
+					_worker_queues.emplace_back(new WorkerQueue_t);
+				}
+			}
 			init_detector();
 		}
 
-		/* TODO */
+		/** Spawn the consumer and worker threads */
 		void start();
 
-		void process(int queueid);
+		/** Consumer loop, processes all rings with id % num_consumers == consumer */
+		void process(unsigned consumer);
+
+		/** Worker loop, analyzes the events dispatched to this worker */
+		void work(unsigned worker);
 
 		template<typename Duration = std::chrono::seconds>
 		void monitor(Duration dur = std::chrono::seconds(2))
@@ -59,6 +192,56 @@ namespace msr {
 		void init_detector();
 		void print_stats();
 
+		/** Returns true if any ring of this consumer holds events */
+		bool has_events(unsigned consumer);
+
+		/**
+		* Decode up to \ref batch_size records of a ring and pass
+		* each record to the handler. If the handler returns false,
+		* decoding stops and the record is kept in the ring.
+		* \return pair of number of records and number of words
+		*/
+		template<typename Ring, typename Handler>
+		std::pair<size_t, size_t> decode(Ring & queue, Handler && handle) {
+			// records are committed as a whole, hence all available records are complete
+			const size_t avail = queue.readAvailable();
+			uint64_t rec[ipc::event::max_record_words];
+			size_t pos = 0;
+			size_t num = 0;
+			while (num < batch_size && pos < avail) {
+				const unsigned nwords = ipc::event::header_words(queue.peek(pos));
+				if (nwords == 0 || nwords > ipc::event::max_record_words || pos + nwords > avail) {
+					logger->error("corrupted event record, drop {} words", avail - pos);
+					pos = avail;
+					break;
+				}
+				for (unsigned i = 0; i < nwords; ++i) {
+					rec[i] = queue.peek(pos + i);
+				}
+				if (!handle(rec))
+					break;
+				pos += nwords;
+				++num;
+			}
+			queue.consume(pos);
+			return std::make_pair(num, pos);
+		}
+
+		/** Decode and process up to \ref batch_size records of a ring. Returns the number of records */
+		size_t drain(Queue_t & queue, unsigned consumer);
+
+		/** Analyze a single record, returns false if it is a sync record which is not in turn */
+		bool analyze(const uint64_t * rec, Analyzer & an);
+
+		/** Forward a record to the workers (worker mode), returns false if it is a sync record which is not in turn */
+		bool dispatch(const uint64_t * rec, unsigned consumer);
+
+		/** Blocking write of a record into the ring of a worker */
+		void forward(const uint64_t * rec, unsigned nwords, unsigned consumer, unsigned worker);
+
+		/** Apply a delta encoded callstack to the thread state. Returns the new stack size */
+		unsigned update_stack(ThreadState & ts, const uint64_t * rec);
+
 		/**
 		 * split address at 32-bit boundary (zero above)
 		 * TODO: TSAN seems to only support 32 bit addresses!!!
@@ -68,17 +251,56 @@ namespace msr {
 			return (addr & 0x00000000FFFFFFFF);
 		}
 
-		void _acquire(ipc::event::Mutex*, int queueid);
-		void _release(ipc::event::Mutex*, int queueid);
+		/** tid of the application thread in the tsan runtime */
+		inline unsigned long tsan_tid(uint64_t tid, const Analyzer & an) const {
+			return (unsigned long)((tid & ((1ull << tid_tag_shift) - 1)) | an.tid_tag);
+		}
+
+		/**
+		* Address of the sync object of a mutex in the tsan runtime.
+		* In worker mode, each worker maps the mutex to a synthetic id.
+		*/
+		inline void* sync_addr(uint64_t mutex, Analyzer & an) const {
+			if (_num_workers == 0)
+				return (void*)lower_half(mutex);
+			auto it = an.sync_ids.find(mutex);
+			if (it == an.sync_ids.end()) {
+				// ids are 8 byte aligned, as tsan tracks sync objects per shadow cell.
+				// Ids are only reused after sync_id_range / 8 distinct mutexes.
+				uint64_t id = sync_id_base + an.worker * sync_id_range
+					+ ((an.next_sync_id++ * 8) % sync_id_range);
+				it = an.sync_ids.emplace(mutex, id).first;
+			}
+			return (void*)it->second;
+		}
+
+		/** true for records which are ordered by the sync sequence number */
+		static inline bool is_sequenced(const uint64_t * rec) {
+			const ipc::event::Type type = ipc::event::header_type(rec[0]);
+			return type == ipc::event::Type::ACQUIRE || type == ipc::event::Type::RELEASE;
+		}
+
+		/** sync sequence number of an acquire or release record */
+		static inline uint64_t sync_seq(const uint64_t * rec) {
+			return rec[3];
+		}
+
+		/** worker which analyzes accesses to this address */
+		inline unsigned shard(uint64_t addr) const {
+			return (unsigned)((addr >> shard_shift) % _num_workers);
+		}
+
+		void _acquire(const uint64_t * rec, Analyzer & an);
+		void _release(const uint64_t * rec, Analyzer & an);
 		void _happens_before();
 		void _happens_after();
-		void _read(ipc::event::MemAccess*, int queueid);
-		void _write(ipc::event::MemAccess*, int queueid);
-		void _allocate(ipc::event::Allocation*, int queueid);
-		void _free(ipc::event::Allocation*, int queueid);
-		void _fork(ipc::event::ForkJoin*, int queueid);
-		void _join(ipc::event::ForkJoin*, int queueid);
-		void _detach(ipc::event::DetachFinish*, int queueid);
-		void _finish(ipc::event::DetachFinish*, int queueid);
+		void _read(const uint64_t * rec, Analyzer & an);
+		void _write(const uint64_t * rec, Analyzer & an);
+		void _allocate(const uint64_t * rec, Analyzer & an);
+		void _free(const uint64_t * rec, Analyzer & an);
+		void _fork(const uint64_t * rec, Analyzer & an);
+		void _join(const uint64_t * rec, Analyzer & an);
+		void _detach(const uint64_t * rec, Analyzer & an);
+		void _finish(const uint64_t * rec, Analyzer & an);
 	};
 }
@@ -66,6 +66,7 @@ namespace msr {
 		if (cb) {
 			if (cb->enabled) return;
 			cb->enabled.store(true, std::memory_order_relaxed);
+			cb->generation.fetch_add(1, std::memory_order_release);
 			logger->info("enabled detector");
 			return;
 		}
@@ -77,6 +78,7 @@ namespace msr {
 		if (cb) {
 			if (!cb->enabled) return;
 			cb->enabled.store(false, std::memory_order_relaxed);
+			cb->generation.fetch_add(1, std::memory_order_release);
 			logger->info("disabled detector");
 			return;
 		}
@@ -87,6 +89,7 @@ namespace msr {
 		auto cb = _pshmcb->get();
 		if (cb) {
 			cb->sampling_rate.store(s, std::memory_order_relaxed);
+			cb->generation.fetch_add(1, std::memory_order_release);
 			logger->info("set sampling rate to {}", s);
 			return;
 		}
@@ -13,6 +13,8 @@
 #include "LoggerTypes.h"
 
 #include <future>
+#include <string>
+#include <algorithm>
 
 #include <Windows.h>
 #include <DbgHelp.h>
@@ -57,12 +59,17 @@ namespace msr {
 		symgetopts = (PFN_SymGetOptions)GetProcAddress(_dbghelp_dll, "SymGetOptions");
 		symsetopts = (PFN_SymSetOptions)GetProcAddress(_dbghelp_dll, "SymSetOptions");
 
+		_ring = std::make_unique<RingSHMDriver>(DRACE_SMR_RING_NAME, true);
+		_ring_worker = std::thread(&ProtocolHandler::process_ring, this);
+
 		_shmdriver->id(SMDataID::READY);
 		_shmdriver->commit();
 	}
 
 	ProtocolHandler::~ProtocolHandler() {
 		quit();
+		if (_ring_worker.joinable())
+			_ring_worker.join();
 	}
 
 	void ProtocolHandler::connect() {
@@ -200,10 +207,10 @@ namespace msr {
 	void ProtocolHandler::resolveIP() {
 		CString buffer;
 		size_t bs;
-		void* ip = _shmdriver->get<void*>();
+		void* ip = request<void*>();
 		logger->debug("resolve IP: {}", ip);
 
-		SymbolInfo & sym = _shmdriver->emplace<SymbolInfo>(ipc::SMDataID::IP);
+		SymbolInfo & sym = response<SymbolInfo>(ipc::SMDataID::IP);
 
 		// Get Module Name
 		_resolver.GetModuleName(ip, buffer);
@@ -222,7 +229,44 @@ namespace msr {
 		bs = sym.path.size();
 		strncpy_s(sym.path.data(), bs, buffer.GetBuffer(bs), bs);
 		logger->debug("+ resolve IP to: {}", sym.function.data());
-		_shmdriver->commit();
+		commit();
+	}
+
+	void ProtocolHandler::resolveIPBatch() {
+		// copy request, as the buffer is reused for the response
+		const auto req = request<IPBatchRequest>();
+		const uint32_t count = std::min<uint32_t>(req.count, IPBatchRequest::max_pcs);
+		logger->debug("resolve {} IPs", count);
+
+		auto & resp = response<IPBatchResponse>(ipc::SMDataID::IPBATCH);
+		resp.count = 0;
+		size_t pos = 0;
+		const SymbolInfo dummy;
+		for (uint32_t i = 0; i < count; ++i) {
+			void* ip = (void*)req.pcs[i];
+			CString module, function, path;
+			_resolver.GetModuleName(ip, module);
+			_resolver.GetMethodName(ip, function);
+			_resolver.GetFileLineInfo(ip, path);
+
+			// same limits as for single IP requests
+			std::string strs[3] = {
+				std::string(module.GetString()).substr(0, dummy.module.size() - 1),
+				std::string(function.GetString()).substr(0, dummy.function.size() - 1),
+				std::string(path.GetString()).substr(0, dummy.path.size() - 1) };
+			const size_t len = strs[0].size() + strs[1].size() + strs[2].size() + 3;
+			if (pos + len > IPBatchResponse::data_size)
+				break; // client requests remaining ips
+
+			for (const auto & str : strs) {
+				std::copy(str.begin(), str.end(), resp.data + pos);
+				pos += str.size();
+				resp.data[pos++] = '\0';
+			}
+			++resp.count;
+		}
+		logger->debug("+ resolved {} IPs", resp.count);
+		commit();
 	}
 
 	void ProtocolHandler::init_symbols() {
@@ -234,7 +278,7 @@ namespace msr {
 	}
 
 	void ProtocolHandler::loadSymbols() {
-		const auto & sr = _shmdriver->get<ipc::SymbolRequest>();
+		const auto & sr = request<ipc::SymbolRequest>();
 		// Convert path
 		std::string strpath(sr.path.data());
 		std::wstring wstrpath(strpath.begin(), strpath.end());
@@ -280,41 +324,62 @@ namespace msr {
 			//symunloadmod(_phandle, sr.base);
 			logger->info("download finished");
 		}
-		_shmdriver->id(ipc::SMDataID::CONFIRM);
-		_shmdriver->commit();
+		response(ipc::SMDataID::CONFIRM);
+		commit();
 	}
 
 	void ProtocolHandler::unloadSymbols() {
-		const auto & sr = _shmdriver->get<ipc::SymbolRequest>();
+		const auto & sr = request<ipc::SymbolRequest>();
 		symunloadmod(_phandle, sr.base);
+		_search_results.clear();
 		logger->debug("closed symbols");
-		_shmdriver->id(ipc::SMDataID::CONFIRM);
-		_shmdriver->commit();
+		response(ipc::SMDataID::CONFIRM);
+		commit();
 	}
 
 	void ProtocolHandler::searchSymbols() {
-		const auto & sr = _shmdriver->get<ipc::SymbolRequest>();
-		std::vector<uint64_t> symbol_addrs;
-		std::string strpath(sr.path.data());
-		std::wstring wstrpath(strpath.begin(), strpath.end());
-
-		logger->debug("search symobls matching {} at {}", sr.match.data(), (void*)sr.base);
-		if (symsearch(_phandle, sr.base, 0, 0, sr.match.data(), 0, SymbolMatchCallback,
-			(void*)&symbol_addrs, sr.full ? SYMSEARCH_ALLITEMS : NULL))
-		{
-			auto & sr = _shmdriver->emplace<ipc::SymbolResponse>(ipc::SMDataID::SEARCHSYMS);
-			sr.size = std::min(symbol_addrs.size(), sr.adresses.size());
+		const auto & sr = request<ipc::SymbolRequest>();
+		SearchKey key(sr.base, sr.full, sr.match.data());
+		const size_t offset = sr.offset;
+
+		auto it = _search_results.find(key);
+		if (it == _search_results.end() || offset == 0) {
+			std::vector<uint64_t> symbol_addrs;
+			logger->debug("search symobls matching {} at {}", sr.match.data(), (void*)sr.base);
+			if (!symsearch(_phandle, sr.base, 0, 0, sr.match.data(), 0, SymbolMatchCallback,
+				(void*)&symbol_addrs, sr.full ? SYMSEARCH_ALLITEMS : NULL))
+			{
+				symbol_addrs.clear();
+			}
 			logger->debug("found {} matching symbols", symbol_addrs.size());
-			// Do not copy more symbols than buffersize
-			auto cpy_range_end = sr.size <= sr.adresses.size() ? symbol_addrs.end() : (symbol_addrs.begin() + sr.adresses.size());
-			std::copy(symbol_addrs.begin(), cpy_range_end, sr.adresses.begin());
-			_shmdriver->commit();
+			// results are only kept for unfinished paginations,
+			// hence drop all if clients do not fetch all pages
+			if (_search_results.size() >= max_search_results)
+				_search_results.clear();
+			_search_results[key] = std::move(symbol_addrs);
+			it = _search_results.find(key);
 		}
+		const auto & matches = it->second;
+
+		auto & resp = response<ipc::SymbolResponse>(ipc::SMDataID::SEARCHSYMS);
+		resp.total = matches.size();
+		resp.offset = std::min(offset, matches.size());
+		resp.size = std::min(matches.size() - resp.offset, resp.adresses.size());
+		std::copy(matches.begin() + resp.offset, matches.begin() + resp.offset + resp.size, resp.adresses.begin());
+
+		if (resp.offset + resp.size == resp.total)
+			_search_results.erase(it);
+		commit();
 	}
 
 	template<typename T>
 	void ProtocolHandler::waitHeartbeat(const std::future<T> & fut) {
 		while (fut.wait_for(std::chrono::seconds(1)) != std::future_status::ready) {
+			// keep clients of the request ring alive
+			_ring->heartbeat();
+			if (_slot)
+				continue;
+
 			_shmdriver->id(ipc::SMDataID::WAIT);
 			_shmdriver->commit();
 			logger->debug("sent WAIT");
@@ -334,6 +399,7 @@ namespace msr {
 		do {
 			if (_shmdriver->wait_receive()) {
 				logger->trace("Message with id {}", (int)_shmdriver->id());
+				std::lock_guard<std::mutex> lg(_mx);
 				switch (_shmdriver->id()) {
 				case SMDataID::CONNECT:
 					connect(); break;
@@ -343,6 +409,8 @@ namespace msr {
 					getCurrentStack(); break;
 				case SMDataID::IP:
 					resolveIP(); break;
+				case SMDataID::IPBATCH:
+					resolveIPBatch(); break;
 				case SMDataID::LOADSYMS:
 					loadSymbols(); break;
 				case SMDataID::UNLOADSYMS:
@@ -361,6 +429,37 @@ namespace msr {
 		} while (_keep_running);
 	}
 
+	void ProtocolHandler::process_ring() {
+		do {
+			// drain even on timeout, as the event is auto-reset
+			_ring->wait_request();
+			ipc::SMSlot * slot;
+			while ((slot = _ring->next_request()) != nullptr) {
+				logger->trace("Ring request {} with id {}", slot->reqid, (int)slot->id);
+				std::lock_guard<std::mutex> lg(_mx);
+				_slot = slot;
+				switch (slot->id) {
+				case SMDataID::IP:
+					resolveIP(); break;
+				case SMDataID::IPBATCH:
+					resolveIPBatch(); break;
+				case SMDataID::LOADSYMS:
+					loadSymbols(); break;
+				case SMDataID::UNLOADSYMS:
+					unloadSymbols(); break;
+				case SMDataID::SEARCHSYMS:
+					searchSymbols(); break;
+				default:
+					// only stateless requests are allowed on the ring
+					logger->error("protocol error on ring, got: {}", (int)slot->id);
+					response(SMDataID::EXIT);
+					commit();
+				}
+				_slot = nullptr;
+			}
+		} while (_keep_running);
+	}
+
 	void ProtocolHandler::quit() {
 		_keep_running = false;
 	}
@@ -15,69 +15,273 @@
 #include <memory>
 #include <thread>
 #include <chrono>
-#include <thread>
+#include <algorithm>
 
+#ifdef _WIN32
 #include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#endif
 #include "tsan-if.h"
 
 namespace msr {
 	void QueueHandler::start() {
 		logger->info("queue handler started");
 
-		for (int i = 0; i < ipc::QueueMetadata::num_queues; ++i) {
+		for (unsigned i = 0; i < _num_workers; ++i) {
+			std::thread t(&QueueHandler::work, this, i);
+			t.detach();
+		}
+		for (unsigned i = 0; i < _num_consumers; ++i) {
 			std::thread t(&QueueHandler::process, this, i);
 			t.detach();
 		}
 	}
 
-	void QueueHandler::process(int queueid) {
-		using ipc::event::Type;
-		auto pitem = std::make_unique<ipc::event::BufferEntry>();
+	/** Pins the calling thread to a single cpu */
+	static void pin_thread(unsigned cpu) {
+		cpu %= std::thread::hardware_concurrency();
+#ifdef _WIN32
+		SetThreadAffinityMask(GetCurrentThread(), 1ull << cpu);
+#else
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+	}
+
+	void QueueHandler::process(unsigned consumer) {
+		pin_thread(consumer);
+
+		logger->info("consumer {} started", consumer);
+		const unsigned num_queues = _qmeta.num_queues.load(std::memory_order_acquire);
+		unsigned idle = 0;
+		while (true) {
+			size_t processed = 0;
+			for (unsigned q = consumer; q < num_queues; q += _num_consumers) {
+				auto & state = _qmeta.state[q];
+				uint32_t st = state.load(std::memory_order_acquire);
+				if (st == (uint32_t)State::FREE)
+					continue;
+
+				auto & queue = _qmeta.queue(q);
+				size_t num;
+				while ((num = drain(queue, consumer)) > 0) {
+					processed += num;
+				}
+				// producer detached and all events are processed (none is held back)
+				if (st == (uint32_t)State::CLOSED && queue.isEmpty()) {
+					state.store((uint32_t)State::FREE, std::memory_order_release);
+				}
+			}
+			if (processed != 0) {
+				idle = 0;
+				continue;
+			}
+
+			// adaptive idle strategy: spin -> yield -> park
+			++idle;
+			if (idle < spin_rounds) {
+				continue;
+			}
+			else if (idle < yield_rounds) {
+				std::this_thread::yield();
+			}
+			else {
+				_qmeta.parked.fetch_add(1, std::memory_order_seq_cst);
+				// re-check to not miss events committed before we announced parking
+				if (!has_events(consumer)) {
+					_shm->wait(_park_timeout);
+				}
+				_qmeta.parked.fetch_sub(1, std::memory_order_relaxed);
+				idle = spin_rounds;
+			}
+		}
+	}
+
+	bool QueueHandler::has_events(unsigned consumer) {
+		const unsigned num_queues = _qmeta.num_queues.load(std::memory_order_acquire);
+		for (unsigned q = consumer; q < num_queues; q += _num_consumers) {
+			if (_qmeta.state[q].load(std::memory_order_acquire) != (uint32_t)State::FREE
+				&& !_qmeta.queue(q).isEmpty())
+			{
+				return true;
+			}
+		}
+		return false;
+	}
+
+	size_t QueueHandler::drain(Queue_t & queue, unsigned consumer) {
+		std::pair<size_t, size_t> cnt;
+		if (_num_workers == 0) {
+			Analyzer & an = _analyzers[consumer];
+			cnt = decode(queue, [&](const uint64_t * rec) { return analyze(rec, an); });
+			an.events += cnt.first;
+		}
+		else {
+			cnt = decode(queue, [&](const uint64_t * rec) { return dispatch(rec, consumer); });
+		}
+		_events[consumer] += cnt.first;
+		_words[consumer] += cnt.second;
+		return cnt.first;
+	}
+
+	bool QueueHandler::analyze(const uint64_t * rec, Analyzer & an) {
+		using namespace ipc::event;
+
+		// the direct mode consumers share the sequence, each worker has its own
+		const bool sequenced = is_sequenced(rec);
+		if (sequenced) {
+			uint64_t turn = (_num_workers == 0) ? _sync_turn.load(std::memory_order_acquire) : an.sync_turn;
+			if (sync_seq(rec) != turn)
+				return false;
+		}
+
+		switch (header_type(rec[0])) {
+		case Type::ACQUIRE:
+			_acquire(rec, an);
+			break;
+		case Type::RELEASE:
+			_release(rec, an);
+			break;
+		case Type::MEMREAD:
+			_read(rec, an);
+			break;
+		case Type::MEMWRITE:
+			_write(rec, an);
+			break;
+		case Type::ALLOCATION:
+			_allocate(rec, an);
+			break;
+		case Type::FREE:
+			_free(rec, an);
+			break;
+		case Type::FORK:
+			_fork(rec, an);
+			break;
+		case Type::JOIN:
+			break;
+		case Type::DETACH:
+			break;
+		case Type::FINISH:
+			break;
+		default:
+			break;
+		}
+
+		if (sequenced) {
+			if (_num_workers == 0)
+				_sync_turn.store(sync_seq(rec) + 1, std::memory_order_release);
+			else
+				an.sync_turn = sync_seq(rec) + 1;
+		}
+		return true;
+	}
+
+	bool QueueHandler::dispatch(const uint64_t * rec, unsigned consumer) {
+		using namespace ipc::event;
+
+		// forward sync records in sequence order, the workers apply them in this order
+		const bool sequenced = is_sequenced(rec);
+		if (sequenced && sync_seq(rec) != _sync_turn.load(std::memory_order_acquire))
+			return false;
 
-		SetThreadAffinityMask(GetCurrentThread(), 1 << (queueid % std::thread::hardware_concurrency()));
+		const Type type = header_type(rec[0]);
+		switch (type) {
+		case Type::MEMREAD:
+		case Type::MEMWRITE:
+		{
+			// workers see accesses of a thread only partially, hence send full stacks
+			auto & ts = _stacks[consumer][header_thread(rec[0])];
+			const unsigned stacksize = update_stack(ts, rec);
+			uint64_t full[max_record_words];
+			full[0] = make_header(type, 2 + stacksize, 0, header_size(rec[0]), header_thread(rec[0]));
+			full[1] = rec[1];
+			std::copy(ts.stack.begin(), ts.stack.begin() + stacksize, full + 2);
+			forward(full, 2 + stacksize, consumer, shard(lower_half(rec[1])));
+			break;
+		}
+		case Type::ALLOCATION:
+		{
+			// each worker resets its own pages of the block in its stream order
+			const uint64_t begin = lower_half(rec[2]);
+			const uint64_t npages = ((begin + std::max<uint64_t>(rec[3], 1) - 1) >> shard_shift)
+				- (begin >> shard_shift) + 1;
+			for (uint64_t p = 0; p < std::min<uint64_t>(npages, _num_workers); ++p) {
+				forward(rec, header_words(rec[0]), consumer, shard(begin + (p << shard_shift)));
+			}
+			break;
+		}
+		case Type::FREE:
+			forward(rec, header_words(rec[0]), consumer, shard(lower_half(rec[1])));
+			break;
+		case Type::FORK:
+			_stacks[consumer][header_thread(rec[0])].stacksize = 0;
+			// fall through
+		default:
+			// sync events are needed by all workers, in order
+			for (unsigned w = 0; w < _num_workers; ++w) {
+				forward(rec, header_words(rec[0]), consumer, w);
+			}
+			break;
+		}
+
+		if (sequenced)
+			_sync_turn.store(sync_seq(rec) + 1, std::memory_order_release);
+		return true;
+	}
 
-		logger->info("process messages on queue {}", queueid);
+	void QueueHandler::forward(const uint64_t * rec, unsigned nwords, unsigned consumer, unsigned worker) {
+		auto & queue = *_worker_queues[consumer * _num_workers + worker];
+		// backpressure: the consumer stops draining the shared rings
+		while (!queue.writeAll(rec, nwords)) {
+			std::this_thread::yield();
+		}
+	}
+
+	void QueueHandler::work(unsigned worker) {
+		Analyzer & an = _analyzers[worker];
+		logger->info("worker {} started", worker);
+
+		unsigned idle = 0;
 		while (true) {
-			auto & queue = _qmeta.queues[queueid];
-			if (queue.remove(pitem.get())) {
-				++_events[queueid];
-				switch (pitem->type) {
-				case Type::ACQUIRE:
-					_acquire((ipc::event::Mutex*) pitem->buffer, queueid);
-					break;
-				case Type::RELEASE:
-					_release((ipc::event::Mutex*) pitem->buffer, queueid);
-					break;
-				case Type::MEMREAD:
-					_read((ipc::event::MemAccess*) pitem->buffer, queueid);
-					break;
-				case Type::MEMWRITE:
-					_write((ipc::event::MemAccess*) pitem->buffer, queueid);
-					break;
-				case Type::ALLOCATION:
-					_allocate((ipc::event::Allocation*) pitem->buffer, queueid);
-					break;
-				case Type::FREE:
-					_free((ipc::event::Allocation*) pitem->buffer, queueid);
-					break;
-				case Type::FORK:
-					_fork((ipc::event::ForkJoin*) pitem->buffer, queueid);
-					break;
-				case Type::JOIN:
-					break;
-				case Type::DETACH:
-					break;
-				case Type::FINISH:
-					break;
+			size_t processed = 0;
+			for (unsigned c = 0; c < _num_consumers; ++c) {
+				auto & queue = *_worker_queues[c * _num_workers + worker];
+				size_t num;
+				while ((num = decode(queue, [&](const uint64_t * rec) { return analyze(rec, an); }).first) > 0) {
+					processed += num;
 				}
-				//std::cout << "Got " << (short)pitem->type << std::endl;
+			}
+			an.events += processed;
+
+			if (processed != 0) {
+				idle = 0;
+			}
+			else if (++idle < spin_rounds) {
+				continue;
+			}
+			else if (idle < yield_rounds) {
+				std::this_thread::yield();
 			}
 			else {
-				std::this_thread::sleep_for(std::chrono::milliseconds(20));
+				// the consumers are backpressured by full worker rings, hence a short sleep is fine
+				std::this_thread::sleep_for(std::chrono::microseconds(500));
 			}
 		}
 	}
 
+	unsigned QueueHandler::update_stack(ThreadState & ts, const uint64_t * rec) {
+		using namespace ipc::event;
+		const unsigned keep = std::min(header_flags(rec[0]), ts.stacksize);
+		const unsigned nnew = header_words(rec[0]) - 2;
+		std::copy(rec + 2, rec + 2 + nnew, ts.stack.begin() + keep);
+		ts.stacksize = keep + nnew;
+		return ts.stacksize;
+	}
+
 	static void callback(__tsan_race_info* raceInfo, void* params) {
 		logger->info("RACE");
 	}
@@ -92,68 +296,122 @@ namespace msr {
 		auto timediff = std::chrono::system_clock::now() - _last_sample;
 		_last_sample = std::chrono::system_clock::now();
 
-		for (int i = 0; i < ipc::QueueMetadata::num_queues; ++i) {
+		for (unsigned i = 0; i < _num_consumers; ++i) {
 			auto evtdiff = _events[i] - _last_evtcnt[i];
+			auto worddiff = _words[i] - _last_wordcnt[i];
 			_last_evtcnt[i] = _events[i];
-			auto & queue = _qmeta.queues[i];
-			double level = static_cast<double>(queue.readAvailable()) / Queue_t::slots;
+			_last_wordcnt[i] = _words[i];
+
+			// fill level of the fullest ring of this consumer
+			double level = 0.0;
+			unsigned active = 0;
+			for (unsigned q = i; q < _qmeta.num_queues.load(); q += _num_consumers) {
+				if (_qmeta.state[q].load(std::memory_order_relaxed) == (uint32_t)State::FREE)
+					continue;
+				++active;
+				level = std::max(level,
+					static_cast<double>(_qmeta.queue(q).readAvailable()) / Queue_t::slots);
+			}
 
 			// we are interesed in MB/s = B/us throughput 
-			auto proc_byte = evtdiff * sizeof(Queue_t::value_type);
+			auto proc_byte = worddiff * sizeof(Queue_t::value_type);
 			double per_us_byte = static_cast<double>(proc_byte) / std::chrono::duration_cast<std::chrono::microseconds>(timediff).count();
 			double per_s_elem = (static_cast<double>(evtdiff) / std::chrono::duration_cast<std::chrono::microseconds>(timediff).count());
-			logger->debug("queue {} throughput {:.2f}MB/s, {:.2f}MElem/s, level(read) {:03.2f}%",
-				i, per_us_byte, per_s_elem, level * 100);
+			logger->debug("consumer {} throughput {:.2f}MB/s, {:.2f}MElem/s, rings {}, max level(read) {:03.2f}%",
+				i, per_us_byte, per_s_elem, active, level * 100);
 		}
+		for (unsigned w = 0; w < _num_workers; ++w) {
+			auto & an = _analyzers[w];
+			auto evtdiff = an.events - an.last_evtcnt;
+			an.last_evtcnt = an.events;
+			double per_s_elem = (static_cast<double>(evtdiff) / std::chrono::duration_cast<std::chrono::microseconds>(timediff).count());
+			logger->debug("worker {} throughput {:.2f}MElem/s", w, per_s_elem);
+		}
+		logger->debug("overflows: dropped {}, stalls {}, spilled {}",
+			_qmeta.dropped.load(std::memory_order_relaxed),
+			_qmeta.stalls.load(std::memory_order_relaxed),
+			_qmeta.spilled.load(std::memory_order_relaxed));
 	}
 
 	// ----- TSAN Messages -----
-	void QueueHandler::_acquire(ipc::event::Mutex* entry, int queueid) {
-		void* thr = _tids[queueid][entry->thread_id];
-		logger->trace("thr {}@{}", entry->thread_id, thr);
-		if (entry->write) {
-			__tsan_MutexLock(thr, 0, (void*)lower_half(entry->addr), entry->recursive, false);
+	void QueueHandler::_acquire(const uint64_t * rec, Analyzer & an) {
+		using namespace ipc::event;
+		const auto tid = header_thread(rec[0]);
+		void* thr = an.tids[tid].thr;
+		logger->trace("thr {}@{}", tid, thr);
+		if (header_flags(rec[0]) & mutex_write) {
+			__tsan_MutexLock(thr, 0, sync_addr(rec[1], an), (int)rec[2], false);
 		}
 		else {
-			__tsan_MutexReadLock(thr, 0, (void*)lower_half(entry->addr), false);
+			__tsan_MutexReadLock(thr, 0, sync_addr(rec[1], an), false);
 		}
 	}
-	void QueueHandler::_release(ipc::event::Mutex* entry, int queueid) {
-		void* thr = _tids[queueid][entry->thread_id];
-		if (entry->write) {
-			__tsan_MutexUnlock(thr, 0, (void*)lower_half(entry->addr), false);
+	void QueueHandler::_release(const uint64_t * rec, Analyzer & an) {
+		using namespace ipc::event;
+		void* thr = an.tids[header_thread(rec[0])].thr;
+		if (header_flags(rec[0]) & mutex_write) {
+			__tsan_MutexUnlock(thr, 0, sync_addr(rec[1], an), false);
 		}
 		else {
-			__tsan_MutexReadUnlock(thr, 0, (void*)lower_half(entry->addr));
+			__tsan_MutexReadUnlock(thr, 0, sync_addr(rec[1], an));
 		}
 	}
-	void QueueHandler::_read(ipc::event::MemAccess* entry, int queueid) {
-		logger->trace("read: tid {}, addr {}, stacksize {}", entry->thread_id, (void*)entry->addr, entry->stacksize);
+	void QueueHandler::_read(const uint64_t * rec, Analyzer & an) {
+		using namespace ipc::event;
+		auto & ts = an.tids[header_thread(rec[0])];
+		unsigned stacksize = update_stack(ts, rec);
+		logger->trace("read: tid {}, addr {}, stacksize {}", header_thread(rec[0]), (void*)rec[1], stacksize);
 
-		void* thr = _tids[queueid][entry->thread_id];
-		if (nullptr == thr) return;
-		__tsan_read(thr, (void*)lower_half(entry->addr), kSizeLog1, entry->callstack.data(), entry->stacksize);
+		if (nullptr == ts.thr) return;
+		__tsan_read(ts.thr, (void*)lower_half(rec[1]), kSizeLog1, ts.stack.data(), stacksize);
 	}
-	void QueueHandler::_write(ipc::event::MemAccess* entry, int queueid) {
-		logger->trace("write: tid {}, addr {}, stacksize {}", entry->thread_id, (void*)entry->addr, entry->stacksize);
+	void QueueHandler::_write(const uint64_t * rec, Analyzer & an) {
+		using namespace ipc::event;
+		auto & ts = an.tids[header_thread(rec[0])];
+		unsigned stacksize = update_stack(ts, rec);
+		logger->trace("write: tid {}, addr {}, stacksize {}", header_thread(rec[0]), (void*)rec[1], stacksize);
 
-		void* thr = _tids[queueid][entry->thread_id];
-		if (nullptr == thr) return;
-		__tsan_write(thr, (void*)lower_half(entry->addr), kSizeLog1, entry->callstack.data(), entry->stacksize);
+		if (nullptr == ts.thr) return;
+		__tsan_write(ts.thr, (void*)lower_half(rec[1]), kSizeLog1, ts.stack.data(), stacksize);
 	}
-	void QueueHandler::_allocate(ipc::event::Allocation* entry, int queueid) {
-		logger->trace("allocate: tid {}, addr {}, size {}", entry->thread_id, entry->addr, entry->size);
-		__tsan_malloc_use_user_tid(entry->thread_id, 0x42, lower_half(entry->addr), entry->size);
+	void QueueHandler::_allocate(const uint64_t * rec, Analyzer & an) {
+		using namespace ipc::event;
+		logger->trace("allocate: tid {}, addr {}, size {}", header_thread(rec[0]), rec[2], rec[3]);
+		const unsigned long tid = tsan_tid(header_thread(rec[0]), an);
+		if (_num_workers == 0) {
+			__tsan_malloc_use_user_tid(tid, 0x42, lower_half(rec[2]), rec[3]);
+			return;
+		}
+		// This worker owns every num_workers-th page of the block. The block is
+		// registered by the owner of its start, the other pages are reset.
+		const uint64_t begin = lower_half(rec[2]);
+		const uint64_t end = begin + std::max<uint64_t>(rec[3], 1);
+		uint64_t page = begin >> shard_shift;
+		page += (an.worker + _num_workers - shard(page << shard_shift)) % _num_workers;
+		for (; (page << shard_shift) < end; page += _num_workers) {
+			const uint64_t lo = std::max(begin, page << shard_shift);
+			const uint64_t hi = std::min(end, (page + 1) << shard_shift);
+			if (lo == begin)
+				__tsan_malloc_use_user_tid(tid, 0x42, lo, hi - lo);
+			else
+				__tsan_reset_range((unsigned)lo, (unsigned)(hi - lo));
+		}
 	}
 
-	void QueueHandler::_free(ipc::event::Allocation* entry, int queueid) {
-		logger->trace("free: addr {}, size {}", entry->addr, entry->size);
-		__tsan_reset_range(lower_half(entry->addr), entry->size);
+	void QueueHandler::_free(const uint64_t * rec, Analyzer & an) {
+		logger->trace("free: addr {}", rec[1]);
+		// TODO: the size of the block is not tracked
+		__tsan_reset_range(lower_half(rec[1]), 0);
 	}
 
-	void QueueHandler::_fork(ipc::event::ForkJoin* entry, int queueid) {
-		void* thr = __tsan_create_thread(entry->child);
-		logger->trace("Fork child {}@{}", entry->child, thr);
-		_tids[queueid][entry->child] = thr;
+	void QueueHandler::_fork(const uint64_t * rec, Analyzer & an) {
+		using namespace ipc::event;
+		const auto child = header_thread(rec[0]);
+		// FORK is broadcast to all workers, each creates its own tsan thread
+		void* thr = __tsan_create_thread(tsan_tid(child, an));
+		logger->trace("Fork child {}@{}", child, thr);
+		auto & ts = an.tids[child];
+		ts.thr = thr;
+		ts.stacksize = 0;
 	}
 }
\ No newline at end of file
@@ -32,6 +32,7 @@
 #include <thread>
 #include <chrono>
 #include <memory>
+#include <algorithm>
 
 std::shared_ptr<spdlog::logger> logger;
 std::unique_ptr<msr::ProtocolHandler> phandler;
@@ -78,8 +79,16 @@ int main(int argc, char** argv) {
 
 	int loglevel = 1;
 	bool display_help = false;
+	unsigned num_queues = ipc::QueueMetadata::default_queues;
+	unsigned num_consumers = 2;
+	unsigned num_workers = 0;
 	auto cli = (
 		clipp::repeatable(clipp::option("-v", "--verbose")(clipp::increment(loglevel))) % "verbose, use multiple times to increase log-level (e.g. -v -v)",
+#ifdef EXTSAN
+		(clipp::option("--queues") & clipp::value("n", num_queues)) % ("number of per-thread event rings (default: " + std::to_string(num_queues) + ")"),
+		(clipp::option("--consumers") & clipp::value("n", num_consumers)) % ("number of event consumer threads (default: " + std::to_string(num_consumers) + ")"),
+		(clipp::option("--workers") & clipp::value("n", num_workers)) % "number of address-sharded analysis workers (default: 0, consumers analyze directly)",
+#endif
 		(clipp::option("--version")([]() {
 		std::cout << "Managed Symbol Resolver (MSR)\n" 
 			      << "Version: " << DRACE_BUILD_VERSION << "\n"
@@ -139,8 +148,13 @@ int main(int argc, char** argv) {
 
 #ifdef EXTSAN
 		// Event message queue
-		auto shm_queue = std::make_shared<ipc::SharedMemory<ipc::QueueMetadata, false>>("drace-events", true);
-		qhandler = std::make_shared<QueueHandler>(*(shm_queue->get()));
+		const unsigned max_queues = ipc::QueueMetadata::max_queues;
+		num_queues = std::max(2u, std::min(num_queues, max_queues));
+		num_consumers = std::max(1u, std::min(num_consumers, num_queues));
+		auto shm_queue = std::make_shared<ipc::SharedMemory<ipc::QueueMetadata, false>>(
+			"drace-events", true, ipc::QueueMetadata::arena_size(num_queues));
+		shm_queue->get()->init(num_queues);
+		qhandler = std::make_shared<QueueHandler>(shm_queue, num_consumers, num_workers);
 		q_fut = std::async(std::launch::async, [=]() {qhandler->start(); });
 		qm_fut = std::async(std::launch::async, [=]() {qhandler->monitor(); });
 #endif
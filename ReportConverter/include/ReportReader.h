@@ -0,0 +1,81 @@
+#pragma once
+/*
+ * DRace, a dynamic data race detector
+ *
+ * Copyright 2018 Siemens AG
+ *
+ * Authors:
+ *   Felix Moessbauer <felix.moessbauer@siemens.com>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "SymbolResolver.h"
+
+#include <report/BinaryFormat.h>
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <functional>
+
+namespace report {
+	/** A memory access with resolved stack */
+	struct Access {
+		AccessRecord       raw;
+		/// innermost frame first
+		std::vector<Frame> stack;
+	};
+
+	struct Race {
+		/// time to race in ms
+		uint64_t time;
+		Access   first;
+		Access   second;
+	};
+
+	/**
+	* Reads a binary race report and resolves the stacks
+	* of all races using the module snapshots in the report
+	*/
+	class ReportReader {
+	public:
+		using RaceCallback = std::function<void(const Race &)>;
+
+	private:
+		std::ifstream    _file;
+		SymbolResolver & _resolver;
+		FileHeader       _header;
+		/// size of the report in bytes
+		std::streamoff   _file_size{ 0 };
+		/// 0 if the report is incomplete
+		uint64_t         _stop_time{ 0 };
+
+		template<typename Record>
+		bool read_record(Record & rec);
+
+		/** Number of bytes behind the current read position */
+		std::streamoff remaining();
+
+		void resolve_access(const AccessRecord & raw, Access & access);
+
+	public:
+		/** Opens the report and validates the header, throws on error */
+		ReportReader(const std::string & filename, SymbolResolver & resolver);
+
+		const FileHeader & header() const {
+			return _header;
+		}
+
+		/** End time of the application or 0 if the report is not complete */
+		uint64_t stop_time() const {
+			return _stop_time;
+		}
+
+		/**
+		* Reads all records and invokes the callback for each race.
+		* Returns the number of races
+		*/
+		size_t process(const RaceCallback & clb);
+	};
+} // namespace report
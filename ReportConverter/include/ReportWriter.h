@@ -0,0 +1,83 @@
+#pragma once
+/*
+ * DRace, a dynamic data race detector
+ *
+ * Copyright 2018 Siemens AG
+ *
+ * Authors:
+ *   Felix Moessbauer <felix.moessbauer@siemens.com>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "ReportReader.h"
+
+#include <report/JsonLines.h>
+
+#include <ostream>
+#include <string>
+
+#ifdef XML_EXPORTER
+#include <tinyxml2.h>
+#endif
+
+namespace report {
+	/** Interface of an output format of drace-report */
+	class ReportWriter {
+	public:
+		virtual ~ReportWriter() = default;
+
+		virtual void begin(const FileHeader & header) { }
+		virtual void race(const Race & race) = 0;
+		/** \param stop_time end of application in ms since epoch (0 if unknown) */
+		virtual void end(uint64_t stop_time) { }
+	};
+
+	/** Human readable output, equivalent to the drace text sink */
+	class TextWriter : public ReportWriter {
+		std::ostream & _stream;
+
+		void print_frame(const Frame & f) const;
+
+	public:
+		explicit TextWriter(std::ostream & stream)
+			: _stream(stream) { }
+
+		void race(const Race & race) override;
+	};
+
+	/** JSON Lines output, one object per race (see report/JsonLines.h) */
+	class JsonWriter : public ReportWriter {
+		std::ostream &          _stream;
+		report::JsonLinesWriter _writer;
+
+		void print_access(const Access & ac);
+
+	public:
+		explicit JsonWriter(std::ostream & stream)
+			: _stream(stream) { }
+
+		void race(const Race & race) override;
+	};
+
+#ifdef XML_EXPORTER
+	/** Valgrind valkyrie compatible xml output */
+	class ValkyrieWriter : public ReportWriter {
+		std::ostream &        _stream;
+		tinyxml2::XMLPrinter  _printer;
+		uint64_t              _start_time{ 0 };
+		unsigned              _num_races{ 0 };
+
+		void print_stack(const std::vector<Frame> & stack);
+		void print_access(const Access & ac, const char * text);
+
+	public:
+		explicit ValkyrieWriter(std::ostream & stream)
+			: _stream(stream), _printer(0, true) { }
+
+		void begin(const FileHeader & header) override;
+		void race(const Race & race) override;
+		void end(uint64_t stop_time) override;
+	};
+#endif
+} // namespace report
@@ -0,0 +1,62 @@
+#pragma once
+/*
+ * DRace, a dynamic data race detector
+ *
+ * Copyright 2018 Siemens AG
+ *
+ * Authors:
+ *   Felix Moessbauer <felix.moessbauer@siemens.com>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <report/BinaryFormat.h>
+
+#include <string>
+#include <vector>
+#include <map>
+
+namespace report {
+	/** A resolved stack frame */
+	struct Frame {
+		uint64_t    pc{ 0 };
+		uint64_t    mod_base{ 0 };
+		uint64_t    mod_end{ 0 };
+		std::string mod_name;
+		std::string sym_name;
+		std::string file;
+		unsigned    line{ 0 };
+		unsigned    line_offs{ 0 };
+	};
+
+	/**
+	* Offline symbol resolver based on DbgHelp.
+	* The modules of the current snapshot are loaded lazily on first access.
+	*/
+	class SymbolResolver {
+		/// DbgHelp requires a unique handle, but not a real process
+		void *                          _handle;
+		std::vector<ModuleRecord>       _modules;
+		/// base -> path of modules loaded into DbgHelp
+		std::map<uint64_t, std::string> _loaded;
+
+		const ModuleRecord * find_module(uint64_t pc) const;
+		bool load_module(const ModuleRecord & mod);
+
+	public:
+		/**
+		* \param search_path symbol search path passed to DbgHelp
+		*        (if empty, the default search path is used)
+		*/
+		explicit SymbolResolver(const std::string & search_path);
+		~SymbolResolver();
+
+		SymbolResolver(const SymbolResolver &) = delete;
+		SymbolResolver & operator=(const SymbolResolver &) = delete;
+
+		/** Replace the current module map */
+		void set_modules(std::vector<ModuleRecord> && modules);
+
+		Frame resolve(uint64_t pc);
+	};
+} // namespace report
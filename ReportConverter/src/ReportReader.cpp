@@ -0,0 +1,111 @@
+/*
+ * DRace, a dynamic data race detector
+ *
+ * Copyright 2018 Siemens AG
+ *
+ * Authors:
+ *   Felix Moessbauer <felix.moessbauer@siemens.com>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "ReportReader.h"
+
+#include <stdexcept>
+
+namespace report {
+
+	ReportReader::ReportReader(const std::string & filename, SymbolResolver & resolver)
+		: _file(filename, std::ifstream::in | std::ifstream::binary),
+		_resolver(resolver)
+	{
+		if (!_file.good()) {
+			throw std::runtime_error("cannot open report " + filename);
+		}
+		_file.seekg(0, std::ifstream::end);
+		_file_size = _file.tellg();
+		_file.seekg(0, std::ifstream::beg);
+		if (!read_record(_header) || _header.magic != report::magic) {
+			throw std::runtime_error("not a drace binary report");
+		}
+		if (_header.version != format_version) {
+			throw std::runtime_error("unsupported report version " + std::to_string(_header.version));
+		}
+	}
+
+	template<typename Record>
+	bool ReportReader::read_record(Record & rec) {
+		_file.read(reinterpret_cast<char*>(&rec), sizeof(Record));
+		return _file.gcount() == sizeof(Record);
+	}
+
+	std::streamoff ReportReader::remaining() {
+		return _file_size - static_cast<std::streamoff>(_file.tellg());
+	}
+
+	void ReportReader::resolve_access(const AccessRecord & raw, Access & access) {
+		access.raw = raw;
+		access.stack.clear();
+		unsigned ssize = std::min<unsigned>(raw.stack_size, max_stack_size);
+		// stack is stored caller first
+		for (unsigned i = 0; i < ssize; ++i) {
+			access.stack.emplace_back(_resolver.resolve(raw.stack_trace[ssize - 1 - i]));
+		}
+	}
+
+	size_t ReportReader::process(const RaceCallback & clb) {
+		size_t num_races = 0;
+		Race race;
+
+		while (_file.good()) {
+			RecordType type;
+			// peek type of next record
+			std::streampos pos = _file.tellg();
+			if (!read_record(type))
+				break;
+			_file.seekg(pos);
+
+			switch (type) {
+			case RecordType::RACE:
+			{
+				RaceRecord rec;
+				if (!read_record(rec))
+					return num_races;
+				race.time = rec.time;
+				resolve_access(rec.first, race.first);
+				resolve_access(rec.second, race.second);
+				clb(race);
+				++num_races;
+				break;
+			}
+			case RecordType::SNAPSHOT:
+			{
+				SnapshotRecord snap;
+				if (!read_record(snap))
+					return num_races;
+				// the count is not trusted, as the file might be truncated or corrupted
+				if (snap.num_modules > remaining() / static_cast<std::streamoff>(sizeof(ModuleRecord)))
+					return num_races;
+				std::vector<ModuleRecord> modules(snap.num_modules);
+				for (auto & mod : modules) {
+					if (!read_record(mod))
+						return num_races;
+				}
+				_resolver.set_modules(std::move(modules));
+				break;
+			}
+			case RecordType::END:
+			{
+				EndRecord rec;
+				if (read_record(rec))
+					_stop_time = rec.stop_time;
+				return num_races;
+			}
+			default:
+				// truncated or corrupted file, keep what we have
+				return num_races;
+			}
+		}
+		return num_races;
+	}
+} // namespace report
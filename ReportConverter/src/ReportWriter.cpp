@@ -0,0 +1,215 @@
+/*
+ * DRace, a dynamic data race detector
+ *
+ * Copyright 2018 Siemens AG
+ *
+ * Authors:
+ *   Felix Moessbauer <felix.moessbauer@siemens.com>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "ReportWriter.h"
+
+#include <iomanip>
+#include <sstream>
+#include <chrono>
+#include <ctime>
+
+namespace report {
+
+	namespace {
+		std::string to_hex(uint64_t val) {
+			std::stringstream ss;
+			ss << "0x" << std::hex << val;
+			return ss.str();
+		}
+
+		/** Converts ms since epoch to an ISO 8601 timestamp */
+		std::string to_iso_time(uint64_t ms) {
+			std::time_t t = static_cast<std::time_t>(ms / 1000);
+			std::tm tm;
+			gmtime_s(&tm, &t);
+			char buffer[32];
+			std::strftime(buffer, sizeof(buffer), "%Y-%m-%dT%H:%M:%S", &tm);
+			std::stringstream ss;
+			ss << buffer << "." << std::setw(3) << std::setfill('0') << (ms % 1000) << "Z";
+			return ss.str();
+		}
+	} // namespace
+
+	void TextWriter::print_frame(const Frame & f) const {
+		auto & s = _stream;
+		s << "PC " << std::hex << (void*)f.pc;
+		if (f.mod_base != 0) {
+			s << " (rel: " << (void*)(f.pc - f.mod_base) << ")";
+		}
+		else {
+			s << " (dynamic code)";
+		}
+		if (f.mod_name != "") {
+			s << "\n\tModule " << f.mod_name;
+			if (f.sym_name != "") {
+				s << " - " << f.sym_name << "\n";
+			}
+			if (f.mod_base != f.mod_end) {
+				s << "\tfrom " << (void*)f.mod_base
+					<< " to " << (void*)f.mod_end;
+			}
+			if (f.file != "") {
+				s << "\n\tFile " << f.file << ":" << std::dec
+					<< f.line << " + " << f.line_offs;
+			}
+		}
+	}
+
+	void TextWriter::race(const Race & race) {
+		std::stringstream ss;
+		ss << "----- DATA Race at " << std::dec << race.time << "ms runtime -----";
+		std::string header = ss.str();
+		auto & s = _stream;
+		s << header << std::endl;
+		for (int i = 0; i != 2; ++i) {
+			const Access & ac = (i == 0) ? race.first : race.second;
+			const AccessRecord & r = ac.raw;
+
+			s << "Access " << i << " tid: " << std::dec << r.thread_id << " ";
+			s << (r.write ? "write" : "read") << " to/from " << (void*)r.accessed_memory
+				<< " with size " << r.access_size << ". Stack(Size " << r.stack_size << ")"
+				<< "Type: " << std::dec << r.access_type << " :" << std::endl;
+			if (r.onheap) {
+				s << "Block begin at " << std::hex << r.heap_block_begin << ", size " << std::dec << r.heap_block_size << std::endl;
+			}
+			else {
+				s << "Block not on heap (anymore)" << std::endl;
+			}
+			for (unsigned p = 0; p < ac.stack.size(); ++p) {
+				s << "#" << std::dec << p << " ";
+				print_frame(ac.stack[p]);
+				s << std::endl;
+			}
+		}
+		s << std::string(header.length(), '-') << std::endl;
+	}
+
+	void JsonWriter::print_access(const Access & ac) {
+		_writer.begin_access(ac.raw);
+		for (const Frame & f : ac.stack) {
+			_writer.frame(f);
+		}
+		_writer.end_access();
+	}
+
+	void JsonWriter::race(const Race & race) {
+		_writer.begin_race(race.time);
+		print_access(race.first);
+		print_access(race.second);
+		_writer.end_race();
+		_stream.write(_writer.data(), _writer.size());
+		_stream.flush();
+	}
+
+#ifdef XML_EXPORTER
+	void ValkyrieWriter::begin(const FileHeader & header) {
+		auto & p = _printer;
+		_start_time = header.start_time;
+
+		p.PushHeader(false, true);
+		p.OpenElement("valgrindoutput");
+		p.OpenElement("protocolversion"); p.PushText(4); p.CloseElement();
+		p.OpenElement("protocoltool");	p.PushText("helgrind");	p.CloseElement();
+
+		p.OpenElement("preamble");
+		p.OpenElement("line"); p.PushText("Drace, a thread error detector"); p.CloseElement();
+		p.CloseElement();
+
+		p.OpenElement("pid"); p.PushText(header.pid); p.CloseElement();
+		p.OpenElement("tool"); p.PushText("drace"); p.CloseElement();
+
+		p.OpenElement("args");
+		p.OpenElement("argv");
+		p.OpenElement("exe"); p.PushText(header.app); p.CloseElement();
+		p.CloseElement();
+		p.CloseElement();
+
+		p.OpenElement("status");
+		p.OpenElement("state"); p.PushText("RUNNING"); p.CloseElement();
+		p.OpenElement("time"); p.PushText(to_iso_time(header.start_time).c_str()); p.CloseElement();
+		p.CloseElement();
+	}
+
+	void ValkyrieWriter::print_stack(const std::vector<Frame> & stack) {
+		auto & p = _printer;
+		p.OpenElement("stack");
+		for (const auto & f : stack) {
+			p.OpenElement("frame");
+			p.OpenElement("ip"); p.PushText(to_hex(f.pc).c_str()); p.CloseElement();
+			p.OpenElement("obj"); p.PushText(f.mod_name.c_str()); p.CloseElement();
+			if (!f.sym_name.empty()) {
+				p.OpenElement("fn"); p.PushText(f.sym_name.c_str()); p.CloseElement();
+			}
+			if (!f.file.empty()) {
+				auto sep = f.file.find_last_of("/\\");
+				std::string dir = (sep == std::string::npos) ? "" : f.file.substr(0, sep);
+				p.OpenElement("dir"); p.PushText(dir.c_str()); p.CloseElement();
+				p.OpenElement("file"); p.PushText(f.file.substr(sep + 1).c_str()); p.CloseElement();
+			}
+			if (f.line) {
+				p.OpenElement("line"); p.PushText(f.line); p.CloseElement();
+			}
+			p.CloseElement();
+		}
+		p.CloseElement();
+	}
+
+	void ValkyrieWriter::print_access(const Access & ac, const char * text) {
+		auto & p = _printer;
+		const AccessRecord & r = ac.raw;
+		p.OpenElement("xwhat");
+		p.OpenElement("text");
+		std::stringstream ss;
+		ss << text << (r.write ? "write" : "read") << " of size "
+			<< r.access_size << " at 0x" << std::hex << r.accessed_memory
+			<< " by thread #" << std::dec << r.thread_id;
+		p.PushText(ss.str().c_str());
+		p.CloseElement();
+		p.OpenElement("hthreadid"); p.PushText(r.thread_id); p.CloseElement();
+		p.CloseElement();
+		print_stack(ac.stack);
+	}
+
+	void ValkyrieWriter::race(const Race & race) {
+		auto & p = _printer;
+		p.OpenElement("error");
+		p.OpenElement("unique"); p.PushText(to_hex(_num_races++).c_str()); p.CloseElement();
+		p.OpenElement("tid"); p.PushText(race.second.raw.thread_id); p.CloseElement();
+		p.OpenElement("threadname"); p.PushText("Thread"); p.CloseElement();
+		p.OpenElement("kind"); p.PushText("Race"); p.CloseElement();
+		print_access(race.second, "Possible data race during ");
+		print_access(race.first, "This conflicts with a previous ");
+		p.CloseElement();
+
+		// Flush buffer to reduce memory usage
+		_stream << p.CStr() << std::endl;
+		p.ClearBuffer();
+	}
+
+	void ValkyrieWriter::end(uint64_t stop_time) {
+		auto & p = _printer;
+		// incomplete reports are marked as still running
+		p.OpenElement("status");
+		p.OpenElement("state"); p.PushText(stop_time ? "FINISHED" : "RUNNING"); p.CloseElement();
+		if (stop_time) {
+			p.OpenElement("time"); p.PushText(to_iso_time(stop_time).c_str()); p.CloseElement();
+			p.OpenElement("duration"); p.PushAttribute("unit", "ms");
+			p.PushText(static_cast<int64_t>(stop_time - _start_time));
+			p.CloseElement();
+		}
+		p.CloseElement(); // status
+		p.CloseElement(); // valgrindoutput
+
+		_stream << p.CStr();
+		p.ClearBuffer();
+	}
+#endif
+} // namespace report
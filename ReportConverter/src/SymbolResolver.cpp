@@ -0,0 +1,116 @@
+/*
+ * DRace, a dynamic data race detector
+ *
+ * Copyright 2018 Siemens AG
+ *
+ * Authors:
+ *   Felix Moessbauer <felix.moessbauer@siemens.com>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "SymbolResolver.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+#include <Windows.h>
+#include <DbgHelp.h>
+
+#undef min
+#undef max
+
+namespace report {
+
+	SymbolResolver::SymbolResolver(const std::string & search_path)
+		// any unique value is accepted if the process is not invaded
+		: _handle(reinterpret_cast<void*>(0xD4ACE))
+	{
+		SymSetOptions(SYMOPT_UNDNAME | SYMOPT_LOAD_LINES | SYMOPT_FAIL_CRITICAL_ERRORS);
+		if (!SymInitialize(_handle, search_path.empty() ? NULL : search_path.c_str(), FALSE)) {
+			throw std::runtime_error("could not initialize DbgHelp");
+		}
+	}
+
+	SymbolResolver::~SymbolResolver() {
+		SymCleanup(_handle);
+	}
+
+	void SymbolResolver::set_modules(std::vector<ModuleRecord> && modules) {
+		std::sort(modules.begin(), modules.end(),
+			[](const ModuleRecord & a, const ModuleRecord & b) { return a.base < b.base; });
+
+		// unload all modules which are not part of the new map
+		for (auto it = _loaded.begin(); it != _loaded.end();) {
+			auto mod = std::find_if(modules.begin(), modules.end(), [&](const ModuleRecord & m) {
+				return m.base == it->first && it->second == m.path;
+			});
+			if (mod == modules.end()) {
+				SymUnloadModule64(_handle, it->first);
+				it = _loaded.erase(it);
+			}
+			else {
+				++it;
+			}
+		}
+		_modules = std::move(modules);
+	}
+
+	const ModuleRecord * SymbolResolver::find_module(uint64_t pc) const {
+		auto it = std::upper_bound(_modules.begin(), _modules.end(), pc,
+			[](uint64_t val, const ModuleRecord & m) { return val < m.base; });
+		if (it == _modules.begin())
+			return nullptr;
+		--it;
+		return (pc < it->end) ? &(*it) : nullptr;
+	}
+
+	bool SymbolResolver::load_module(const ModuleRecord & mod) {
+		if (_loaded.find(mod.base) != _loaded.end())
+			return true;
+		DWORD64 base = SymLoadModuleEx(_handle, NULL, mod.path, NULL,
+			mod.base, static_cast<DWORD>(mod.end - mod.base), NULL, 0);
+		if (base == 0 && GetLastError() != ERROR_SUCCESS)
+			return false;
+		_loaded.emplace(mod.base, mod.path);
+		return true;
+	}
+
+	Frame SymbolResolver::resolve(uint64_t pc) {
+		Frame frame;
+		frame.pc = pc;
+
+		const ModuleRecord * mod = find_module(pc);
+		if (mod == nullptr) {
+			// dynamic code
+			return frame;
+		}
+		frame.mod_base = mod->base;
+		frame.mod_end = mod->end;
+		std::string path(mod->path);
+		frame.mod_name = path.substr(path.find_last_of("/\\") + 1);
+
+		if (!load_module(*mod))
+			return frame;
+
+		ULONG64 buffer[(sizeof(SYMBOL_INFO) + MAX_SYM_NAME * sizeof(TCHAR) + sizeof(ULONG64) - 1) / sizeof(ULONG64)];
+		PSYMBOL_INFO syminfo = reinterpret_cast<PSYMBOL_INFO>(buffer);
+		syminfo->SizeOfStruct = sizeof(SYMBOL_INFO);
+		syminfo->MaxNameLen = MAX_SYM_NAME;
+
+		DWORD64 sym_displacement = 0;
+		if (SymFromAddr(_handle, pc, &sym_displacement, syminfo)) {
+			frame.sym_name = syminfo->Name;
+		}
+
+		IMAGEHLP_LINE64 line;
+		line.SizeOfStruct = sizeof(IMAGEHLP_LINE64);
+		DWORD line_displacement = 0;
+		if (SymGetLineFromAddr64(_handle, pc, &line_displacement, &line)) {
+			frame.file = line.FileName;
+			frame.line = line.LineNumber;
+			frame.line_offs = line_displacement;
+		}
+		return frame;
+	}
+} // namespace report
@@ -0,0 +1,101 @@
+/*
+ * DRace, a dynamic data race detector
+ *
+ * Copyright 2018 Siemens AG
+ *
+ * Authors:
+ *   Felix Moessbauer <felix.moessbauer@siemens.com>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+/**
+\brief Offline converter for binary DRace race reports (drace-report)
+*/
+
+#include "ReportReader.h"
+#include "ReportWriter.h"
+#include "SymbolResolver.h"
+#include "version/version.h"
+
+#include "clipp.h"
+
+#include <iostream>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+
+int main(int argc, char** argv) {
+	using namespace report;
+
+	std::string in_file;
+	std::string out_file;
+	std::string format = "text";
+	std::string sympath;
+	bool display_help = false;
+
+	auto cli = (
+		clipp::value("report", in_file) % "binary race report generated by drace (--bin-file)",
+		(clipp::option("-o", "--out") & clipp::value("filename", out_file)) % "write to this file (default: stdout)",
+		(clipp::option("-f", "--format") & (clipp::required("text").set(format, std::string("text"))
+			| clipp::required("json").set(format, std::string("json"))
+#ifdef XML_EXPORTER
+			| clipp::required("xml").set(format, std::string("xml"))
+#endif
+			)) % "output format (default: text)",
+		(clipp::option("-s", "--sympath") & clipp::value("path", sympath)) % "symbol search path (default: _NT_SYMBOL_PATH)",
+		(clipp::option("--version")([]() {
+		std::cout << "DRace Report Converter\n"
+			<< "Version: " << DRACE_BUILD_VERSION << "\n"
+			<< "Hash:    " << DRACE_BUILD_HASH << std::endl;
+		std::exit(0); })) % "display version information",
+		clipp::option("-h", "--usage").set(display_help)
+	);
+
+	if (!clipp::parse(argc, argv, cli) || display_help) {
+		std::cout << clipp::make_man_page(cli, "drace-report.exe") << std::endl;
+		std::exit(display_help ? 0 : 1);
+	}
+
+	try {
+		std::ofstream out_stream;
+		if (out_file != "") {
+			out_stream.open(out_file, std::ofstream::out);
+			if (!out_stream.good()) {
+				throw std::runtime_error("cannot open " + out_file);
+			}
+		}
+		std::ostream & out = (out_file != "") ? out_stream : std::cout;
+
+		std::unique_ptr<ReportWriter> writer;
+		if (format == "json") {
+			writer = std::make_unique<JsonWriter>(out);
+		}
+#ifdef XML_EXPORTER
+		else if (format == "xml") {
+			writer = std::make_unique<ValkyrieWriter>(out);
+		}
+#endif
+		else {
+			writer = std::make_unique<TextWriter>(out);
+		}
+
+		SymbolResolver resolver(sympath);
+		ReportReader reader(in_file, resolver);
+
+		writer->begin(reader.header());
+		size_t num_races = reader.process([&](const Race & r) { writer->race(r); });
+		writer->end(reader.stop_time());
+
+		std::cerr << "Converted " << num_races << " races";
+		if (reader.stop_time() == 0) {
+			std::cerr << " (report is incomplete)";
+		}
+		std::cerr << std::endl;
+	}
+	catch (const std::runtime_error & e) {
+		std::cerr << "Error: " << e.what() << std::endl;
+		return 1;
+	}
+	return 0;
+}
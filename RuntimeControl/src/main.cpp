@@ -0,0 +1,169 @@
+/*
+ * DRace, a dynamic data race detector
+ *
+ * Copyright 2018 Siemens AG
+ *
+ * Authors:
+ *   Felix Moessbauer <felix.moessbauer@siemens.com>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+/**
+\brief Runtime control of a running DRace instance (drace-ctl)
+
+Attaches to the control block which is provided by the MSR
+and changes the settings of DRace without restarting the application.
+*/
+
+#include "ipc/SharedMemory.h"
+#include "ipc/SMData.h"
+#include "version/version.h"
+
+#include "clipp.h"
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+
+using ControlBlock = ipc::ClientCB;
+
+/** Print the current settings of the control block */
+static void print_state(const ControlBlock & cb) {
+	std::cout << "generation:     " << cb.generation.load() << "\n"
+		<< "detector:       " << (cb.enabled.load() ? "ON" : "OFF") << "\n"
+		<< "sampling-rate:  " << cb.sampling_rate.load() << "\n"
+		<< "instr-rate:     " << cb.instr_rate.load() << "\n"
+		<< "dedup:          " << (cb.dedup.load() ? "ON" : "OFF") << "\n"
+		<< "off-modules:   ";
+	ControlBlock::ModuleEntry::name_t buf;
+	for (const auto & mod : cb.disabled_modules) {
+		if (mod.read(buf))
+			std::cout << " " << buf.data();
+	}
+	std::cout << "\n" << "off-threads:   ";
+	for (const auto & tid : cb.disabled_threads) {
+		if (tid.load() != 0)
+			std::cout << " " << tid.load();
+	}
+	std::cout << std::endl;
+}
+
+/** Changes a module entry, the DRace client only sees completely written names */
+static void set_module(ControlBlock & cb, const std::string & name, bool disabled) {
+	using entry_t = ControlBlock::ModuleEntry;
+	auto & mods = cb.disabled_modules;
+	entry_t::name_t buf;
+	auto it = std::find_if(mods.begin(), mods.end(), [&](const entry_t & m) {
+		return m.read(buf) && name == buf.data(); });
+	if (!disabled) {
+		if (it != mods.end())
+			it->write("", 0);
+		return;
+	}
+	if (it != mods.end())
+		return;
+	it = std::find_if(mods.begin(), mods.end(), [&](const entry_t & m) { return !m.read(buf); });
+	if (it == mods.end() || name.size() >= buf.size())
+		throw std::runtime_error("cannot disable module " + name);
+	it->write(name.data(), name.size());
+}
+
+static void set_thread(ControlBlock & cb, uint32_t tid, bool disabled) {
+	if (!disabled) {
+		for (auto & t : cb.disabled_threads) {
+			uint32_t expected = tid;
+			t.compare_exchange_strong(expected, 0);
+		}
+		return;
+	}
+	if (cb.thread_disabled(tid))
+		return;
+	for (auto & t : cb.disabled_threads) {
+		uint32_t expected = 0;
+		if (t.compare_exchange_strong(expected, tid))
+			return;
+	}
+	throw std::runtime_error("cannot disable thread " + std::to_string(tid));
+}
+
+int main(int argc, char** argv) {
+	bool enable = false;
+	bool disable = false;
+	bool flush = false;
+	bool display_help = false;
+	int sampling_rate = -1;
+	int instr_rate = -1;
+	std::string dedup;
+	std::vector<std::string> mods_off, mods_on;
+	std::vector<uint32_t> threads_off, threads_on;
+
+	auto cli = (
+		clipp::option("-e", "--enable").set(enable) % "enable detector on all threads",
+		clipp::option("-d", "--disable").set(disable) % "disable detector on all threads",
+		(clipp::option("-s", "--sample-rate") & clipp::integer("rate", sampling_rate)) % "sample each nth instruction",
+		(clipp::option("-i", "--instr-rate") & clipp::integer("rate", instr_rate)) % "instrument each nth instruction (re-instruments all code)",
+		(clipp::option("--dedup") & (clipp::required("on").set(dedup, std::string("on"))
+			| clipp::required("off").set(dedup, std::string("off")))) % "report each pair of racing instructions only once",
+		clipp::repeatable(clipp::option("--module-off") & clipp::value("name", mods_off)) % "do not instrument memory accesses in this module",
+		clipp::repeatable(clipp::option("--module-on") & clipp::value("name", mods_on)) % "instrument memory accesses in this module again",
+		clipp::repeatable(clipp::option("--thread-off") & clipp::integer("tid", threads_off)) % "disable detector on this thread",
+		clipp::repeatable(clipp::option("--thread-on") & clipp::integer("tid", threads_on)) % "enable detector on this thread again",
+		clipp::option("-f", "--flush").set(flush) % "analyze buffered accesses of all threads",
+		(clipp::option("--version")([]() {
+		std::cout << "DRace Runtime Control\n"
+			<< "Version: " << DRACE_BUILD_VERSION << "\n"
+			<< "Hash:    " << DRACE_BUILD_HASH << std::endl;
+		std::exit(0); })) % "display version information",
+		clipp::option("-h", "--usage").set(display_help)
+	);
+
+	if (!clipp::parse(argc, argv, cli) || display_help || (enable && disable)) {
+		std::cout << clipp::make_man_page(cli, "drace-ctl.exe") << std::endl
+			<< "Without options, the current settings are printed." << std::endl;
+		std::exit(display_help ? 0 : 1);
+	}
+
+	try {
+		// the control block is created by the MSR
+		ipc::SharedMemory<ControlBlock, false> shm(DRACE_SMR_CB_NAME, false);
+		ControlBlock & cb = *shm.get();
+		if (cb.version != ControlBlock::current_version) {
+			throw std::runtime_error("control block has version " + std::to_string(cb.version)
+				+ ", expected " + std::to_string(ControlBlock::current_version));
+		}
+
+		if (enable || disable)
+			cb.enabled.store(enable, std::memory_order_relaxed);
+		if (sampling_rate > 0)
+			cb.sampling_rate.store(sampling_rate, std::memory_order_relaxed);
+		if (instr_rate > 0)
+			cb.instr_rate.store(instr_rate, std::memory_order_relaxed);
+		if (dedup != "")
+			cb.dedup.store(dedup == "on", std::memory_order_relaxed);
+		for (const auto & mod : mods_off)
+			set_module(cb, mod, true);
+		for (const auto & mod : mods_on)
+			set_module(cb, mod, false);
+		for (auto tid : threads_off)
+			set_thread(cb, tid, true);
+		for (auto tid : threads_on)
+			set_thread(cb, tid, false);
+		if (flush)
+			cb.flush_seq.fetch_add(1, std::memory_order_relaxed);
+
+		// publish all changes at once, after all entries are complete
+		bool changed = enable || disable || sampling_rate > 0 || instr_rate > 0 || dedup != ""
+			|| !mods_off.empty() || !mods_on.empty() || !threads_off.empty() || !threads_on.empty() || flush;
+		if (changed)
+			cb.generation.fetch_add(1, std::memory_order_release);
+		print_state(cb);
+	}
+	catch (const std::runtime_error & e) {
+		std::cerr << "Error: " << e.what() << " (is the MSR running?)" << std::endl;
+		return 1;
+	}
+	return 0;
+}
@@ -10,6 +10,7 @@
  */
 
 #include "benchmark/benchmark.h"
+#include "flat-map.h"
 
 #include <unordered_map>
 #include <random>
@@ -83,6 +84,23 @@ static void LinearSearchMutexLoad(benchmark::State& state) {
 	delete[] buf;
 }
 
+/* Container which is used in the drace client (SIMD search, heap fallback above 16 mutexes) */
+static void FlatMapMutexLoad(benchmark::State& state) {
+	drace::FlatMap<uint64_t, int, 16> map;
+	std::uniform_int_distribution<uint64_t> dist(0, state.range(0));
+
+	for (auto _ : state) {
+		auto key = generate_key(dist);
+		map[key]++;
+
+		if (dropout(prng) > 0.6) {
+			map.erase(key);
+		}
+	}
+	state.counters["size"] = map.size();
+}
+
 // Register the function as a benchmark
 BENCHMARK(StdUMapMutexLoad)->RangeMultiplier(2)->Range(1, 1024);
 BENCHMARK(LinearSearchMutexLoad)->RangeMultiplier(2)->Range(1, 1024);
+BENCHMARK(FlatMapMutexLoad)->RangeMultiplier(2)->Range(1, 1024);
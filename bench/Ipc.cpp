@@ -0,0 +1,45 @@
+/*
+ * DRace, a dynamic data race detector
+ *
+ * Copyright 2018 Siemens AG
+ *
+ * Authors:
+ *   Felix Moessbauer <felix.moessbauer@siemens.com>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "benchmark/benchmark.h"
+#include "ipc/SharedMemory.h"
+
+#include <thread>
+#include <atomic>
+
+/* This benchmark measures the round-trip latency of a notification
+*  between both units of a shared memory segment (e.g. DRace and the MSR).
+*  The second unit runs on its own thread and echoes each notification.
+*/
+
+static void ShmNotifyRoundTrip(benchmark::State& state) {
+	ipc::SharedMemory<uint64_t> creator("drace-bench-shm", true);
+	ipc::SharedMemory<uint64_t> attached("drace-bench-shm", false);
+	std::atomic<bool> stop{ false };
+
+	std::thread echo([&]() {
+		while (!stop.load(std::memory_order_relaxed)) {
+			if (attached.wait())
+				attached.notify();
+		}
+	});
+
+	for (auto _ : state) {
+		creator.notify();
+		while (!creator.wait()) { }
+	}
+
+	stop.store(true, std::memory_order_relaxed);
+	// wake up the echo thread
+	creator.notify();
+	echo.join();
+}
+BENCHMARK(ShmNotifyRoundTrip)->UseRealTime();
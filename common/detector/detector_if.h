@@ -127,6 +127,38 @@ namespace detector {
 		void* addr
 	);
 
+	/**
+	* Log that the calling thread accessed a memory range whose accesses are
+	* not passed to the detector individually (e.g. thread-private pages).
+	* As the owner calls this itself, its accesses are attributed to its current clock.
+	*/
+	void own_range(
+		/// ptr to thread-local storage of calling thread
+		tls_t  tls,
+		/// instruction pointer of the first summarized access
+		void*  pc,
+		/// begin of memory range
+		void*  addr,
+		/// size of memory range
+		size_t size
+	);
+
+	/**
+	* Transfer a memory range recorded by \ref own_range to the calling thread.
+	* A race is reported if the last \ref own_range of another thread
+	* does not happen before.
+	*/
+	void transfer_range(
+		/// ptr to thread-local storage of calling thread
+		tls_t  tls,
+		/// instruction pointer of the access which transfers the range
+		void*  pc,
+		/// begin of memory range
+		void*  addr,
+		/// size of memory range
+		size_t size
+	);
+
 	/** Log a thread-creation event */
 	void fork(
 		/// id of parent thread
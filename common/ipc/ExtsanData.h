@@ -14,6 +14,8 @@
 #undef max
 
 #include <array>
+#include <atomic>
+#include <new>
 
 #include "ringbuffer.hpp"
 
@@ -33,57 +35,146 @@ namespace ipc {
 			FINISH
 		};
 
-		struct MemAccess {
-			uint32_t thread_id;
-			uint32_t stacksize;
-			uint64_t addr;
-			std::array<uint64_t, 16> callstack;
-		};
+		/// maximum number of frames of a callstack
+		constexpr unsigned max_stack_size = 16;
+		/// maximum length of a record in words (memory access with full stack)
+		constexpr unsigned max_record_words = 2 + max_stack_size;
 
-		struct Mutex {
-			unsigned long thread_id;
-			uint64_t addr;
-			int recursive;
-			bool write;
-			bool acquire;
-		};
+		/**
+		* Events are encoded as variable-length records of 64 bit words.
+		* The first word is a header:
+		*
+		*   bits  0 -  7: type
+		*   bits  8 - 15: length of the record in words (including header)
+		*   bits 16 - 23: type specific flags
+		*   bits 24 - 31: access size (memory accesses)
+		*   bits 32 - 63: thread id
+		*
+		* Layout of the payload words:
+		*
+		*   MEMREAD, MEMWRITE: addr, frames...
+		*     Callstacks are delta encoded against the last stack sent
+		*     by the same thread: the flags hold the number of frames
+		*     (from the outermost) which are kept, followed by the new frames.
+		*   ACQUIRE, RELEASE:  addr, recursive, sync sequence number. flags: 1 = write
+		*     The sequence number orders the sync events of all threads,
+		*     see \ref QueueMetadata::sync_seq.
+		*   ALLOCATION:        pc, addr, size
+		*   FREE:              addr
+		*   FORK, JOIN:        parent thread id (thread id is the child)
+		*   DETACH, FINISH:    -
+		*/
+		constexpr uint64_t make_header(Type type, unsigned nwords, unsigned flags, unsigned size, uint32_t tid) {
+			return (uint64_t)type
+				| ((uint64_t)(nwords & 0xFF) << 8)
+				| ((uint64_t)(flags & 0xFF) << 16)
+				| ((uint64_t)(size & 0xFF) << 24)
+				| ((uint64_t)tid << 32);
+		}
 
-		struct Allocation {
-			unsigned long thread_id;
-			uint64_t pc;
-			uint64_t addr;
-			size_t size;
-		};
+		constexpr Type     header_type(uint64_t header) { return (Type)(header & 0xFF); }
+		constexpr unsigned header_words(uint64_t header) { return (unsigned)((header >> 8) & 0xFF); }
+		constexpr unsigned header_flags(uint64_t header) { return (unsigned)((header >> 16) & 0xFF); }
+		constexpr unsigned header_size(uint64_t header) { return (unsigned)((header >> 24) & 0xFF); }
+		constexpr uint32_t header_thread(uint64_t header) { return (uint32_t)(header >> 32); }
 
-		struct ForkJoin {
-			unsigned long parent;
-			unsigned long child;
-		};
+		/// flag of ACQUIRE and RELEASE records
+		constexpr unsigned mutex_write = 0x1;
+	}
 
-		struct DetachFinish {
-			unsigned long thread_id;
-		};
+	/**
+	* Single producer, single consumer ring of event words. Only the shared
+	* fallback ring is written by multiple producers (protected by its spinlock).
+	*/
+	using queue_t = ipc::Ringbuffer<uint64_t, 1 << 18, true, 64>;
 
-		struct BufferEntry {
-			Type type{ Type::NONE };
-			char buffer[sizeof(MemAccess)];
+	/**
+	* Header of the event arena. The rings are placed directly
+	* behind this header in the shared memory segment, hence the
+	* number of rings is chosen at runtime by the creator (MSR).
+	* Each application thread claims a private ring on fork and
+	* releases it on join. Ring 0 is shared by all threads which
+	* did not get a private ring.
+	*/
+	struct alignas(64) QueueMetadata {
+		enum class State : uint32_t {
+			FREE = 0,
+			ACTIVE,
+			/// producer detached, ring is freed by the consumer when drained
+			CLOSED
 		};
 
-		template<typename T, class... Args>
-		struct GenericEntry {
-			Type type{ Type::NONE };
-			T buffer;
-		
-			GenericEntry(Type t, Args&&... args)
-				: type(t), buffer(std::forward<Args>(args)...) { }
-		};
-	}
+		static constexpr unsigned shared_queue{ 0 };
+		static constexpr unsigned default_queues{ 64 };
+		static constexpr unsigned max_queues{ 1024 };
+
+		/// number of rings in the arena, 0 until the arena is initialized
+		std::atomic<unsigned> num_queues;
+		std::atomic<uint32_t> state[max_queues];
+
+		/// number of consumers which wait for the doorbell
+		std::atomic<uint32_t> parked;
+
+		/**
+		* Next sequence number of acquire and release records.
+		* As the rings are drained independently, a consumer applies these
+		* records in sequence order. Otherwise an acquire could be analyzed
+		* before the preceding release of the same mutex by another thread.
+		*/
+		std::atomic<uint64_t> sync_seq;
+
+		// overflow statistics, published by producers on join
+		std::atomic<uint64_t> dropped;
+		std::atomic<uint64_t> stalls;
+		std::atomic<uint64_t> spilled;
+
+		/** Size in bytes of the arena with the given number of rings */
+		static size_t arena_size(unsigned nqueues) {
+			return sizeof(QueueMetadata) + nqueues * sizeof(queue_t);
+		}
+
+		/** Constructs the rings in the arena, called by the creator */
+		void init(unsigned nqueues) {
+			for (unsigned i = 0; i < max_queues; ++i) {
+				state[i].store((uint32_t)State::FREE, std::memory_order_relaxed);
+			}
+			for (unsigned i = 0; i < nqueues; ++i) {
+				new (&queue(i)) queue_t;
+			}
+			state[shared_queue].store((uint32_t)State::ACTIVE, std::memory_order_relaxed);
+			parked.store(0, std::memory_order_relaxed);
+			sync_seq.store(0, std::memory_order_relaxed);
+			dropped.store(0, std::memory_order_relaxed);
+			stalls.store(0, std::memory_order_relaxed);
+			spilled.store(0, std::memory_order_relaxed);
+			num_queues.store(nqueues, std::memory_order_release);
+		}
+
+		inline queue_t & queue(unsigned id) {
+			return reinterpret_cast<queue_t*>(this + 1)[id];
+		}
 
-	using queue_t = ipc::Ringbuffer<ipc::event::BufferEntry, 1 << 20, false, 64>;
+		/**
+		* Claim a private ring.
+		* \return id of the ring or \ref shared_queue if none is free
+		*/
+		unsigned claim() {
+			unsigned nqueues = num_queues.load(std::memory_order_acquire);
+			for (unsigned i = shared_queue + 1; i < nqueues; ++i) {
+				uint32_t expected = (uint32_t)State::FREE;
+				if (state[i].load(std::memory_order_relaxed) == expected &&
+					state[i].compare_exchange_strong(expected, (uint32_t)State::ACTIVE, std::memory_order_acquire))
+				{
+					return i;
+				}
+			}
+			return shared_queue;
+		}
 
-	struct QueueMetadata {
-		static constexpr unsigned num_queues{ 2 };
-		unsigned next_queue{ 0 };
-		queue_t queues[num_queues];
+		/** Release a private ring after the last event is committed */
+		void release(unsigned id) {
+			if (id != shared_queue)
+				state[id].store((uint32_t)State::CLOSED, std::memory_order_release);
+		}
 	};
 }
\ No newline at end of file
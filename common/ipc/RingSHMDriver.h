@@ -0,0 +1,193 @@
+#pragma once
+/*
+ * DRace, a dynamic data race detector
+ *
+ * Copyright 2018 Siemens AG
+ *
+ * Authors:
+ *   Felix Moessbauer <felix.moessbauer@siemens.com>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <thread>
+#include <chrono>
+#include <new>
+
+#include "SharedMemory.h"
+#include "SMData.h"
+
+namespace ipc {
+
+	/** Handles pipelined communication between Drace and MSR.
+	* Unlike the \ref SyncSHMDriver, multiple requests can be in flight at the same time.
+	* A client claims a slot using \ref acquire, constructs the request in it,
+	* \ref submit s it and later \ref await s the response.
+	* The MSR picks requests using \ref next_request and completes them using \ref respond.
+	* Instead of a WAIT / CONFIRM handshake, the MSR increments a heartbeat counter.
+	* \note Threadsafe, as each slot is owned by exactly one party at a time
+	*/
+	template<bool SENDER, bool NOTHROW = true>
+	class RingSHMDriver {
+	private:
+		SharedMemory<SMRing, NOTHROW> _shm;
+		SMRing * _ring;
+
+	public:
+		/// Attach to shared memory if any
+		RingSHMDriver(const char* shmkey, bool create)
+			: _shm(shmkey, create),
+			_ring(_shm.get())
+		{ }
+
+		/** Constructs T in the buffer of the slot */
+		template<typename T, class... Args>
+		static inline T & emplace(SMSlot * slot, SMDataID mid, Args&&... args) {
+			slot->id = mid;
+			return *(new (slot->buffer) T(std::forward<Args>(args)...));
+		}
+
+		/** Gets value of type T from begin of the buffer of the slot */
+		template<typename T>
+		static inline const T & get(const SMSlot * slot) {
+			return *reinterpret_cast<const T*>(slot->buffer);
+		}
+
+		/* Client */
+
+		/** Claims a free slot, nullptr if all slots are in use */
+		SMSlot * try_acquire() {
+			for (unsigned i = 0; i < SMRing::num_slots; ++i) {
+				SMSlot * slot = &(_ring->slots[i]);
+				uint32_t expected = SMSlot::FREE;
+				if (slot->state.load(std::memory_order_relaxed) == SMSlot::FREE &&
+					slot->state.compare_exchange_strong(expected, SMSlot::CLAIMED, std::memory_order_acquire))
+				{
+					return slot;
+				}
+			}
+			return nullptr;
+		}
+
+		/** Claims a free slot, waits until one becomes available */
+		SMSlot * acquire() {
+			SMSlot * slot;
+			while ((slot = try_acquire()) == nullptr) {
+				std::this_thread::yield();
+			}
+			return slot;
+		}
+
+		/** Publishes the request in the slot, returns the request id */
+		uint32_t submit(SMSlot * slot) {
+			slot->reqid = _ring->next_reqid.fetch_add(1, std::memory_order_relaxed);
+			slot->state.store(SMSlot::REQUEST, std::memory_order_release);
+			_shm.notify();
+			return slot->reqid;
+		}
+
+		/**
+		* Wait for the response to a submitted request.
+		* The timeout only expires if the MSR does not show any progress
+		* (heartbeat) in this period. On timeout, the slot is given up
+		* and must not be used any longer.
+		*/
+		template<typename duration = std::chrono::milliseconds>
+		bool await(SMSlot * slot, const duration & timeout = std::chrono::milliseconds(100)) {
+			using clock = std::chrono::steady_clock;
+			uint32_t beat = _ring->heartbeat.load(std::memory_order_relaxed);
+			auto deadline = clock::now() + timeout;
+
+			while (slot->state.load(std::memory_order_acquire) != SMSlot::RESPONSE) {
+				// the event is shared by all waiting clients, hence poll
+				_shm.wait(std::chrono::milliseconds(1));
+
+				uint32_t now_beat = _ring->heartbeat.load(std::memory_order_relaxed);
+				if (now_beat != beat) {
+					beat = now_beat;
+					deadline = clock::now() + timeout;
+				}
+				else if (clock::now() > deadline) {
+					abandon(slot);
+					return false;
+				}
+			}
+			return true;
+		}
+
+		/** Releases the slot after the response is consumed */
+		void release(SMSlot * slot) {
+			slot->state.store(SMSlot::FREE, std::memory_order_release);
+		}
+
+		/* Server */
+
+		/**
+		* Returns the pending request with the lowest id and marks
+		* it as processing, nullptr if no request is pending.
+		*/
+		SMSlot * next_request() {
+			SMSlot * next = nullptr;
+			for (unsigned i = 0; i < SMRing::num_slots; ++i) {
+				SMSlot * slot = &(_ring->slots[i]);
+				if (slot->state.load(std::memory_order_acquire) == SMSlot::REQUEST &&
+					(next == nullptr || (int32_t)(slot->reqid - next->reqid) < 0))
+				{
+					next = slot;
+				}
+			}
+			if (next != nullptr) {
+				uint32_t expected = SMSlot::REQUEST;
+				if (!next->state.compare_exchange_strong(expected, SMSlot::PROCESSING, std::memory_order_acquire)) {
+					// request was abandoned in the meantime
+					return next_request();
+				}
+			}
+			return next;
+		}
+
+		/** Publishes the response in the slot */
+		void respond(SMSlot * slot) {
+			uint32_t expected = SMSlot::PROCESSING;
+			if (!slot->state.compare_exchange_strong(expected, SMSlot::RESPONSE, std::memory_order_release)) {
+				// client is no longer waiting
+				slot->state.store(SMSlot::FREE, std::memory_order_release);
+			}
+			heartbeat();
+			_shm.notify();
+		}
+
+		/** Signal progress to waiting clients */
+		inline void heartbeat() {
+			_ring->heartbeat.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		template<typename duration = std::chrono::milliseconds>
+		inline bool wait_request(const duration & d = std::chrono::milliseconds(100)) {
+			return _shm.wait(d);
+		}
+
+		/**
+		* returns true if the ring is in a valid state and can be used.
+		* This is for the nothrow case, where the constructor cannot
+		* throw a exception if an error occured during shm attaching
+		*/
+		inline bool valid() const {
+			return (nullptr != _ring);
+		}
+
+	private:
+		/** Gives up a request the client is no longer waiting for */
+		void abandon(SMSlot * slot) {
+			uint32_t expected = SMSlot::REQUEST;
+			if (slot->state.compare_exchange_strong(expected, SMSlot::FREE))
+				return;
+			expected = SMSlot::PROCESSING;
+			if (slot->state.compare_exchange_strong(expected, SMSlot::ABANDONED))
+				return;
+			// response arrived in the meantime
+			release(slot);
+		}
+	};
+
+} // namespace ipc
@@ -11,12 +11,14 @@
  */
 
 #include <cstdint>
+#include <cstring>
 #include <string>
 #include <array>
 #include <atomic>
 
 constexpr auto DRACE_SMR_NAME = "drace-msr";
 constexpr auto DRACE_SMR_CB_NAME = "drace-cb";
+constexpr auto DRACE_SMR_RING_NAME = "drace-msr-ring";
 constexpr auto DRACE_SMR_MAXLEN = 1024;
 
 /// Inter Process Communication
@@ -34,6 +36,7 @@ namespace ipc {
 		LOADSYMS,
 		UNLOADSYMS,
 		SEARCHSYMS,
+		IPBATCH,
 
 		WAIT,
 		CONFIRM,
@@ -62,13 +65,26 @@ namespace ipc {
 		uint64_t base;
 		size_t   size;
 		bool     full{ false };
+		/// index of the first match to return (for paginated searches)
+		size_t   offset{ 0 };
 		std::array<char, 256> path;
 		std::array<char, 256> match;
 	};
 
+	/**
+	* One page of the matches of a symbol search.
+	* If \c offset + \c size is less than \c total, the remaining matches
+	* are fetched by repeating the request with an increased offset.
+	*/
 	struct SymbolResponse {
+		static constexpr unsigned max_adresses = (DRACE_SMR_MAXLEN - 16 - 3 * sizeof(size_t)) / sizeof(uint64_t);
+
 		size_t size{0};
-		std::array<uint64_t, 64> adresses;
+		/// index of the first match in this page
+		size_t offset{0};
+		/// total number of matches
+		size_t total{0};
+		std::array<uint64_t, max_adresses> adresses;
 	};
 
 	struct MachineContext {
@@ -87,9 +103,139 @@ namespace ipc {
 		char buffer[BUFFER_SIZE];
 	};
 
+	/** Batch of instruction pointers to resolve */
+	struct IPBatchRequest {
+		static constexpr unsigned max_pcs = (SMData::BUFFER_SIZE - sizeof(uint64_t)) / sizeof(uint64_t);
+
+		uint32_t count{ 0 };
+		uint64_t pcs[max_pcs];
+	};
+
+	/**
+	* Symbol information of the first \c count pcs of a \ref IPBatchRequest.
+	* For each pc, module, function and path are stored as consecutive
+	* zero-terminated strings. The remaining pcs have to be requested again.
+	*/
+	struct IPBatchResponse {
+		static constexpr unsigned data_size = SMData::BUFFER_SIZE - sizeof(uint32_t);
+
+		uint32_t count{ 0 };
+		char     data[data_size];
+	};
+
+	/** Slot of the request ring. Holds one request and its response */
+	struct alignas(64) SMSlot {
+		/**
+		* Lifecycle of a slot:
+		* FREE -> CLAIMED -> REQUEST -> PROCESSING -> RESPONSE -> FREE.
+		* If the client gives up on a request that is already processed,
+		* the slot is marked ABANDONED and freed by the server.
+		*/
+		enum State : uint32_t { FREE, CLAIMED, REQUEST, PROCESSING, RESPONSE, ABANDONED };
+
+		std::atomic<uint32_t> state{ FREE };
+		/// Request id, assigned on submission
+		uint32_t reqid{ 0 };
+		/// Message ID of request and response
+		SMDataID id;
+		/// Raw data buffer
+		char buffer[SMData::BUFFER_SIZE];
+	};
+
+	/** Multi-slot request / response ring between DRace and MSR */
+	struct SMRing {
+		static constexpr unsigned num_slots = 16;
+
+		/// Next request id
+		std::atomic<uint32_t> next_reqid{ 0 };
+		/// Incremented by the MSR while it is alive and makes progress
+		std::atomic<uint32_t> heartbeat{ 0 };
+		SMSlot slots[num_slots];
+	};
+
+	/**
+	* Control block to change the behavior of DRace at runtime.
+	* Writers first change the settings and then increment \c generation.
+	* DRace applies all settings as soon as it observes a new generation.
+	*/
 	struct ClientCB {
+		static constexpr uint32_t current_version = 3;
+		static constexpr unsigned max_modules = 16;
+		static constexpr unsigned max_threads = 64;
+
+		/// layout version of this block
+		uint32_t              version{ current_version };
+		/// incremented after each change of the settings
+		std::atomic<uint32_t> generation{ 0 };
+
 		std::atomic<bool>     enabled{ true };
-		std::atomic<uint32_t> sampling_rate;
+		std::atomic<uint32_t> sampling_rate{ 1 };
+		/// instrument each nth instruction, changes trigger a re-instrumentation
+		std::atomic<uint32_t> instr_rate{ 1 };
+		/// report each pair of racing instructions only once
+		std::atomic<bool>     dedup{ false };
+		/// incremented to request the analysis of all buffered accesses
+		std::atomic<uint32_t> flush_seq{ 0 };
+		/**
+		* Module name, guarded by a sequence counter which is odd while
+		* the name is written. Hence, readers never observe torn names.
+		*/
+		struct ModuleEntry {
+			using name_t = std::array<char, 64>;
+
+			std::atomic<uint32_t> seq{ 0 };
+			name_t                name{};
+
+			/** Copies a consistent snapshot of the name, returns false if the entry is empty */
+			bool read(name_t & buf) const {
+				while (true) {
+					uint32_t s = seq.load(std::memory_order_acquire);
+					if (s & 1)
+						continue;
+					std::memcpy(buf.data(), name.data(), buf.size());
+					std::atomic_thread_fence(std::memory_order_acquire);
+					if (seq.load(std::memory_order_relaxed) == s)
+						break;
+				}
+				buf.back() = '\0';
+				return buf[0] != '\0';
+			}
+
+			/** Sets the name, an empty name clears the entry. Concurrent writers are serialized */
+			void write(const char * str, size_t len) {
+				uint32_t s = seq.load(std::memory_order_relaxed);
+				while ((s & 1) || !seq.compare_exchange_weak(s, s + 1, std::memory_order_relaxed)) {
+					s = seq.load(std::memory_order_relaxed);
+				}
+				// the odd counter is visible before any byte of the name
+				std::atomic_thread_fence(std::memory_order_release);
+				std::memcpy(name.data(), str, len);
+				name[len] = '\0';
+				seq.store(s + 2, std::memory_order_release);
+			}
+		};
+
+		/// names of modules whose memory accesses are not instrumented
+		std::array<ModuleEntry, max_modules> disabled_modules{};
+		/// ids of threads the detector is disabled on, 0 denotes an empty entry
+		std::array<std::atomic<uint32_t>, max_threads> disabled_threads{};
+
+		bool module_disabled(const char * name) const {
+			ModuleEntry::name_t buf;
+			for (const auto & mod : disabled_modules) {
+				if (mod.read(buf) && strncmp(buf.data(), name, buf.size()) == 0)
+					return true;
+			}
+			return false;
+		}
+
+		bool thread_disabled(uint32_t tid) const {
+			for (const auto & t : disabled_threads) {
+				if (t.load(std::memory_order_relaxed) == tid)
+					return true;
+			}
+			return false;
+		}
 	};
 
 } // namespace ipc
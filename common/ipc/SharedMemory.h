@@ -10,14 +10,35 @@
  * SPDX-License-Identifier: MIT
  */
 
+#ifdef _WIN32
 #include <windows.h>
 #include <stdio.h>
 #include <conio.h>
 #include <tchar.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
 
+#include <atomic>
+#include <new>
+
+typedef unsigned char byte;
+#endif
+
+#include <cstdint>
+#include <chrono>
+#include <string>
 #include <stdexcept>
 
 namespace ipc {
+#ifdef _WIN32
 	/**
 	* Provides a shared memory abstraction for two participating units
 	* To synchronize accesses, \cnotify() and \cwait() can be used.
@@ -31,12 +52,18 @@ namespace ipc {
 		bool nothrow = false>
 		class SharedMemory {
 		bool   _creator;
-		HANDLE _event_in;
-		HANDLE _event_out;
-		HANDLE _hMapFile;
+		HANDLE _event_in{ nullptr };
+		HANDLE _event_out{ nullptr };
+		HANDLE _hMapFile{ nullptr };
 		T*     _buffer{ nullptr };
 		public:
-			SharedMemory(const char * name, bool create = false)
+			/**
+			* Create or attach to a shared memory segment.
+			* \param size size of the segment in bytes, has to be at least sizeof(T).
+			*        Only used by the creator. The object T is only constructed
+			*        by the creator.
+			*/
+			SharedMemory(const char * name, bool create = false, size_t size = sizeof(T))
 				: _creator(create)
 			{
 				if (_creator) {
@@ -44,8 +71,8 @@ namespace ipc {
 						INVALID_HANDLE_VALUE,    // use paging file
 						NULL,                    // default security
 						PAGE_READWRITE,          // read/write access
-						0,                       // maximum object size (high-order DWORD)
-						sizeof(T),				 // maximum object size (low-order DWORD)
+						(DWORD)((uint64_t)size >> 32), // maximum object size (high-order DWORD)
+						(DWORD)(size & 0xFFFFFFFF),    // maximum object size (low-order DWORD)
 						name);                   // name of mapping object
 				}
 				else {
@@ -65,6 +92,8 @@ namespace ipc {
 					if (nothrow) return;
 					throw std::runtime_error("error creating file view");
 				}
+				// constructed before the events, as the destructor destructs it once mapped
+				if (_creator) new (_buffer) T;
 
 				// Create Event for notification
 				std::string evtname("Global\\");
@@ -82,8 +111,6 @@ namespace ipc {
 					if (nothrow) return;
 					throw std::runtime_error("error creating notification event");
 				}
-
-				new (_buffer) T;
 			}
 
 			~SharedMemory() {
@@ -91,7 +118,7 @@ namespace ipc {
 				if (nullptr != _event_out) CloseHandle(_event_out);
 
 				// destruct object in buffer;
-				if (nullptr != _buffer) _buffer->~T();
+				if (_creator && nullptr != _buffer) _buffer->~T();
 
 				if (nullptr != _buffer) UnmapViewOfFile(_buffer);
 				if (nullptr != _hMapFile) CloseHandle(_hMapFile);
@@ -130,5 +157,170 @@ namespace ipc {
 				}
 			}
 	};
+#else
+	/**
+	* Provides a shared memory abstraction for two participating units
+	* To synchronize accesses, \cnotify() and \cwait() can be used.
+	* Internally the POSIX shared memory object is prefixed by a control
+	* block containing two futex words which are used as auto-reset
+	* events, one for sending and one for receiving.
+	*/
+	template<
+		/// Type of shared memory. Object is constructed in place
+		typename T = byte,
+		/// If true, no exceptions are used. To check liveness, use \cvalid()
+		bool nothrow = false>
+		class SharedMemory {
+		/// Control block in front of the object, constructed by the creator
+		struct alignas(64) Control {
+			std::atomic<uint32_t> event_in{ 0 };
+			std::atomic<uint32_t> event_out{ 0 };
+		};
+		bool        _creator;
+		size_t      _map_size;
+		std::string _name;
+		int         _fd{ -1 };
+		void*       _map{ MAP_FAILED };
+		Control*    _ctrl{ nullptr };
+		T*          _buffer{ nullptr };
+
+		static long futex(std::atomic<uint32_t> * addr, int op, uint32_t val, const timespec * ts) {
+			return syscall(SYS_futex, reinterpret_cast<uint32_t*>(addr), op, val, ts, nullptr, 0);
+		}
+
+		public:
+			/**
+			* Create or attach to a shared memory segment.
+			* \param size size of the segment in bytes, has to be at least sizeof(T).
+			*        Only used by the creator. The object T is only constructed
+			*        by the creator.
+			*/
+			SharedMemory(const char * name, bool create = false, size_t size = sizeof(T))
+				: _creator(create), _map_size(sizeof(Control) + size)
+			{
+				// POSIX shm names have to start with a slash
+				_name = std::string("/") + name;
+				// true if this unit created the segment
+				bool fresh = false;
+				if (_creator) {
+					fresh = create_segment();
+				}
+				else {
+					_fd = shm_open(_name.c_str(), O_RDWR, 0);
+				}
+
+				if (-1 == _fd) {
+					if (nothrow) return;
+					throw std::runtime_error("error creating/attaching shared memory object");
+				}
+
+				if (fresh && (-1 == ftruncate(_fd, _map_size))) {
+					if (nothrow) return;
+					throw std::runtime_error("error resizing shared memory object");
+				}
+				if (!fresh) {
+					struct stat st;
+					if (-1 == fstat(_fd, &st) || (size_t)st.st_size < sizeof(Control) + sizeof(T)) {
+						if (nothrow) return;
+						throw std::runtime_error("error attaching shared memory object");
+					}
+					_map_size = st.st_size;
+				}
+
+				_map = mmap(nullptr, _map_size, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+				if (MAP_FAILED == _map) {
+					if (nothrow) return;
+					throw std::runtime_error("error mapping shared memory object");
+				}
+
+				_ctrl = reinterpret_cast<Control*>(_map);
+				_buffer = reinterpret_cast<T*>(reinterpret_cast<char*>(_map) + sizeof(Control));
+
+				if (fresh) new (_ctrl) Control;
+				if (_creator) new (_buffer) T;
+			}
+
+			~SharedMemory() {
+				// destruct object in buffer;
+				if (_creator && nullptr != _buffer) _buffer->~T();
+
+				if (MAP_FAILED != _map) munmap(_map, _map_size);
+				if (-1 != _fd) close(_fd);
+				// the name is removed, the object persists until all units detached
+				if (_creator && -1 != _fd) shm_unlink(_name.c_str());
+			}
+
+			T* get() {
+				return _buffer;
+			}
+
+		private:
+			/**
+			* Creates the segment or attaches to the segment of a live creator
+			* (as CreateFileMapping does). Creators hold a shared lock on the segment,
+			* hence a segment without lock was left by a crashed creator. It is replaced,
+			* as it contains stale event words. Attached units keep their mapping.
+			* \return true if a new segment was created
+			*/
+			bool create_segment() {
+				bool fresh = true;
+				_fd = shm_open(_name.c_str(), O_CREAT | O_EXCL | O_RDWR, S_IRUSR | S_IWUSR);
+				if (-1 == _fd && errno == EEXIST) {
+					_fd = shm_open(_name.c_str(), O_RDWR, 0);
+					if (-1 != _fd && 0 == flock(_fd, LOCK_EX | LOCK_NB)) {
+						close(_fd);
+						shm_unlink(_name.c_str());
+						_fd = shm_open(_name.c_str(), O_CREAT | O_EXCL | O_RDWR, S_IRUSR | S_IWUSR);
+					}
+					else {
+						fresh = false;
+					}
+				}
+				// released on close
+				if (-1 != _fd) flock(_fd, LOCK_SH);
+				return fresh;
+			}
+
+		public:
+			void notify() const {
+				auto * evt = _creator ? &_ctrl->event_in : &_ctrl->event_out;
+				evt->store(1, std::memory_order_release);
+				if (-1 == futex(evt, FUTEX_WAKE, 1, nullptr)) {
+					if (nothrow) return;
+					throw std::runtime_error("error in futex wake");
+				}
+			}
+
+			template<typename duration = std::chrono::milliseconds>
+			bool wait(const duration & d = std::chrono::milliseconds(100)) const {
+				using ns_t = std::chrono::nanoseconds;
+				using clock = std::chrono::steady_clock;
+
+				auto * evt = _creator ? &_ctrl->event_out : &_ctrl->event_in;
+				const auto deadline = clock::now() + std::chrono::duration_cast<ns_t>(d);
+				while (true) {
+					// auto-reset: consume the signal
+					if (evt->exchange(0, std::memory_order_acquire) == 1)
+						return true;
+
+					auto remaining = std::chrono::duration_cast<ns_t>(deadline - clock::now()).count();
+					if (remaining <= 0)
+						return false;
+
+					timespec ts;
+					ts.tv_sec = remaining / 1000000000;
+					ts.tv_nsec = remaining % 1000000000;
+					if (-1 == futex(evt, FUTEX_WAIT, 0, &ts)) {
+						// woken up, value changed or spurious wakeup
+						if (errno == EAGAIN || errno == EINTR || errno == ETIMEDOUT)
+							continue;
+						if (!nothrow)
+							throw std::runtime_error("error in futex wait");
+						return false;
+					}
+				}
+			}
+	};
+#endif
 
 } // namespace ipc
@@ -208,7 +208,7 @@ namespace ipc {
 			if ((head - tail) == buffer_size)
 				return nullptr;
 
-			return &(data_buff[(head+1) & buffer_mask]);
+			return &(data_buff[head & buffer_mask]);
 		}
 
 		/*!
@@ -224,6 +224,60 @@ namespace ipc {
 				std::atomic_thread_fence(std::memory_order_release);
 		}
 
+		/*!
+		 * \brief Inserts all elements or none, without blocking
+		 * \param[in] buff Pointer to buffer with data to be inserted from
+		 * \param count Number of elements to write from the given buffer
+		 * \return Indicates if the data was inserted into internal buffer
+		 */
+		bool writeAll(const T* buff, size_t count)
+		{
+			index_t tmp_head = head;
+
+			if (wmo_multi_core)
+				std::atomic_thread_fence(std::memory_order_acquire);
+
+			if ((buffer_size - (tmp_head - tail)) < count)
+				return false;
+
+			for (size_t i = 0; i < count; i++)
+				data_buff[tmp_head++ & buffer_mask] = buff[i];
+
+			if (wmo_multi_core)
+				std::atomic_thread_fence(std::memory_order_release);
+
+			head = tmp_head;
+
+			if (wmo_multi_core)
+				std::atomic_thread_fence(std::memory_order_release);
+
+			return true;
+		}
+
+		/*!
+		 * \brief Reads an element without removing it
+		 * \warning offset has to be less than \c readAvailable()
+		 * \param offset Offset from the tail
+		 * \return Reference to the element
+		 */
+		const T & peek(index_t offset) const {
+			return data_buff[(tail + offset) & buffer_mask];
+		}
+
+		/*!
+		 * \brief Removes elements which were read using \c peek()
+		 * \param count Number of elements to remove
+		 */
+		void consume(index_t count) {
+			if (wmo_multi_core)
+				std::atomic_thread_fence(std::memory_order_release);
+
+			tail = tail + count;
+
+			if (wmo_multi_core)
+				std::atomic_thread_fence(std::memory_order_release);
+		}
+
 		/*!
 		 * \brief Inserts data returned by callback function, into internal buffer, without blocking
 		 *
@@ -473,7 +527,7 @@ namespace ipc {
 	size_t Ringbuffer<T, buffer_size, wmo_multi_core, cacheline_size, index_t>::readBuff(T* buff, size_t count)
 	{
 		index_t available = 0;
-		index_t tmp_tail = head;
+		index_t tmp_tail = tail;
 		size_t to_read = count;
 
 		if (wmo_multi_core)
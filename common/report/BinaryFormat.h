@@ -0,0 +1,128 @@
+#pragma once
+/*
+ * DRace, a dynamic data race detector
+ *
+ * Copyright 2018 Siemens AG
+ *
+ * Authors:
+ *   Felix Moessbauer <felix.moessbauer@siemens.com>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+/**
+* Compact binary race report
+*
+* The file starts with a \ref report::FileHeader, followed by a sequence
+* of fixed-size records. Each record starts with a \ref report::RecordType tag,
+* the size of a record is determined by its type.
+* Races are stored with unresolved program counters. Before the first race
+* which is written after a change of the module map, a module snapshot
+* (\ref report::SnapshotRecord followed by \ref report::ModuleRecord entries)
+* is emitted. Hence, the pcs of a race can be resolved offline using the last
+* snapshot preceding it.
+*
+* All values are stored in native (little-endian) byte order.
+*/
+namespace report {
+	/// "DRRP"
+	constexpr uint32_t magic = 0x50525244;
+	constexpr uint16_t format_version = 1;
+	constexpr int      max_stack_size = 16;
+	constexpr int      max_path_len = 260;
+
+	enum class RecordType : uint32_t {
+		RACE = 1,
+		SNAPSHOT = 2,
+		MODULE = 3,
+		END = 4
+	};
+
+	struct FileHeader {
+		uint32_t magic{ report::magic };
+		uint16_t version{ format_version };
+		uint16_t stack_size{ max_stack_size };
+		uint32_t pid{ 0 };
+		uint32_t reserved{ 0 };
+		/// start of the application in ms since epoch
+		uint64_t start_time{ 0 };
+		char     app[max_path_len]{ 0 };
+	};
+
+	/** A single memory access with unresolved stack */
+	struct AccessRecord {
+		uint64_t accessed_memory;
+		uint64_t access_size;
+		uint64_t heap_block_begin;
+		uint64_t heap_block_size;
+		uint32_t thread_id;
+		int32_t  access_type;
+		uint32_t stack_size;
+		uint8_t  write;
+		uint8_t  onheap;
+		uint8_t  pad[2];
+		/// stack is stored in reverse order (caller first)
+		uint64_t stack_trace[max_stack_size];
+	};
+
+	struct RaceRecord {
+		RecordType   type{ RecordType::RACE };
+		uint32_t     reserved{ 0 };
+		/// time to race in ms
+		uint64_t     time;
+		AccessRecord first;
+		AccessRecord second;
+	};
+
+	/** Announces a new module map, followed by \c num_modules ModuleRecords */
+	struct SnapshotRecord {
+		RecordType type{ RecordType::SNAPSHOT };
+		uint32_t   num_modules{ 0 };
+	};
+
+	struct ModuleRecord {
+		RecordType type{ RecordType::MODULE };
+		uint32_t   reserved{ 0 };
+		uint64_t   base;
+		uint64_t   end;
+		char       path[max_path_len]{ 0 };
+	};
+
+	/** Written on a regular shutdown of the instrumented process */
+	struct EndRecord {
+		RecordType type{ RecordType::END };
+		uint32_t   reserved{ 0 };
+		/// end of the application in ms since epoch
+		uint64_t   stop_time;
+	};
+
+	static_assert(sizeof(AccessRecord) == 176, "unexpected AccessRecord layout");
+	static_assert(sizeof(RaceRecord) == 16 + 2 * sizeof(AccessRecord), "unexpected RaceRecord layout");
+	static_assert(sizeof(ModuleRecord) == 24 + max_path_len + 4, "unexpected ModuleRecord layout");
+
+	/** Returns the size of a record of the given type, or 0 if the type is unknown */
+	inline size_t record_size(RecordType type) {
+		switch (type) {
+		case RecordType::RACE:     return sizeof(RaceRecord);
+		case RecordType::SNAPSHOT: return sizeof(SnapshotRecord);
+		case RecordType::MODULE:   return sizeof(ModuleRecord);
+		case RecordType::END:      return sizeof(EndRecord);
+		default: return 0;
+		}
+	}
+
+	/** Copies a null terminated string into a fixed-size buffer (truncating) */
+	inline void copy_string(char * dest, const char * src, size_t len) {
+		if (src == nullptr) {
+			dest[0] = '\0';
+			return;
+		}
+		size_t n = std::min(std::strlen(src), len - 1);
+		std::memcpy(dest, src, n);
+		dest[n] = '\0';
+	}
+} // namespace report
@@ -0,0 +1,234 @@
+#pragma once
+/*
+ * DRace, a dynamic data race detector
+ *
+ * Copyright 2018 Siemens AG
+ *
+ * Authors:
+ *   Felix Moessbauer <felix.moessbauer@siemens.com>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+/**
+* JSON Lines race report
+*
+* Each line holds one self-contained JSON object per race:
+* @code
+* {"time":<ms>,"accesses":[<access>,<access>]}
+* <access> := {"thread":<tid>,"write":<bool>,"address":"0x..","size":<n>,"type":<n>,
+*              "heap":{"begin":"0x..","size":<n>} | null,"stack":[<frame>,...]}
+* <frame>  := {"pc":"0x..",["module":"..","offset":"0x..",]["function":"..",]["file":"..","line":<n>]}
+* @endcode
+* The innermost frame is written first. This serializer is shared by the
+* drace sink and drace-report, hence both produce the same format.
+*/
+namespace report {
+	/**
+	* Serializes races into a preallocated buffer, which is only
+	* re-allocated if a race does not fit into it.
+	* Accesses and frames are templates, as the drace client and
+	* drace-report use different types with the same members.
+	*/
+	class JsonLinesWriter {
+		/// initial size of the serialization buffer
+		static constexpr size_t buffer_size = 16 * 1024;
+
+		std::vector<char> _buffer;
+		size_t            _pos{ 0 };
+		unsigned          _num_accesses{ 0 };
+		unsigned          _num_frames{ 0 };
+
+	public:
+		JsonLinesWriter()
+			: _buffer(buffer_size) { }
+
+		/** Starts a new race, discards the previous one */
+		void begin_race(uint64_t time) {
+			_pos = 0;
+			_num_accesses = 0;
+			append("{\"time\":");
+			append_uint(time);
+			append(",\"accesses\":[");
+		}
+
+		/** Terminates the race object and the line */
+		void end_race() {
+			append("]}\n");
+		}
+
+		/** Writes all fields of the access up to the stack, which is filled using \ref frame and \ref frame_pc */
+		template<typename Access>
+		void begin_access(const Access & ac) {
+			if (_num_accesses++ != 0) append(',');
+			_num_frames = 0;
+			append("{\"thread\":");
+			append_uint(ac.thread_id);
+			append(",\"write\":");
+			if (ac.write) append("true");
+			else append("false");
+			append(",\"address\":");
+			append_hex(ac.accessed_memory);
+			append(",\"size\":");
+			append_uint(ac.access_size);
+			append(",\"type\":");
+			append_int(ac.access_type);
+			append(",\"heap\":");
+			if (ac.onheap) {
+				append("{\"begin\":");
+				append_hex(ac.heap_block_begin);
+				append(",\"size\":");
+				append_uint(ac.heap_block_size);
+				append('}');
+			}
+			else {
+				append("null");
+			}
+			append(",\"stack\":[");
+		}
+
+		void end_access() {
+			append("]}");
+		}
+
+		/** Appends an unresolved frame */
+		void frame_pc(uint64_t pc) {
+			if (_num_frames++ != 0) append(',');
+			append("{\"pc\":");
+			append_hex(pc);
+			append('}');
+		}
+
+		/** Appends a (partially) resolved frame, empty members are omitted */
+		template<typename Frame>
+		void frame(const Frame & f) {
+			if (_num_frames++ != 0) append(',');
+			append("{\"pc\":");
+			append_hex((uint64_t)f.pc);
+			if (!f.mod_name.empty()) {
+				append(",\"module\":");
+				append_string(f.mod_name);
+				append(",\"offset\":");
+				append_hex((uint64_t)(f.pc - f.mod_base));
+			}
+			if (!f.sym_name.empty()) {
+				append(",\"function\":");
+				append_string(f.sym_name);
+			}
+			if (!f.file.empty()) {
+				append(",\"file\":");
+				append_string(f.file);
+				append(",\"line\":");
+				append_uint(f.line);
+			}
+			append('}');
+		}
+
+		inline const char * data() const {
+			return _buffer.data();
+		}
+
+		inline size_t size() const {
+			return _pos;
+		}
+
+	private:
+		inline void reserve(size_t len) {
+			if (_pos + len > _buffer.size())
+				_buffer.resize(std::max(_buffer.size() * 2, _pos + len));
+		}
+
+		inline void append(const char * str, size_t len) {
+			reserve(len);
+			std::memcpy(_buffer.data() + _pos, str, len);
+			_pos += len;
+		}
+
+		/** append a string literal */
+		template<size_t N>
+		inline void append(const char(&str)[N]) {
+			append(str, N - 1);
+		}
+
+		inline void append(char c) {
+			reserve(1);
+			_buffer[_pos++] = c;
+		}
+
+		void append_uint(uint64_t val) {
+			char tmp[20];
+			int len = 0;
+			do {
+				tmp[len++] = '0' + static_cast<char>(val % 10);
+				val /= 10;
+			} while (val != 0);
+			reserve(len);
+			while (len > 0) {
+				_buffer[_pos++] = tmp[--len];
+			}
+		}
+
+		void append_int(int64_t val) {
+			if (val < 0) {
+				append('-');
+				append_uint(static_cast<uint64_t>(-(val + 1)) + 1);
+			}
+			else {
+				append_uint(static_cast<uint64_t>(val));
+			}
+		}
+
+		/** appends a quoted hex number, e.g. "0x7ff0" */
+		void append_hex(uint64_t val) {
+			static const char digits[] = "0123456789abcdef";
+			char tmp[16];
+			int len = 0;
+			do {
+				tmp[len++] = digits[val & 0xF];
+				val >>= 4;
+			} while (val != 0);
+			reserve(len + 4);
+			_buffer[_pos++] = '"';
+			_buffer[_pos++] = '0';
+			_buffer[_pos++] = 'x';
+			while (len > 0) {
+				_buffer[_pos++] = tmp[--len];
+			}
+			_buffer[_pos++] = '"';
+		}
+
+		/** appends a quoted and escaped string */
+		void append_string(const std::string & str) {
+			static const char digits[] = "0123456789abcdef";
+			// worst case: each character is escaped as \u00XX
+			reserve(str.size() * 6 + 2);
+			_buffer[_pos++] = '"';
+			for (char c : str) {
+				switch (c) {
+				case '"':  _buffer[_pos++] = '\\'; _buffer[_pos++] = '"'; break;
+				case '\\': _buffer[_pos++] = '\\'; _buffer[_pos++] = '\\'; break;
+				case '\n': _buffer[_pos++] = '\\'; _buffer[_pos++] = 'n'; break;
+				case '\r': _buffer[_pos++] = '\\'; _buffer[_pos++] = 'r'; break;
+				case '\t': _buffer[_pos++] = '\\'; _buffer[_pos++] = 't'; break;
+				default:
+					if (static_cast<unsigned char>(c) < 0x20) {
+						std::memcpy(_buffer.data() + _pos, "\\u00", 4);
+						_pos += 4;
+						_buffer[_pos++] = digits[(c >> 4) & 0xF];
+						_buffer[_pos++] = digits[c & 0xF];
+					}
+					else {
+						_buffer[_pos++] = c;
+					}
+				}
+			}
+			_buffer[_pos++] = '"';
+		}
+	};
+} // namespace report
@@ -42,6 +42,10 @@ void detector::allocate(tls_t tls, void* pc, void* addr, size_t size) { }
 
 void detector::deallocate(tls_t tls, void* addr) { }
 
+void detector::own_range(tls_t tls, void* pc, void* addr, size_t size) { }
+
+void detector::transfer_range(tls_t tls, void* pc, void* addr, size_t size) { }
+
 void detector::fork(tid_t parent, tid_t child, tls_t * tls) {
 	*tls = (void*)child;
 }
@@ -15,6 +15,9 @@
 #include <thread>
 #include <mutex>
 #include <iostream>
+#include <cstring>
+#include <vector>
+#include <chrono>
 
 #include <detector/detector_if.h>
 
@@ -32,21 +35,297 @@ namespace detector {
 
 		using shm_t = ipc::SharedMemory<ipc::QueueMetadata, true>;
 
+		std::unique_ptr<shm_t> shm;
+
+		/// what to do if the ring of a thread is full
+		enum class Overflow {
+			/// spin, then wait until the consumer made space
+			BLOCK,
+			/// drop the event (only memory accesses, other events are never dropped)
+			DROP,
+			/// buffer the event thread-locally and retry later
+			SPILL
+		};
+
+		struct parameters_t {
+			Overflow overflow{ Overflow::DROP };
+			/// maximum size of the thread-local overflow buffer in words
+			size_t   max_spill_words{ 1 << 20 };
+		} params;
+
 		struct tls_data {
 			detector::tid_t thread_id;
-			ipc::queue_t* queue;
+			unsigned        queue_id;
+			ipc::queue_t*   queue;
+			ipc::QueueMetadata* qmeta;
+			/// last callstack sent to MSR, used for delta encoding
+			unsigned        last_stacksize;
+			uint64_t        last_stack[ipc::event::max_stack_size];
+
+			/// records which did not fit into the ring (spill policy)
+			std::vector<uint64_t> spill;
+			/// begin of the first record in spill which is not yet written
+			size_t   spill_pos{ 0 };
+
+			// overflow statistics of this thread
+			uint64_t dropped{ 0 };
+			uint64_t stalls{ 0 };
+			uint64_t spilled{ 0 };
 		};
+
+		/// threads which are not yet joined, for statistics
+		std::vector<tls_data*> threads;
+		std::mutex             threads_mx;
+
+		/**
+		* Wake up a consumer if at least one is parked.
+		* A consumer which misses the doorbell wakes up after its park timeout.
+		*/
+		static inline void ring_doorbell(tls_data * tls) {
+			if (tls->qmeta->parked.load(std::memory_order_relaxed) != 0) {
+				shm->notify();
+			}
+		}
+
+		/** Try to write a whole record into the thread's ring.
+		* Only the shared ring requires locking.
+		* \return false if the ring is full
+		*/
+		static inline bool push(tls_data * tls, const uint64_t * rec, unsigned nwords) {
+			bool success;
+			if (tls->queue_id == ipc::QueueMetadata::shared_queue) {
+				std::lock_guard<ipc::spinlock> lg(tls->queue->mxspin);
+				success = tls->queue->writeAll(rec, nwords);
+			}
+			else {
+				success = tls->queue->writeAll(rec, nwords);
+			}
+			if (success) {
+				ring_doorbell(tls);
+			}
+			return success;
+		}
+
+		/** Move spilled records into the ring as long as there is space */
+		static void drain_spill(tls_data * tls) {
+			auto & spill = tls->spill;
+			while (tls->spill_pos < spill.size()) {
+				const uint64_t * rec = spill.data() + tls->spill_pos;
+				unsigned nwords = ipc::event::header_words(rec[0]);
+				if (!push(tls, rec, nwords))
+					return;
+				tls->spill_pos += nwords;
+			}
+			spill.clear();
+			tls->spill_pos = 0;
+		}
+
+		/** Slow path of \ref write_record, applies the overflow policy */
+		static bool overflow(tls_data * tls, const uint64_t * rec, unsigned nwords) {
+			switch (params.overflow) {
+			case Overflow::BLOCK:
+			{
+				++(tls->stalls);
+				// bounded spin, then wait for the consumer
+				for (unsigned spins = 0; !push(tls, rec, nwords); ++spins) {
+					if (spins < 128)
+						continue;
+					else if (spins < 256)
+						std::this_thread::yield();
+					else {
+						ring_doorbell(tls);
+						std::this_thread::sleep_for(std::chrono::microseconds(100));
+					}
+				}
+				return true;
+			}
+			case Overflow::SPILL:
+			{
+				drain_spill(tls);
+				if (tls->spill.empty() && push(tls, rec, nwords))
+					return true;
+				if (tls->spill.size() + nwords > params.max_spill_words) {
+					++(tls->dropped);
+					return false;
+				}
+				tls->spill.insert(tls->spill.end(), rec, rec + nwords);
+				++(tls->spilled);
+				return true;
+			}
+			default:
+				++(tls->dropped);
+				std::this_thread::yield();
+				return false;
+			}
+		}
+
+		/**
+		* Writes a whole record into the thread's ring or
+		* applies the overflow policy if the ring is full.
+		* \return false if the record is dropped
+		*/
+		static inline bool write_record(tls_data * tls, const uint64_t * rec, unsigned nwords) {
+			if (tls->spill.empty() && push(tls, rec, nwords))
+				return true;
+			return overflow(tls, rec, nwords);
+		}
+
+		/**
+		* Write a record which must not be dropped, also flushes the spill buffer.
+		* Used for all events except memory accesses, as missing sync or
+		* allocation events lead to false positives in the consumer.
+		*/
+		static void write_record_sync(tls_data * tls, const uint64_t * rec, unsigned nwords) {
+			while (!tls->spill.empty()) {
+				drain_spill(tls);
+				std::this_thread::yield();
+			}
+			while (!push(tls, rec, nwords)) {
+				std::this_thread::yield();
+			}
+		}
+
+		/**
+		* Try to write an acquire or release record, whose last word is set
+		* to the next global sync sequence number. The number is only taken
+		* if the record fits, hence the records of each ring are in sequence
+		* order and the consumer never waits for a record behind a held one.
+		*/
+		static inline bool push_sequenced(tls_data * tls, uint64_t * rec, unsigned nwords) {
+			auto write = [tls, rec, nwords]() {
+				if (tls->queue->writeAvailable() < nwords)
+					return false;
+				rec[nwords - 1] = tls->qmeta->sync_seq.fetch_add(1, std::memory_order_relaxed);
+				return tls->queue->writeAll(rec, nwords);
+			};
+			bool success;
+			if (tls->queue_id == ipc::QueueMetadata::shared_queue) {
+				std::lock_guard<ipc::spinlock> lg(tls->queue->mxspin);
+				success = write();
+			}
+			else {
+				success = write();
+			}
+			if (success) {
+				ring_doorbell(tls);
+			}
+			return success;
+		}
+
+		/** Write an acquire or release record, see \ref push_sequenced */
+		static void write_record_sequenced(tls_data * tls, uint64_t * rec, unsigned nwords) {
+			while (!tls->spill.empty()) {
+				drain_spill(tls);
+				std::this_thread::yield();
+			}
+			while (!push_sequenced(tls, rec, nwords)) {
+				std::this_thread::yield();
+			}
+		}
+
+		/** Add the overflow statistics of a thread to the shared counters */
+		static void publish_stats(tls_data * tls) {
+			ipc::QueueMetadata * qmeta = shm->get();
+			qmeta->dropped.fetch_add(tls->dropped, std::memory_order_relaxed);
+			qmeta->stalls.fetch_add(tls->stalls, std::memory_order_relaxed);
+			qmeta->spilled.fetch_add(tls->spilled, std::memory_order_relaxed);
+		}
+
+		static void parse_args(int argc, const char ** argv) {
+			int processed = 1;
+			while (processed < argc) {
+				if (strncmp(argv[processed], "--overflow", 16) == 0 && processed + 1 < argc) {
+					std::string policy(argv[processed + 1]);
+					if (policy == "block")
+						params.overflow = Overflow::BLOCK;
+					else if (policy == "spill")
+						params.overflow = Overflow::SPILL;
+					else
+						params.overflow = Overflow::DROP;
+					processed += 2;
+				}
+				else {
+					++processed;
+				}
+			}
+		}
+
+		static void print_config() {
+			const char * policies[] = { "block", "drop", "spill" };
+			std::cout << "> Detector Configuration:\n"
+				<< "> overflow:  " << policies[(int)params.overflow] << std::endl
+				<< "> version:   " << detector::version() << std::endl;
+		}
+
+		/** Encodes a memory access with a delta encoded callstack */
+		static inline void mem_access(
+			tls_data * tls,
+			ipc::event::Type type,
+			void* callstack,
+			unsigned stacksize,
+			void* addr,
+			size_t size)
+		{
+			using namespace ipc::event;
+			const uint64_t * stack = (const uint64_t*)callstack;
+			if (stacksize > max_stack_size) {
+				// keep innermost frames
+				stack += stacksize - max_stack_size;
+				stacksize = max_stack_size;
+			}
+
+			// number of outermost frames which are equal to last stack
+			unsigned keep = 0;
+			unsigned max_keep = std::min(stacksize, tls->last_stacksize);
+			while (keep < max_keep && stack[keep] == tls->last_stack[keep]) {
+				++keep;
+			}
+
+			uint64_t rec[max_record_words];
+			unsigned nwords = 2 + (stacksize - keep);
+			rec[0] = make_header(type, nwords, keep, (unsigned)std::min<size_t>(size, 0xFF), tls->thread_id);
+			rec[1] = (uint64_t)addr;
+			memcpy(rec + 2, stack + keep, (stacksize - keep) * sizeof(uint64_t));
+
+			if (write_record(tls, rec, nwords)) {
+				// the consumer only sees committed stacks
+				memcpy(tls->last_stack + keep, stack + keep, (stacksize - keep) * sizeof(uint64_t));
+				tls->last_stacksize = stacksize;
+			}
+		}
 	} // namespace extsan
 } // namespace detector
 
-std::unique_ptr<detector::extsan::shm_t> shm;
+using namespace detector::extsan;
 
 bool detector::init(int argc, const char **argv, Callback rc_clb) {
-	shm = std::make_unique<ipc::SharedMemory<ipc::QueueMetadata, true>>("drace-events", false);
+	parse_args(argc, argv);
+	print_config();
+
+	shm.reset(new shm_t("drace-events", false));
+	if (nullptr == shm->get() || shm->get()->num_queues.load() == 0) {
+		std::cerr << "could not attach to event queues, is MSR running?" << std::endl;
+		return false;
+	}
 	return true;
 }
 
 void detector::finalize() {
+	if (nullptr != shm->get()) {
+		{
+			// threads which are not joined yet
+			std::lock_guard<std::mutex> lg(threads_mx);
+			for (auto * tls : threads) {
+				publish_stats(tls);
+			}
+			threads.clear();
+		}
+		const ipc::QueueMetadata * qmeta = shm->get();
+		std::cout << "> ----- EXTSAN SUMMARY -----\n"
+			<< "> dropped events: " << qmeta->dropped.load() << "\n"
+			<< "> stalls:         " << qmeta->stalls.load() << "\n"
+			<< "> spilled events: " << qmeta->spilled.load() << std::endl;
+	}
 	shm.reset();
 }
 
@@ -57,19 +336,15 @@ void detector::acquire(
 	bool write)
 {
 	using namespace extsan;
-	auto * queue = (ipc::queue_t*)(tls);
-
-	ipc::event::BufferEntry entry;
-	entry.type = ipc::event::Type::ACQUIRE;
-	auto * buf = (ipc::event::Mutex*)(entry.buffer);
-	buf->thread_id = ((tls_data*)&tls)->thread_id;
-	buf->acquire = true;
-	buf->addr = (uint64_t)mutex;
-	buf->recursive = recursive;
-	buf->write = write;
-
-	std::lock_guard<ipc::spinlock> lg(queue->mxspin);
-	queue->insert(&entry);
+	using namespace ipc::event;
+	auto * data = (tls_data*)(tls);
+
+	uint64_t rec[4] = {
+		make_header(Type::ACQUIRE, 4, write ? mutex_write : 0, 0, data->thread_id),
+		(uint64_t)mutex,
+		(uint64_t)recursive,
+		0 };
+	write_record_sequenced(data, rec, 4);
 }
 
 /* Release a mutex */
@@ -79,18 +354,15 @@ void detector::release(
 	bool write)
 {
 	using namespace extsan;
-	auto * queue = (ipc::queue_t*)(tls);
-
-	ipc::event::BufferEntry entry;
-	entry.type = ipc::event::Type::RELEASE;
-	auto * buf = (ipc::event::Mutex*)(entry.buffer);
-	buf->thread_id = ((tls_data*)&tls)->thread_id;
-	buf->acquire = false;
-	buf->addr = (uint64_t)mutex;
-	buf->write = write;
-
-	std::lock_guard<ipc::spinlock> lg(queue->mxspin);
-	queue->insert(&entry);
+	using namespace ipc::event;
+	auto * data = (tls_data*)(tls);
+
+	uint64_t rec[4] = {
+		make_header(Type::RELEASE, 4, write ? mutex_write : 0, 0, data->thread_id),
+		(uint64_t)mutex,
+		0,
+		0 };
+	write_record_sequenced(data, rec, 4);
 }
 
 void detector::happens_before(tid_t thread_id, void* identifier) { }
@@ -99,112 +371,91 @@ void detector::happens_after(tid_t thread_id, void* identifier) { }
 
 void detector::read(tls_t tls, void* callstack, unsigned stacksize, void* addr, size_t size)
 {
-	using namespace extsan;
-	auto * queue = (ipc::queue_t*)(tls);
-
-	std::lock_guard<ipc::spinlock> lg(queue->mxspin);
-
-	ipc::event::BufferEntry * entry = queue->get_next_write_slot();
-	if (nullptr == entry) {
-		std::this_thread::yield();
-		return; // Queue is full
-	}
-
-	entry->type = ipc::event::Type::MEMREAD;
-	auto * buf = (ipc::event::MemAccess*)(entry->buffer);
-	buf->thread_id = ((tls_data*)&tls)->thread_id;
-	memcpy(buf->callstack.data(), callstack, stacksize * sizeof(void*));
-	buf->stacksize = stacksize;
-	buf->addr = (uint64_t)addr;
-	queue->commit_write();
+	extsan::mem_access((extsan::tls_data*)tls, ipc::event::Type::MEMREAD, callstack, stacksize, addr, size);
 }
 
 void detector::write(tls_t tls, void* callstack, unsigned stacksize, void* addr, size_t size)
 {
-	using namespace extsan;
-	auto * queue = (ipc::queue_t*)(tls);
-
-	std::lock_guard<ipc::spinlock> lg(queue->mxspin);
-
-	ipc::event::BufferEntry * entry = queue->get_next_write_slot();
-	if (nullptr == entry) {
-		std::this_thread::yield();
-		return; // Queue is full
-	}
-
-	entry->type = ipc::event::Type::MEMWRITE;
-	auto * buf = (ipc::event::MemAccess*)(entry->buffer);
-	buf->thread_id = ((tls_data*)&tls)->thread_id;
-	memcpy(buf->callstack.data(), callstack, stacksize * sizeof(void*));
-	buf->stacksize = stacksize;
-	buf->addr = (uint64_t)addr;
-	queue->commit_write();
+	extsan::mem_access((extsan::tls_data*)tls, ipc::event::Type::MEMWRITE, callstack, stacksize, addr, size);
 }
 
 void detector::allocate(tls_t tls, void* pc, void* addr, size_t size)
 {
 	using namespace extsan;
-	auto * queue = (ipc::queue_t*)(tls);
-
-	ipc::event::BufferEntry entry;
-	entry.type = ipc::event::Type::ALLOCATION;
-	auto * buf = (ipc::event::Allocation*)(entry.buffer);
-	buf->pc = (uint64_t)pc;
-	buf->addr = (uint64_t)addr;
-	buf->size = size;
-	buf->thread_id = ((tls_data*)&tls)->thread_id;
-
-	std::lock_guard<ipc::spinlock> lg(queue->mxspin);
-	queue->insert(&entry);
+	using namespace ipc::event;
+	auto * data = (tls_data*)(tls);
+
+	uint64_t rec[4] = {
+		make_header(Type::ALLOCATION, 4, 0, 0, data->thread_id),
+		(uint64_t)pc,
+		(uint64_t)addr,
+		(uint64_t)size };
+	write_record_sync(data, rec, 4);
 }
 
 void detector::deallocate(tls_t tls, void* addr) {
 	using namespace extsan;
-	auto * queue = (ipc::queue_t*)(tls);
+	using namespace ipc::event;
+	auto * data = (tls_data*)(tls);
 
-	ipc::event::BufferEntry entry;
-	entry.type = ipc::event::Type::FREE;
-	auto * buf = (ipc::event::Allocation*)(entry.buffer);
-	buf->addr = (uint64_t)addr;
-	buf->thread_id = ((tls_data*)&tls)->thread_id;
+	uint64_t rec[2] = {
+		make_header(Type::FREE, 2, 0, 0, data->thread_id),
+		(uint64_t)addr };
+	write_record_sync(data, rec, 2);
+}
+
+void detector::own_range(tls_t tls, void* pc, void* addr, size_t size)
+{
+	// the range is represented by its first byte, see tsan detector
+	extsan::mem_access((extsan::tls_data*)tls, ipc::event::Type::MEMWRITE, &pc, 1, addr, 1);
+}
 
-	std::lock_guard<ipc::spinlock> lg(queue->mxspin);
-	queue->insert(&entry);
+void detector::transfer_range(tls_t tls, void* pc, void* addr, size_t size)
+{
+	extsan::mem_access((extsan::tls_data*)tls, ipc::event::Type::MEMREAD, &pc, 1, addr, 1);
 }
 
 void detector::fork(tid_t parent, tid_t child, tls_t * tls) {
 	using namespace extsan;
+	using namespace ipc::event;
 	ipc::QueueMetadata * qmeta = shm->get();
-	auto & queue = qmeta->queues[++qmeta->next_queue % ipc::QueueMetadata::num_queues];
-	auto tls_ = new tls_data;
-
-	tls_->thread_id = child;
-	tls_->queue = &queue;
-
-	ipc::event::BufferEntry entry;
-	entry.type = ipc::event::Type::FORK;
-	auto * buf = (ipc::event::ForkJoin*)(entry.buffer);
-	buf->child = child;
-	buf->parent = parent;
+	auto data = new tls_data;
+
+	// called on the child thread, hence the ring has a single producer
+	data->thread_id = child;
+	data->queue_id = qmeta->claim();
+	data->queue = &(qmeta->queue(data->queue_id));
+	data->qmeta = qmeta;
+	data->last_stacksize = 0;
+	*tls = (tls_t)data;
+	{
+		std::lock_guard<std::mutex> lg(threads_mx);
+		threads.push_back(data);
+	}
 
-	std::lock_guard<ipc::spinlock> lg(queue.mxspin);
-	queue.insert(entry);
-	*tls = (tls_t)tls_;
+	uint64_t rec[2] = {
+		make_header(Type::FORK, 2, 0, 0, child),
+		(uint64_t)parent };
+	write_record_sync(data, rec, 2);
 }
 
 void detector::join(tid_t parent, tid_t child, tls_t tls) {
 	using namespace extsan;
-	auto * queue = ((tls_data*)&tls)->queue;
-
-	ipc::event::BufferEntry entry;
-	entry.type = ipc::event::Type::JOIN;
-	auto * buf = (ipc::event::ForkJoin*)(entry.buffer);
-	buf->child = child;
-	buf->parent = parent;
-
-	std::lock_guard<ipc::spinlock> lg(queue->mxspin);
-	queue->insert(&entry);
-	delete ((tls_data*)&tls);
+	using namespace ipc::event;
+	auto * data = (tls_data*)(tls);
+
+	uint64_t rec[2] = {
+		make_header(Type::JOIN, 2, 0, 0, child),
+		(uint64_t)parent };
+	write_record_sync(data, rec, 2);
+
+	shm->get()->release(data->queue_id);
+	{
+		std::lock_guard<std::mutex> lg(threads_mx);
+		threads.erase(std::find(threads.begin(), threads.end(), data));
+	}
+	publish_stats(data);
+	delete data;
 }
 
 std::string detector::name() {
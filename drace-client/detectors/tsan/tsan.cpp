@@ -305,6 +305,18 @@ void detector::deallocate(tls_t tls, void* addr) {
 	}
 }
 
+void detector::own_range(tls_t tls, void* pc, void* addr, size_t size) {
+	// the range is represented by its first byte, which is
+	// written by the owner and read on transfer
+	uint64_t addr_32 = lower_half((uint64_t)addr);
+	__tsan_write(tls, (void*)addr_32, pc, &pc, 1);
+}
+
+void detector::transfer_range(tls_t tls, void* pc, void* addr, size_t size) {
+	uint64_t addr_32 = lower_half((uint64_t)addr);
+	__tsan_read(tls, (void*)addr_32, pc, &pc, 1);
+}
+
 void detector::fork(tid_t parent, tid_t child, tls_t * tls) {
 	*tls = __tsan_create_thread(child);
 
@@ -13,6 +13,9 @@
 #include <dr_api.h>
 #include "ipc/SMData.h"
 
+#include <string>
+#include <vector>
+
 namespace drace {
 	/** Provides routines to perform communication with MSR */
 	class MSR {
@@ -24,8 +27,20 @@ namespace drace {
 		static bool request_symbols(const module_data_t * mod);
 		static void unload_symbols(app_pc mod_start);
 
+		/** Resolve a managed pc. Results are cached */
 		static ::ipc::SymbolInfo lookup_address(app_pc pc);
-		static ::ipc::SymbolResponse search_symbol(const module_data_t * mod, const std::string & match, bool full_search);
+		/**
+		* Resolve multiple managed pcs using batch requests
+		* and store the results in the cache
+		*/
+		static void lookup_addresses(const app_pc * pcs, size_t count);
+		/** Search a symbol, returns the adresses of all matches */
+		static std::vector<uint64_t> search_symbol(const module_data_t * mod, const std::string & match, bool full_search);
+		/** Search multiple symbols at once. Requests are pipelined if the MSR supports it */
+		static std::vector<std::vector<uint64_t>> search_symbols(
+			const module_data_t * mod,
+			const std::vector<std::string> & matches,
+			bool full_search);
 
 		static void getCurrentStack(int thread_id, void* rbp, void* rsp, void* rip);
 	};
@@ -55,6 +55,16 @@ namespace drace {
 			deallocate(_alloc_ctx);
 		}
 
+		/**
+		* Uses externally managed memory of the given capacity.
+		* The memory is not freed by this buffer.
+		*/
+		void assign(T * mem, size_t capacity) {
+			deallocate(_alloc_ctx);
+			DR_ASSERT(((uint64_t)mem % alignment) == 0);
+			data = mem;
+		}
+
 		/** deallocate this buffer using the provided drcontext.
 		 * If no context is provided, the context at allocation time is used
 		 */
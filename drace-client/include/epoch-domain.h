@@ -0,0 +1,187 @@
+#pragma once
+/*
+ * DRace, a dynamic data race detector
+ *
+ * Copyright 2018 Siemens AG
+ *
+ * Authors:
+ *   Felix Moessbauer <felix.moessbauer@siemens.com>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <atomic>
+
+#include <dr_api.h>
+
+namespace drace {
+	/**
+	* Epoch based memory reclamation (RCU-style) with per-thread reader words.
+	*
+	* Each reader owns a slot, which is only written by the reader itself:
+	* it holds the global epoch while the reader is inside a read-side
+	* critical section and 0 otherwise. Hence, readers do not perform
+	* read-modify-write operations on shared cache lines.
+	* A writer first unpublishes the data and then calls \ref synchronize,
+	* which advances the epoch and waits until each slot is either inactive
+	* or was entered after the advance. Afterwards, the data can be freed.
+	*
+	* Readers without a slot (\ref NO_SLOT) register in the shared counter of the
+	* current epoch parity instead, which is drained by the writer.
+	* Slots are allocated in cache-line sized entries, which are added in chunks
+	* on demand and never freed before the domain is destroyed.
+	*/
+	class EpochDomain {
+	public:
+		static constexpr unsigned CHUNK = 256;
+		static constexpr unsigned MAX_CHUNKS = 1024;
+		/// max number of reader slots
+		static constexpr unsigned capacity = CHUNK * MAX_CHUNKS;
+		/// readers without a slot, e.g. unregistered threads
+		static constexpr unsigned NO_SLOT = ~0u;
+
+	private:
+		struct alignas(64) Reader {
+			/// epoch of the active critical section, 0 if inactive
+			std::atomic<uint64_t> epoch;
+		};
+
+		std::atomic<Reader*>  _chunks[MAX_CHUNKS];
+		std::atomic<uint64_t> _epoch{ 1 };
+		/// number of active readers without a slot per epoch parity
+		std::atomic<unsigned> _shared_readers[2];
+		/// serializes grace periods
+		void * _sync_mx;
+
+	public:
+		/// token of a nested critical section, see \ref enter
+		static constexpr unsigned NESTED = 0;
+		/// token of a critical section on a reader slot
+		static constexpr unsigned ACTIVE = 1;
+		/// token of a shared reader, plus the epoch parity
+		static constexpr unsigned SHARED = 2;
+
+		/**
+		* Read-side critical section. Data obtained from the protected
+		* structure is valid until the guard is destroyed.
+		* Guards of the same slot can be nested.
+		*/
+		class Guard {
+			EpochDomain & _dom;
+			unsigned      _slot;
+			unsigned      _token;
+		public:
+			Guard(EpochDomain & dom, unsigned slot)
+				: _dom(dom), _slot(slot), _token(dom.enter(slot)) { }
+			~Guard() {
+				_dom.leave(_slot, _token);
+			}
+			Guard(const Guard &) = delete;
+			Guard & operator=(const Guard &) = delete;
+		};
+
+		EpochDomain() {
+			for (unsigned c = 0; c < MAX_CHUNKS; ++c) {
+				_chunks[c].store(nullptr, std::memory_order_relaxed);
+			}
+			_shared_readers[0].store(0, std::memory_order_relaxed);
+			_shared_readers[1].store(0, std::memory_order_relaxed);
+			_sync_mx = dr_mutex_create();
+		}
+
+		~EpochDomain() {
+			for (unsigned c = 0; c < MAX_CHUNKS; ++c) {
+				delete[] _chunks[c].load(std::memory_order_relaxed);
+			}
+			dr_mutex_destroy(_sync_mx);
+		}
+
+		/**
+		* Enters a read-side critical section on the given slot.
+		* Returns the token which has to be passed to \ref leave.
+		*/
+		unsigned enter(unsigned slot) {
+			if (slot >= capacity) {
+				while (true) {
+					unsigned parity = _epoch.load(std::memory_order_seq_cst) & 1;
+					_shared_readers[parity].fetch_add(1, std::memory_order_seq_cst);
+					// epoch advanced in between, the writer might not see us
+					if ((_epoch.load(std::memory_order_seq_cst) & 1) == parity)
+						return SHARED + parity;
+					_shared_readers[parity].fetch_sub(1, std::memory_order_release);
+				}
+			}
+			std::atomic<uint64_t> & word = get_reader(slot).epoch;
+			if (word.load(std::memory_order_relaxed) != 0)
+				return NESTED;
+			word.store(_epoch.load(std::memory_order_relaxed), std::memory_order_relaxed);
+			// order the announcement before the reads of the protected data
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			return ACTIVE;
+		}
+
+		void leave(unsigned slot, unsigned token) {
+			if (token >= SHARED) {
+				_shared_readers[token - SHARED].fetch_sub(1, std::memory_order_release);
+			}
+			else if (token == ACTIVE) {
+				get_reader(slot).epoch.store(0, std::memory_order_release);
+			}
+		}
+
+		/**
+		* Waits until all readers which might have seen unpublished data left.
+		* Must not be called inside a read-side critical section of this domain.
+		*/
+		void synchronize() {
+			dr_mutex_lock(_sync_mx);
+			// order the unpublication before the scan of the slots
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			const uint64_t epoch = _epoch.fetch_add(1, std::memory_order_seq_cst) + 1;
+			unsigned waits = 0;
+			for (unsigned c = 0; c < MAX_CHUNKS; ++c) {
+				Reader * readers = _chunks[c].load(std::memory_order_acquire);
+				if (readers == nullptr)
+					continue;
+				for (unsigned i = 0; i < CHUNK; ++i) {
+					while (true) {
+						uint64_t seen = readers[i].epoch.load(std::memory_order_acquire);
+						if (seen == 0 || seen >= epoch)
+							break;
+						if (++waits > 100) {
+							dr_thread_yield();
+						}
+					}
+				}
+			}
+			// shared readers of the previous epoch
+			while (_shared_readers[(epoch - 1) & 1].load(std::memory_order_seq_cst) != 0) {
+				if (++waits > 100) {
+					dr_thread_yield();
+				}
+			}
+			dr_mutex_unlock(_sync_mx);
+		}
+
+	private:
+		/** Returns the reader slot, allocates its chunk if required */
+		Reader & get_reader(unsigned slot) {
+			std::atomic<Reader*> & chunk = _chunks[slot / CHUNK];
+			Reader * readers = chunk.load(std::memory_order_acquire);
+			if (readers == nullptr) {
+				Reader * fresh = new Reader[CHUNK];
+				for (unsigned i = 0; i < CHUNK; ++i) {
+					fresh[i].epoch.store(0, std::memory_order_relaxed);
+				}
+				if (chunk.compare_exchange_strong(readers, fresh, std::memory_order_acq_rel)) {
+					readers = fresh;
+				}
+				else {
+					// concurrently allocated by another thread
+					delete[] fresh;
+				}
+			}
+			return readers[slot % CHUNK];
+		}
+	};
+}
@@ -0,0 +1,142 @@
+#pragma once
+/*
+ * DRace, a dynamic data race detector
+ *
+ * Copyright 2018 Siemens AG
+ *
+ * Authors:
+ *   Felix Moessbauer <felix.moessbauer@siemens.com>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include <unordered_map>
+#include <type_traits>
+
+#if defined(_M_X64) || defined(__SSE2__)
+#include <emmintrin.h>
+#define DRACE_FLATMAP_SSE2
+#endif
+
+namespace drace {
+	/**
+	* Associative container for a small number of 64 bit keys.
+	* The first N elements are stored in a flat array which is searched
+	* linearly (two keys at a time using SSE2). Further elements are
+	* stored in a heap allocated hash map, which is only created if needed.
+	* This is tuned for the per-thread mutex bookkeeping, where a thread
+	* rarely holds more than a handful of locks at a time.
+	* \note References to values are invalidated by \ref erase
+	*/
+	template<typename Key, typename Value, unsigned N = 16>
+	class FlatMap {
+		static_assert(sizeof(Key) == 8 && std::is_integral<Key>::value, "only 64 bit integral keys are supported");
+		static_assert(N > 0 && N % 2 == 0, "capacity has to be a multiple of two");
+
+		using overflow_t = std::unordered_map<Key, Value>;
+
+		/// keys of the inline elements, only the first _size entries are valid.
+		/// The container itself is not aligned (placement new in thread-local memory)
+		Key      _keys[N]{};
+		Value    _values[N];
+		unsigned _size{ 0 };
+		/// elements which do not fit into the inline storage
+		std::unique_ptr<overflow_t> _overflow;
+
+	public:
+		/** Returns a pointer to the value of key, nullptr if not found */
+		inline Value * find(Key key) {
+			int pos = search(key);
+			if (pos >= 0)
+				return &_values[pos];
+			if (_overflow) {
+				auto it = _overflow->find(key);
+				if (it != _overflow->end())
+					return &(it->second);
+			}
+			return nullptr;
+		}
+
+		/** Returns the value of key, inserts a value-initialized element if not found */
+		inline Value & operator[](Key key) {
+			Value * val = find(key);
+			if (val != nullptr)
+				return *val;
+			if (_size < N) {
+				_keys[_size] = key;
+				_values[_size] = Value();
+				return _values[_size++];
+			}
+			if (!_overflow)
+				_overflow.reset(new overflow_t());
+			return (*_overflow)[key];
+		}
+
+		inline size_t count(Key key) const {
+			if (search(key) >= 0)
+				return 1;
+			return _overflow ? _overflow->count(key) : 0;
+		}
+
+		/** Removes the element, returns the number of removed elements */
+		size_t erase(Key key) {
+			int pos = search(key);
+			if (pos < 0)
+				return _overflow ? _overflow->erase(key) : 0;
+
+			--_size;
+			_keys[pos] = _keys[_size];
+			_values[pos] = _values[_size];
+			// refill the inline storage from the heap
+			if (_overflow && !_overflow->empty()) {
+				auto it = _overflow->begin();
+				_keys[_size] = it->first;
+				_values[_size] = it->second;
+				++_size;
+				_overflow->erase(it);
+			}
+			return 1;
+		}
+
+		inline size_t size() const {
+			return _size + (_overflow ? _overflow->size() : 0);
+		}
+
+		inline bool empty() const {
+			return size() == 0;
+		}
+
+		void clear() {
+			_size = 0;
+			_overflow.reset();
+		}
+
+	private:
+		/** Position of key in the inline storage, -1 if not found */
+		inline int search(Key key) const {
+#ifdef DRACE_FLATMAP_SSE2
+			const __m128i needle = _mm_set1_epi64x((long long)key);
+			for (unsigned i = 0; i < _size; i += 2) {
+				__m128i cmp = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)(_keys + i)), needle);
+				// both 32 bit halves have to match
+				cmp = _mm_and_si128(cmp, _mm_shuffle_epi32(cmp, _MM_SHUFFLE(2, 3, 0, 1)));
+				int mask = _mm_movemask_pd(_mm_castsi128_pd(cmp));
+				if (mask & 1)
+					return i;
+				// second key may be beyond the end
+				if ((mask & 2) && (i + 1) < _size)
+					return i + 1;
+			}
+#else
+			for (unsigned i = 0; i < _size; ++i) {
+				if (_keys[i] == key)
+					return i;
+			}
+#endif
+			return -1;
+		}
+	};
+}
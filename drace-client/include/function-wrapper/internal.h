@@ -21,9 +21,19 @@ namespace drace {
 		using wrapcb_pre_t = void(void *, void **);
 		using wrapcb_post_t = void(void *, void *);
 
+		struct wrap_info_t;
+
 		namespace internal {
+			/** Wrap info and found symbol offsets of a symbol search */
+			struct search_info_t {
+				wrap_info_t         * info;
+				std::vector<size_t> * offsets;
+			};
+
 			void wrap_dotnet_helper(uint64_t addr);
 			bool wrap_function_clbck(const char *name, size_t modoffs, void *data);
+			/** Like \ref wrap_function_clbck but records the offset, data is a search_info_t */
+			bool wrap_and_record_clbck(const char *name, size_t modoffs, void *data);
 
 			bool mutex_wrap_callback(const char *name, size_t modoffs, void *data);
 		} // namespace internal
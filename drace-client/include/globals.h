@@ -17,6 +17,8 @@
 
 #include "config.h"
 #include "aligned-stack.h"
+#include "flat-map.h"
+#include "module/Cache.h"
 
 #include <string>
 #include <unordered_map>
@@ -26,8 +28,8 @@
 
 #include <dr_api.h>
 
-/// max number of individual mutexes per thread
-constexpr int MUTEX_MAP_SIZE = 128;
+/// number of individual mutexes per thread which are tracked without heap allocations
+constexpr unsigned MUTEX_MAP_SIZE = 16;
 
 /** Upper limit of process address space according to
 *   https://docs.microsoft.com/en-us/windows-hardware/drivers/gettingstarted/virtual-address-spaces
@@ -45,6 +47,9 @@ namespace drace {
 		bool     excl_traces{ false };
 		bool     excl_stack{ false };
 		bool     exclude_master{ false };
+		bool     excl_single{ false };
+		bool     excl_private{ false };
+		bool     excl_readonly{ false };
 		bool     delayed_sym_lookup{ false };
 		bool     fastmode{ true };
 		/** Use external controller */
@@ -54,6 +59,9 @@ namespace drace {
 		std::string  config_file{ "drace.ini" };
 		std::string  out_file;
 		std::string  xml_file;
+		std::string  bin_file;
+		std::string  json_file;
+		std::string  modcache_file;
 		std::string  logfile{ "stderr" };
 
 		// Raw arguments
@@ -65,20 +73,18 @@ namespace drace {
 	class Statistics;
 
 	/** Per Thread data (thread-private)
-	* \warning This struct is not default-constructed
-	*          but just allocated as a memory block and casted
-	*          Initialisation is done in the thread-creation event
-	*          in memory_instr.
+	* \warning This struct is not allocated using new
+	*          but constructed in a block of the \ref ThreadSlab
+	*          in the thread-creation event in memory_instr.
+	*
+	* The fields which are accessed by the instrumentation
+	* are placed in the first cache line.
 	*/
 	struct per_thread_t {
 		using tls_map_t = std::vector<std::pair<thread_id_t, per_thread_t*>>;
 
-		byte         *buf_ptr;
-		ptr_int_t     buf_end;
-		AlignedBuffer<byte, 64> mem_buf;
-
-		void         *cache;
-		thread_id_t   tid;
+		byte         *buf_ptr{ nullptr };
+		ptr_int_t     buf_end{ 0 };
 		/**
 		* Represents the detector state.
 		* If value==0 the detector is disabled.
@@ -89,36 +95,59 @@ namespace drace {
 		* @endcode
 		*/
 		uint64_t    enabled{ true };
+		/**
+		* Detector state of the current block (lossy-flush): the detector state
+		* if the code region of the block is instrumented, 0 otherwise.
+		* Set by the block header, changes of \ref enabled take effect at the next block.
+		*/
+		uint64_t    block_enabled{ true };
 		/// inverse of flush pending, jmpecxz
 		std::atomic<ptr_uint_t> no_flush{ false };
+		/// begin of this threads stack range
+		ULONG_PTR appstack_beg{ 0x0 };
+		/// end of this threads stack range
+		ULONG_PTR appstack_end{ 0x0 };
+		thread_id_t   tid;
+		/// local sampling state
+		int sampling_pos = 0;
+
+		/// memory buffer, located in the thread slab
+		alignas(64) AlignedBuffer<byte, 64> mem_buf;
+		/// Shadow Stack, located in the thread slab
+		AlignedStack<void*, 64> stack;
+		/// cache of recently instrumented modules
+		module::Cache mod_cache;
 		/// external flush is currently executed;
 		std::atomic<bool> external_flush{ false };
-		/// Shadow Stack
-		AlignedStack<void*, 64> stack;
+		/// flush requested by the external controller (fast-mode),
+		/// the buffer is analyzed by this thread at its next call or flush
+		std::atomic<bool> ext_flush_req{ false };
 		/// Stack used to track state of detector
 		uint64        event_cnt{ 0 };
 		/// bool external change detected
 		/// this flag is used to trigger the enable or disable
 		/// logic on this thread
 		bool enable_external{ true };
-
-		/// begin of this threads stack range
-		ULONG_PTR appstack_beg{ 0x0 };
-		/// end of this threads stack range
-		ULONG_PTR appstack_end{ 0x0 };
+		/// generation of the external control block seen by this thread
+		uint32_t ext_generation{ 0 };
+		/// last synchronization epoch seen by this thread (excl-readonly)
+		uint32_t epoch_seen{ 0 };
+		/// thread phase when the current buffer was started (excl-single)
+		uint32_t buf_phase{ 0 };
+		/// true, if this was the only thread when the current buffer was started
+		bool buf_single{ false };
 
 		/** book-keeping of active mutexes
-		 * All even indices are mutex addresses
-		 * while uneven indices denote the number of
-		 * references at the location in index-1.
+		 * Maps the mutex address to the number of
+		 * references (recursive locks) of this thread.
 		 * This is tuned for maximum cache-locality */
-		std::unordered_map<uint64_t, unsigned> mutex_book;
+		FlatMap<uint64_t, unsigned, MUTEX_MAP_SIZE> mutex_book;
 		/// Used for event syncronisation procedure
 		tls_map_t     th_towait;
-		/// Statistics
-		std::unique_ptr<Statistics>   stats;
-		/// local sampling state
-		int sampling_pos = 0;
+		/// slot in the thread registry, also used as reader slot of epoch domains
+		unsigned      registry_slot{ ~0u };
+		/// Statistics, located in the thread slab
+		Statistics   *stats{ nullptr };
 		/**
 		 * as the detector cannot allocate TLS,
 		 * use this ptr for per-thread data in detector */
@@ -127,11 +156,17 @@ namespace drace {
 
 	/** Thread local storage */
 	extern int      tls_idx;
-	extern std::unordered_map<thread_id_t, per_thread_t*> TLS_buckets;
-	extern void* tls_rw_mutex;
+
+	template<typename T, unsigned N>
+	class ThreadRegistry;
+	using thread_registry_t = ThreadRegistry<per_thread_t, 4096>;
+	/// per-thread data of all running threads
+	extern std::unique_ptr<thread_registry_t> thread_registry;
 
 	// TODO check if global is better
 	extern std::atomic<int> num_threads_active;
+	/// incremented after a thread is added to num_threads_active (excl-single)
+	extern std::atomic<uint32_t> thread_phase;
 	extern std::atomic<uint> runtime_tid;
 	extern std::atomic<thread_id_t> last_th_start;
 	extern std::atomic<bool> th_start_pending;
@@ -148,6 +183,8 @@ namespace drace {
 
 	// Global mutex to synchronize threads
 	extern void* th_mutex;
+	/// protects merging of thread statistics into the global ones
+	extern void* stats_mutex;
 
 	class MemoryTracker;
 	extern std::unique_ptr<MemoryTracker> memory_tracker;
@@ -155,6 +192,12 @@ namespace drace {
 	class RaceCollector;
 	extern std::unique_ptr<RaceCollector> race_collector;
 
+	class PageOwnership;
+	extern std::unique_ptr<PageOwnership> page_ownership;
+
+	class PageEpochs;
+	extern std::unique_ptr<PageEpochs> page_epochs;
+
 	// Global Configuration
 	extern drace::Config config;
 
@@ -168,6 +211,9 @@ namespace drace {
 		template<bool, bool>
 		class MtSyncSHMDriver;
 
+		template<bool, bool>
+		class RingSHMDriver;
+
 		template<typename T, bool>
 		class SharedMemory;
 
@@ -176,6 +222,7 @@ namespace drace {
 
 namespace drace {
 	extern std::unique_ptr<::ipc::MtSyncSHMDriver<true, true>> shmdriver;
+	extern std::unique_ptr<::ipc::RingSHMDriver<true, true>> shmring;
 	extern std::unique_ptr<::ipc::SharedMemory<ipc::ClientCB, true>> extcb;
 }
 
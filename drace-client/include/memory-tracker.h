@@ -12,6 +12,7 @@
 
 #include "Module.h"
 #include "statistics.h"
+#include "ipc/SMData.h"
 
 #include <dr_api.h>
 #include <drmgr.h>
@@ -27,6 +28,8 @@
 #undef max
 
 namespace drace {
+	class ThreadSlab;
+
 	/**
 	* Covers application memory tracing.
 	* Responsible for adding all instrumentation code (except function wrapping).
@@ -35,9 +38,18 @@ namespace drace {
 	*/
 	class MemoryTracker {
 	public:
-		/** Single memory reference */
+		/** Single entry of the per-thread buffer */
 		struct mem_ref_t {
-			bool  write;
+			/** Kind of the entry. Accesses are written as 32 bit value (write flag) by the instrumentation */
+			enum kind_t : uint32_t {
+				READ = 0,
+				WRITE = 1,
+				/// allocation of size bytes at addr by function pc
+				ALLOC = 2,
+				/// entry of a block which is reserved but not written yet
+				RESERVED = 3
+			};
+			uint32_t kind;
 			void *addr;
 			size_t size;
 			app_pc pc;
@@ -46,6 +58,11 @@ namespace drace {
 		/** Maximum number of references between clean calls */
 		static constexpr int MAX_NUM_MEM_REFS = 128;
 		static constexpr int MEM_BUF_SIZE = sizeof(mem_ref_t) * MAX_NUM_MEM_REFS;
+		/**
+		* Maximum number of references of a block which are written using a single buffer update.
+		* This number of entries is allocated behind the buffer and used as sink if the detector is disabled.
+		*/
+		static constexpr int MAX_BLOCK_REFS = 32;
 
 		/** aggregate frequent pc's on this granularity (2^n bytes)*/
 		static constexpr unsigned HIST_PC_RES = 10;
@@ -69,8 +86,6 @@ namespace drace {
 		/* XCX registers */
 		drvector_t allowed_xcx;
 
-		module::Cache mc;
-
 		// fast random numbers for sampling
 		std::mt19937 _prng;
 
@@ -81,6 +96,22 @@ namespace drace {
 		/// current pos in period
 		int _sample_pos = 0;
 
+		/// generation of the external control block whose settings are applied
+		std::atomic<uint32_t> _ext_generation{ 0 };
+		/// last handled flush request of the external control block
+		uint32_t _ext_flush_seq{ 0 };
+
+		/**
+		 * Guards the region state of all modules (\ref module::Metadata::region_refs).
+		 * With lossy-flush, the state of the code region of 2^HIST_PC_RES bytes is checked
+		 * inline once per block, hence regions can be switched on and off without flushing
+		 * the code cache.
+		 */
+		void * _region_mx;
+
+		/** recycled blocks of per-thread data and buffers */
+		std::unique_ptr<ThreadSlab> _slab;
+
 		static const std::mt19937::result_type _max_value = decltype(_prng)::max();
 
 	public:
@@ -91,6 +122,18 @@ namespace drace {
 		static void process_buffer(void);
 		static void clear_buffer(void);
 		static void analyze_access(per_thread_t * data);
+		/** Forward an allocation entry to the detector, reserved entries are skipped */
+		static void analyze_alloc(per_thread_t * data, const mem_ref_t * mem_ref);
+		/** Reset the buffer and record the thread phase it is started in */
+		static void begin_buffer(per_thread_t * data);
+		/** Discard the accesses in the buffer of this thread, allocation entries are still processed */
+		static void discard_buffer(per_thread_t * data);
+		/**
+		* Mark the accesses in the buffer of another thread as processed.
+		* The allocation entries are kept, as the detector state of
+		* this thread must only be changed by the thread itself.
+		*/
+		static void invalidate_accesses(per_thread_t * data);
 		static void flush_all_threads(per_thread_t * data, bool self = true, bool flush_external = false);
 
 		// Events
@@ -158,6 +201,25 @@ namespace drace {
 			data->event_cnt++;
 		}
 
+		/**
+		* Appends an allocation event to the buffer of this thread.
+		* The event is processed in order with the memory accesses of this thread,
+		* hence no flush of other threads is required.
+		* \note Must only be called by the thread owning data
+		*/
+		static inline void buffer_event(per_thread_t * data, mem_ref_t::kind_t kind, void * addr, size_t size, void * pc) {
+			// the inline instrumentation only flushes if buf_ptr equals the end
+			if (data->buf_ptr + sizeof(mem_ref_t) >= data->mem_buf.data + MEM_BUF_SIZE) {
+				process_buffer();
+			}
+			mem_ref_t * ref = (mem_ref_t*)data->buf_ptr;
+			ref->kind = kind;
+			ref->addr = addr;
+			ref->size = size;
+			ref->pc = (app_pc)pc;
+			data->buf_ptr += sizeof(mem_ref_t);
+		}
+
 		/** Update the code cache and remove items where the instrumentation should change.
 		 * We only consider traces, as other parts are not performance critical
 		 */
@@ -165,6 +227,20 @@ namespace drace {
 
 		static bool pc_in_freq(per_thread_t * data, void* bb);
 
+		/** Skip the instrumentation of this region (pc >> HIST_PC_RES) */
+		void disable_region(uint64_t region);
+		/** Instrument this region again, if there is no other request to disable it */
+		void enable_region(uint64_t region);
+		/**
+		* Returns the state flag of the region of pc (1: instrumented), or nullptr
+		* if the region cannot be switched (no lossy-flush or pc not in a known module)
+		*/
+		static uint8_t * region_flag(app_pc pc);
+		/** Offset of the detector state which is checked by the instrumentation */
+		static inline int enabled_offset() {
+			return params.lossy_flush ? offsetof(per_thread_t, block_enabled) : offsetof(per_thread_t, enabled);
+		}
+
 	private:
 
 		void code_cache_init(void);
@@ -175,11 +251,35 @@ namespace drace {
 		void MemoryTracker::insert_jmp_on_flush(void *drcontext, instrlist_t *ilist, instr_t *where,
 			reg_id_t regxcx, reg_id_t regtls, instr_t *call_flush);
 
+		/**
+		* Inserts action if reg_addr points into the stack range of this thread (only if excl-stack).
+		* \note requires reserved aflags
+		*/
+		void insert_stack_check(void *drcontext, instrlist_t *ilist, instr_t *where,
+			reg_id_t reg_addr, reg_id_t regtls, instr_t *action);
+
+		/**
+		* Inserts the block header which combines the detector state and the state of
+		* the code region of the block start into per_thread_t::block_enabled (only if lossy-flush).
+		* The instrumentation of the block checks this field instead of the detector state.
+		*/
+		void insert_region_header(void *drcontext, instrlist_t *ilist, instr_t *where, app_pc pc);
+
 		/** Instrument all memory accessing instructions */
 		void instrument_mem_full(void *drcontext, instrlist_t *ilist, instr_t *where, opnd_t ref, bool write);
 		/** Instrument all memory accessing instructions (fast-mode)*/
 		void instrument_mem_fast(void *drcontext, instrlist_t *ilist, instr_t *where, opnd_t ref, bool write);
 
+		/**
+		* Reserve buffer space for all num_refs references of the block (fast-mode).
+		* Afterwards, reg_buf points to the first reserved entry, or to a sink if
+		* the detector is disabled. reg_buf has to be kept until the last reference is written.
+		*/
+		void insert_block_header(void *drcontext, instrlist_t *ilist, instr_t *where, reg_id_t reg_buf, unsigned num_refs);
+		/** Write a single reference to the entry at index of the reserved block buffer (fast-mode) */
+		void instrument_mem_block(void *drcontext, instrlist_t *ilist, instr_t *where, opnd_t ref, bool write,
+			reg_id_t reg_buf, unsigned index);
+
 		/**
 		* instrument_mem is called whenever a memory reference is identified.
 		* It inserts code before the memory reference to to fill the memory buffer
@@ -197,6 +297,9 @@ namespace drace {
 		/** Read data from external CB and modify instrumentation / detection accordingly */
 		void handle_ext_state(per_thread_t * data);
 
+		/** Apply the process-wide settings of the external CB */
+		void apply_ext_config(per_thread_t * data, const ipc::ClientCB & cb);
+
 		void update_sampling();
 	};
 
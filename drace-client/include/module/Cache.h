@@ -10,31 +10,73 @@
  * SPDX-License-Identifier: MIT
  */
 
-#include "Tracker.h"
+#include <dr_api.h>
 
 namespace drace {
 	namespace module {
+		class Metadata;
+
+		/**
+		* Small multi-way cache of module ranges (thread-private).
+		* The least recently used entry is evicted on an update.
+		* As the cache stores weak pointers to modules, all entries are
+		* invalidated if the module snapshot generation changes.
+		*/
 		class Cache {
+		public:
+			/// number of cached modules
+			static constexpr int ways = 4;
+
 		private:
-			/** keep last module here for faster lookup
-			*  we use a week pointer as we do not obtain ownership */
-			Metadata*  _mod{ nullptr };
-			app_pc       _start;
-			app_pc       _end;
+			struct Entry {
+				app_pc     start{ nullptr };
+				app_pc     end{ nullptr };
+				/// we use a weak pointer as we do not obtain ownership
+				Metadata * mod{ nullptr };
+			};
+
+			/// most recently used entry first
+			Entry    _entries[ways];
+			uint64_t _generation{ 0 };
 
 		public:
-			/** Lookup last module in cache, returns (found, instrument)*/
-			inline Metadata* lookup(app_pc pc) {
-				if (!_mod) return nullptr;
-				if (pc >= _start && pc < _end) {
-					return _mod;
+			/** Lookup module in cache, returns nullptr if not found */
+			inline Metadata* lookup(app_pc pc, uint64_t generation) {
+				if (generation != _generation) {
+					clear();
+					_generation = generation;
+					return nullptr;
+				}
+				for (int i = 0; i < ways; ++i) {
+					if (pc >= _entries[i].start && pc < _entries[i].end) {
+						if (i != 0) {
+							// move to front
+							Entry hit = _entries[i];
+							for (int j = i; j > 0; --j) {
+								_entries[j] = _entries[j - 1];
+							}
+							_entries[0] = hit;
+						}
+						return _entries[0].mod;
+					}
 				}
 				return nullptr;
 			}
-			inline void update(Metadata * mod) {
-				_mod = mod;
-				_start = _mod->info->start;
-				_end = _mod->info->end;
+
+			/** Insert module as most recently used entry */
+			inline void update(Metadata * mod, app_pc start, app_pc end) {
+				for (int i = ways - 1; i > 0; --i) {
+					_entries[i] = _entries[i - 1];
+				}
+				_entries[0].start = start;
+				_entries[0].end = end;
+				_entries[0].mod = mod;
+			}
+
+			inline void clear() {
+				for (auto & e : _entries) {
+					e = Entry();
+				}
 			}
 		};
 	} // namespace module
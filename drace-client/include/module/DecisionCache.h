@@ -0,0 +1,89 @@
+#pragma once
+/*
+ * DRace, a dynamic data race detector
+ *
+ * Copyright 2018 Siemens AG
+ *
+ * Authors:
+ *   Felix Moessbauer <felix.moessbauer@siemens.com>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "Metadata.h"
+
+#include <dr_api.h>
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+namespace drace {
+	namespace module {
+		/**
+		* Persistent cache of per-module instrumentation decisions.
+		*
+		* Modules are identified by their path, timestamp and checksum.
+		* For each module, the instrumentation flags, the module type,
+		* the availability of debug information and the offsets of all
+		* symbols found using a debug-symbol search are stored.
+		* The cache is loaded on startup and written back on shutdown.
+		* If the exclusion rules change, the whole cache is discarded.
+		*
+		* All methods are thread-safe.
+		*/
+		class DecisionCache {
+		public:
+			struct Decision {
+				Metadata::INSTR_FLAGS    instrument;
+				Metadata::MOD_TYPE_FLAGS modtype;
+				bool                     debug_info;
+			};
+
+		private:
+			struct Entry {
+				bool     has_decision{ false };
+				Decision decision;
+				/// symbol pattern -> offsets relative to module base
+				std::unordered_map<std::string, std::vector<size_t>> symbols;
+			};
+
+			std::string _filename;
+			/// fingerprint of the rules the decisions depend on
+			uint64_t    _config_hash;
+			std::unordered_map<std::string, Entry> _entries;
+			void *      _mx;
+			bool        _dirty{ false };
+
+			static std::string make_key(const module_data_t * mod);
+
+			void load();
+
+		public:
+			DecisionCache(const std::string & filename, uint64_t config_hash);
+			~DecisionCache();
+
+			DecisionCache(const DecisionCache &) = delete;
+			DecisionCache & operator=(const DecisionCache &) = delete;
+
+			/** Returns true and sets \c dec if a decision for this module is cached */
+			bool lookup(const module_data_t * mod, Decision & dec) const;
+			void store(const module_data_t * mod, const Decision & dec);
+
+			/**
+			* Returns true and fills \c offsets if the debug-symbol search
+			* for this pattern in this module is cached
+			*/
+			bool lookup_symbol(const module_data_t * mod, const std::string & pattern,
+				std::vector<size_t> & offsets) const;
+			void store_symbol(const module_data_t * mod, const std::string & pattern,
+				const std::vector<size_t> & offsets);
+
+			/** Writes the cache to disk if it was changed */
+			void save();
+
+			/** Stable (FNV-1a) hash to fingerprint configuration items */
+			static uint64_t hash(const std::vector<std::string> & items, uint64_t seed = 0xcbf29ce484222325ull);
+		};
+	} // namespace module
+} // namespace drace
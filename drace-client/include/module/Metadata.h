@@ -11,6 +11,9 @@
  */
 
 #include "../globals.h"
+#include <algorithm>
+#include <atomic>
+#include <memory>
 #include <dr_api.h>
 
 namespace drace {
@@ -46,6 +49,18 @@ namespace drace {
 			MOD_TYPE_FLAGS modtype{ MOD_TYPE_FLAGS::UNKNOWN };
 			module_data_t *info{ nullptr };
 			bool   debug_info;
+			/// memory instrumentation disabled by the external controller,
+			/// changed while other threads instrument this module
+			std::atomic<bool> ext_disabled{ false };
+			/**
+			* Instrumentation state per code region (lossy-flush, 1: instrumented),
+			* indexed by \ref region_index. The flags are checked by the instrumented
+			* code, hence they are never reallocated. Copies of the metadata do not
+			* share the region state.
+			*/
+			std::unique_ptr<uint8_t[]> region_enabled;
+			/// number of requests to disable a region, guarded by the region mutex of the memory tracker
+			std::unique_ptr<uint16_t[]> region_refs;
 
 		private:
 			/**
@@ -77,7 +92,8 @@ namespace drace {
 				loaded(other.loaded),
 				instrument(other.instrument),
 				modtype(other.modtype),
-				debug_info(other.debug_info)
+				debug_info(other.debug_info),
+				ext_disabled(other.ext_disabled.load(std::memory_order_relaxed))
 			{
 				info = dr_copy_module_data(other.info);
 			}
@@ -90,11 +106,35 @@ namespace drace {
 				instrument(other.instrument),
 				info(other.info),
 				modtype(other.modtype),
-				debug_info(other.debug_info)
+				debug_info(other.debug_info),
+				ext_disabled(other.ext_disabled.load(std::memory_order_relaxed)),
+				region_enabled(std::move(other.region_enabled)),
+				region_refs(std::move(other.region_refs))
 			{
 				other.info = nullptr;
 			}
 
+			/**
+			* Allocates the region state with one entry per region of 2^res bytes.
+			* All regions are instrumented initially.
+			*/
+			void init_regions(unsigned res) {
+				size_t num = ((ptr_uint_t)(end - 1) >> res) - ((ptr_uint_t)base >> res) + 1;
+				region_enabled.reset(new uint8_t[num]);
+				region_refs.reset(new uint16_t[num]());
+				std::fill_n(region_enabled.get(), num, (uint8_t)1);
+			}
+
+			/** Index of the region (pc >> res) in the region state, the region has to be part of this module */
+			inline size_t region_index(uint64_t region, unsigned res) const {
+				return (size_t)(region - ((ptr_uint_t)base >> res));
+			}
+
+			/** Instrumentation flags, considering the external controller */
+			inline INSTR_FLAGS effective_instrument() const {
+				return ext_disabled.load(std::memory_order_relaxed) ? (INSTR_FLAGS)(instrument & ~INSTR_FLAGS::MEMORY) : instrument;
+			}
+
 			void set_info(const module_data_t * mod) {
 				info = dr_copy_module_data(mod);
 				tag_module();
@@ -110,6 +150,7 @@ namespace drace {
 				info = dr_copy_module_data(other.info);
 				modtype = other.modtype;
 				debug_info = other.debug_info;
+				ext_disabled.store(other.ext_disabled.load(std::memory_order_relaxed), std::memory_order_relaxed);
 				return *this;
 			}
 
@@ -123,6 +164,9 @@ namespace drace {
 				info = other.info;
 				modtype = other.modtype;
 				debug_info = other.debug_info;
+				ext_disabled.store(other.ext_disabled.load(std::memory_order_relaxed), std::memory_order_relaxed);
+				region_enabled = std::move(other.region_enabled);
+				region_refs = std::move(other.region_refs);
 
 				other.info = nullptr;
 				return *this;
@@ -12,11 +12,17 @@
 
 #include "globals.h"
 #include "Metadata.h"
+#include "DecisionCache.h"
 #include "symbols.h"
+#include "epoch-domain.h"
+#include "thread-registry.h"
 
 #include <dr_api.h>
+#include <algorithm>
 #include <map>
+#include <vector>
 #include <memory>
+#include <atomic>
 
 namespace drace {
 	namespace module {
@@ -24,10 +30,39 @@ namespace drace {
 			/// as we use lower_bound search, we have to reverse the sorting
 			using map_t = std::map<app_pc, std::shared_ptr<Metadata>, std::greater<app_pc>>;
 
+			/**
+			* Immutable, sorted array of all known modules.
+			* A new snapshot is published (RCU-style) whenever the module set
+			* changes, hence readers do not have to take the mod_lock.
+			*/
+			struct Snapshot {
+				struct Entry {
+					app_pc     base;
+					app_pc     end;
+					Metadata * mod;
+				};
+				/// sorted by base (ascending)
+				std::vector<Entry> entries;
+				uint64_t           generation;
+			};
+
 			/// RW mutex for access of modules container
 			void *mod_lock;
 			map_t _modules_idx;
 
+			/// current snapshot, readers only dereference it
+			std::atomic<const Snapshot*> _snapshot{ nullptr };
+			/**
+			* Readers of the snapshot, indexed by the registry slot of the thread.
+			* A replaced snapshot is freed after all readers which might see it left.
+			*/
+			mutable EpochDomain _readers;
+			/// generation of the current snapshot
+			std::atomic<uint64_t> _generation{ 0 };
+
+			/** Build and publish a new snapshot, write-lock has to be held */
+			void publish_snapshot();
+
 		public:
 			using PMetadata = std::shared_ptr<Metadata>;
 
@@ -37,15 +72,42 @@ namespace drace {
 			std::vector<std::string> excluded_mods;
 			std::vector<std::string> excluded_path_prefix;
 
+			/// persistent instrumentation decisions (optional)
+			std::unique_ptr<DecisionCache> decisions;
+
 		public:
 			explicit Tracker(const std::shared_ptr<Symbols> & syms);
 			~Tracker();
 
 			/** Returns a shared_ptr to the module which contains the given program counter.
 			 * If the pc is not in a known module, returns a nullptr
+			 * \note requires the read-lock
 			 */
 			PMetadata get_module_containing(const app_pc pc) const;
 
+			/** Returns the module which contains the given program counter
+			 * or nullptr if the pc is not in a known module.
+			 * This lookup is lock-free. As modules are never removed from the
+			 * tracker, the pointer remains valid until the tracker is destroyed.
+			 */
+			inline Metadata * find_module(const app_pc pc) const {
+				Metadata * result = nullptr;
+				EpochDomain::Guard guard(_readers, current_registry_slot());
+				const Snapshot * snap = _snapshot.load(std::memory_order_acquire);
+				if (nullptr != snap) {
+					const auto & entries = snap->entries;
+					// find first module starting after pc
+					auto it = std::upper_bound(entries.begin(), entries.end(), pc,
+						[](const app_pc val, const Snapshot::Entry & e) { return val < e.base; });
+					if (it != entries.begin()) {
+						--it;
+						if (pc < it->end)
+							result = it->mod;
+					}
+				}
+				return result;
+			}
+
 			/** Registers a new module by moving it */
 			inline PMetadata add(Metadata && mod) {
 				PMetadata ptr = std::make_shared<Metadata>(mod);
@@ -69,6 +131,29 @@ namespace drace {
 			/** Registers a module and sets flags accordingly */
 			PMetadata register_module(const module_data_t * mod, bool loaded);
 
+			/** Marks the module starting at the given address as unloaded */
+			void unregister_module(const module_data_t * mod);
+
+			/** Returns a counter which changes whenever a module is loaded or unloaded
+			* (generation of the current snapshot) */
+			inline uint64_t generation() const {
+				return _generation.load(std::memory_order_acquire);
+			}
+
+			/**
+			* Calls \c func for each currently loaded module.
+			* The read-lock is held during the iteration.
+			*/
+			template<typename Func>
+			void for_each_loaded(Func && func) const {
+				lock_read();
+				for (const auto & m : _modules_idx) {
+					if (m.second->loaded)
+						func(*(m.second));
+				}
+				unlock_read();
+			}
+
 			/** Request a read-lock for the module dataset*/
 			inline void lock_read() const {
 				dr_rwlock_read_lock(mod_lock);
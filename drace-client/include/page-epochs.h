@@ -0,0 +1,105 @@
+#pragma once
+/*
+ * DRace, a dynamic data race detector
+ *
+ * Copyright 2018 Siemens AG
+ *
+ * Authors:
+ *   Felix Moessbauer <felix.moessbauer@siemens.com>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "globals.h"
+
+#include <atomic>
+#include <memory>
+
+namespace drace {
+	/**
+	* Detects pages which are read-only after publication.
+	* The execution is split into synchronization epochs. An epoch is complete,
+	* if each thread executed a synchronization event after it began.
+	* Pages which were not written since the last complete epoch are
+	* considered read-only and reads to them are not analyzed until
+	* the page is written again.
+	* Pages are hashed into a fixed size table, colliding pages share the write epoch.
+	* \note This is a heuristic, as reads are skipped even if the thread did not
+	*       synchronize with the writer.
+	*/
+	class PageEpochs {
+	public:
+		static constexpr unsigned PAGE_BITS = 12;
+		static constexpr unsigned TABLE_BITS = 16;
+
+	private:
+		/// current epoch and number of threads which have seen it, encoded as (epoch << 32 | count)
+		std::atomic<uint64_t> _state{ (uint64_t)1 << 32 };
+		/// last epoch which has been seen by all threads
+		std::atomic<uint32_t> _complete{ 0 };
+		/// epoch of the last write to each page
+		std::unique_ptr<std::atomic<uint32_t>[]> _write_epoch;
+
+	public:
+		PageEpochs()
+			: _write_epoch(new std::atomic<uint32_t>[1 << TABLE_BITS])
+		{
+			for (unsigned i = 0; i < (1 << TABLE_BITS); ++i) {
+				_write_epoch[i].store(0, std::memory_order_relaxed);
+			}
+		}
+
+		/** Mark the page as written in the current epoch */
+		inline void write(uint64_t addr, size_t size) {
+			uint32_t epoch = (uint32_t)(_state.load(std::memory_order_relaxed) >> 32);
+			mark(addr >> PAGE_BITS, epoch);
+			// access spans two pages
+			if (((addr + size - 1) >> PAGE_BITS) != (addr >> PAGE_BITS))
+				mark((addr + size - 1) >> PAGE_BITS, epoch);
+		}
+
+		/** Returns true if the page has not been written since the last complete epoch */
+		inline bool is_read_only(uint64_t addr, size_t size) const {
+			uint32_t complete = _complete.load(std::memory_order_relaxed);
+			return _write_epoch[hash(addr >> PAGE_BITS)].load(std::memory_order_relaxed) < complete
+				&& _write_epoch[hash((addr + size - 1) >> PAGE_BITS)].load(std::memory_order_relaxed) < complete;
+		}
+
+		/**
+		* Called on each synchronization event of a thread.
+		* \param epoch_seen last epoch this thread has seen (thread-private)
+		*/
+		void sync(uint32_t & epoch_seen) {
+			uint64_t state = _state.load(std::memory_order_relaxed);
+			uint32_t epoch = (uint32_t)(state >> 32);
+			if (epoch == epoch_seen)
+				return;
+			epoch_seen = epoch;
+
+			// count this thread, the last one completes the epoch
+			while ((uint32_t)(state >> 32) == epoch) {
+				uint32_t count = (uint32_t)state + 1;
+				bool all = (count >= (uint32_t)num_threads_active.load(std::memory_order_relaxed));
+				uint64_t next = all ? ((uint64_t)(epoch + 1) << 32) : (state + 1);
+				if (_state.compare_exchange_weak(state, next, std::memory_order_relaxed)) {
+					if (all)
+						_complete.store(epoch, std::memory_order_relaxed);
+					return;
+				}
+			}
+			// epoch changed concurrently, this thread is counted at its next event
+		}
+
+	private:
+		static inline unsigned hash(uint64_t page) {
+			return (unsigned)((page * 0x9E3779B97F4A7C15ull) >> (64 - TABLE_BITS));
+		}
+
+		/** only write if changed, as read-mostly pages are shared by all threads */
+		inline void mark(uint64_t page, uint32_t epoch) {
+			std::atomic<uint32_t> & entry = _write_epoch[hash(page)];
+			uint32_t current = entry.load(std::memory_order_relaxed);
+			while (current < epoch && !entry.compare_exchange_weak(current, epoch, std::memory_order_relaxed)) {}
+		}
+	};
+}
@@ -0,0 +1,107 @@
+#pragma once
+/*
+ * DRace, a dynamic data race detector
+ *
+ * Copyright 2018 Siemens AG
+ *
+ * Authors:
+ *   Felix Moessbauer <felix.moessbauer@siemens.com>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "globals.h"
+
+#include <atomic>
+#include <memory>
+
+#include <dr_api.h>
+
+namespace drace {
+	/**
+	* Tracks the thread which first touched a memory page.
+	* Accesses to pages which are only used by a single thread are not
+	* forwarded to the detector. Instead, the owner summarizes its accesses
+	* per flush using \ref detector::own_range. When a second thread touches
+	* the page, it takes it over using \ref detector::transfer_range, which
+	* reports a race if the accesses of the owner do not happen before.
+	* Afterwards, the page is shared and all further accesses are analyzed.
+	* Pages are hashed into a fixed size table, colliding pages are treated as shared.
+	* \note Races between the owner and the second thread are reported at page
+	*       granularity (on the first byte of the page).
+	*/
+	class PageOwnership {
+	public:
+		static constexpr unsigned PAGE_BITS = 12;
+		static constexpr unsigned TABLE_BITS = 18;
+		/// owner of pages which are accessed by multiple threads
+		static constexpr uint64_t SHARED = 0xFFFFFFFF;
+
+		/// Ownership state of a page as seen by an accessing thread
+		enum class State {
+			/// page is owned by the accessing thread
+			OWNED,
+			/// page was owned by another thread and is now shared
+			TRANSFERRED,
+			/// page is shared or not tracked
+			SHARED
+		};
+
+	private:
+		/// entries are encoded as (page << 32 | owner), 0 if empty
+		std::unique_ptr<std::atomic<uint64_t>[]> _table;
+
+	public:
+		PageOwnership()
+			: _table(new std::atomic<uint64_t>[1 << TABLE_BITS])
+		{
+			for (unsigned i = 0; i < (1 << TABLE_BITS); ++i) {
+				_table[i].store(0, std::memory_order_relaxed);
+			}
+		}
+
+		/**
+		* Returns the state of the page after this access. If the page is owned
+		* by another thread, it becomes shared and \ref State::TRANSFERRED is
+		* returned exactly once.
+		*/
+		State access(thread_id_t tid, uint64_t addr, size_t size) {
+			uint64_t page = addr >> PAGE_BITS;
+			// accesses spanning two pages are treated as shared
+			if (page != ((addr + size - 1) >> PAGE_BITS))
+				return State::SHARED;
+
+			std::atomic<uint64_t> & slot = _table[hash(page)];
+			uint64_t entry = slot.load(std::memory_order_relaxed);
+			while (true) {
+				if (entry == 0) {
+					// first touch
+					if (slot.compare_exchange_weak(entry, (page << 32) | tid, std::memory_order_relaxed))
+						return State::OWNED;
+					continue;
+				}
+				if ((entry >> 32) != page) {
+					// collision
+					return State::SHARED;
+				}
+				uint64_t owner = entry & SHARED;
+				if (owner == tid)
+					return State::OWNED;
+				if (owner == SHARED)
+					return State::SHARED;
+				if (slot.compare_exchange_weak(entry, (page << 32) | SHARED, std::memory_order_relaxed))
+					return State::TRANSFERRED;
+			}
+		}
+
+		/// first address of the page containing addr
+		static constexpr uint64_t page_begin(uint64_t addr) {
+			return addr & ~((1ull << PAGE_BITS) - 1);
+		}
+
+	private:
+		static inline unsigned hash(uint64_t page) {
+			return (unsigned)((page * 0x9E3779B97F4A7C15ull) >> (64 - TABLE_BITS));
+		}
+	};
+}
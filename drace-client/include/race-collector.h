@@ -13,6 +13,8 @@
 #include "globals.h"
 #include "symbols.h"
 #include "sink/hr-text.h"
+#include "sink/binary.h"
+#include "sink/json-lines.h"
 
 #include "MSR.h"
 
@@ -20,8 +22,12 @@
 #include <sstream>
 #include <iostream>
 #include <iomanip>
+#include <fstream>
 #include <vector>
 #include <unordered_map>
+#include <set>
+#include <utility>
+#include <atomic>
 #include <chrono>
 
 #include <dr_api.h>
@@ -73,8 +79,20 @@ namespace drace {
 
 		sink::HRText<decltype(std::cout)> _console;
 
+		/// streaming sink for the binary report (optional)
+		std::ofstream _bin_file;
+		std::unique_ptr<sink::Binary<std::ofstream>> _bin_sink;
+		/// streaming sink for JSON Lines output (optional)
+		std::ofstream _json_file;
+		std::unique_ptr<sink::JsonLines<std::ofstream>> _json_sink;
+
 		void *_race_mx;
 
+		/// report each pair of racing instructions only once
+		std::atomic<bool> _dedup{ false };
+		/// pcs of already reported races (ordered pair)
+		std::set<std::pair<uint64_t, uint64_t>> _reported;
+
 	public:
 		RaceCollector(
 			bool delayed_lookup,
@@ -101,29 +119,110 @@ namespace drace {
 		void add_race(const detector::Race * r) {
 			if (num_races() > MAX)
 				return;
+			if (_dedup.load(std::memory_order_relaxed) && !is_new_race(r))
+				return;
 
 			auto ttr = std::chrono::duration_cast<std::chrono::milliseconds>(clock_t::now() - _start_time);
 
-			if (!_delayed_lookup) {
-				DecoratedRace dr(
+			// the sinks get this entry, as _races might be appended concurrently
+			entry_t entry = _delayed_lookup
+				? entry_t(ttr.count(), DecoratedRace(*r))
+				: entry_t(ttr.count(), DecoratedRace(
 					std::move(resolve_symbols(r->first)),
-					std::move(resolve_symbols(r->second)));
+					std::move(resolve_symbols(r->second))));
 
-				//dr_mutex_lock(_race_mx);
-				_races.emplace_back(ttr.count(), dr);
-				//dr_mutex_unlock(_race_mx);
+			if (_bin_sink) {
+				dr_mutex_lock(_race_mx);
+				_bin_sink->process_single_race(entry);
+				dr_mutex_unlock(_race_mx);
 			}
-			else {
-				//dr_mutex_lock(_race_mx);
-				_races.emplace_back(ttr.count(), *r);
-				//dr_mutex_unlock(_race_mx);
+			if (_json_sink) {
+				dr_mutex_lock(_race_mx);
+				_json_sink->process_single_race(entry);
+				dr_mutex_unlock(_race_mx);
 			}
-			print_last_race();
+			print_race(entry);
+
+			//dr_mutex_lock(_race_mx);
+			_races.emplace_back(std::move(entry));
+			//dr_mutex_unlock(_race_mx);
+		}
+
+		/** Enable or disable the filtering of races between already reported pairs of instructions */
+		void set_dedup(bool dedup) {
+			if (dedup != _dedup.exchange(dedup, std::memory_order_relaxed)) {
+				LOG_INFO(-1, "race deduplication %s", dedup ? "ON" : "OFF");
+			}
+		}
+
+		/**
+		* Streams all further races into a binary report file.
+		* As the report contains unresolved stacks, no symbol lookup
+		* is required for this sink.
+		*/
+		bool open_binary_report(
+			const std::string & filename,
+			const module::Tracker & modules,
+			const char * app,
+			std::chrono::system_clock::time_point start)
+		{
+			_bin_file.open(filename, std::ofstream::out | std::ofstream::binary);
+			if (!_bin_file.good())
+				return false;
+			_bin_sink = std::make_unique<sink::Binary<std::ofstream>>(_bin_file, modules, app, start);
+			return true;
+		}
+
+		/**
+		* Streams all further races into a JSON Lines file.
+		* With delayed symbol lookup, only the raw program counters are written.
+		*/
+		bool open_json_report(const std::string & filename) {
+			_json_file.open(filename, std::ofstream::out);
+			if (!_json_file.good())
+				return false;
+			_json_sink = std::make_unique<sink::JsonLines<std::ofstream>>(_json_file);
+			return true;
+		}
+
+		void close_json_report() {
+			if (!_json_sink)
+				return;
+			dr_mutex_lock(_race_mx);
+			_json_sink.reset();
+			_json_file.close();
+			dr_mutex_unlock(_race_mx);
+		}
+
+		/** Marks the binary report as complete and closes it */
+		void close_binary_report(std::chrono::system_clock::time_point stop) {
+			if (!_bin_sink)
+				return;
+			dr_mutex_lock(_race_mx);
+			_bin_sink->finish(stop);
+			_bin_sink.reset();
+			_bin_file.close();
+			dr_mutex_unlock(_race_mx);
+		}
+
+		/** Returns true if no race between these instructions was reported yet */
+		bool is_new_race(const detector::Race * r) {
+			uint64_t a = r->first.stack_size > 0 ? r->first.stack_trace[r->first.stack_size - 1] : 0;
+			uint64_t b = r->second.stack_size > 0 ? r->second.stack_trace[r->second.stack_size - 1] : 0;
+			if (a > b)
+				std::swap(a, b);
+
+			dr_mutex_lock(_race_mx);
+			bool inserted = _reported.emplace(a, b).second;
+			dr_mutex_unlock(_race_mx);
+			return inserted;
 		}
 
 		/** Takes a detector Access Entry, resolves symbols and converts it to a ResolvedAccess */
 		ResolvedAccess resolve_symbols(const detector::AccessEntry & e) const {
 			ResolvedAccess ra(e);
+			// resolve managed frames in a single batch
+			_syms->prefetch(e.stack_trace, e.stack_size);
 			for (unsigned i = 0; i < e.stack_size; ++i) {
 				ra.resolved_stack.emplace_back(_syms->get_symbol_info((app_pc)e.stack_trace[i]));
 			}
@@ -151,9 +250,9 @@ namespace drace {
 			}
 		}
 
-		inline void print_last_race() const {
+		inline void print_race(const entry_t & race) const {
 			DR_ASSERT(!dr_using_app_state(dr_get_current_drcontext()));
-			_console.process_single_race(_races.back());
+			_console.process_single_race(race);
 		}
 
 		const RaceCollectionT & get_races() const {
@@ -78,7 +78,7 @@ namespace drace {
 
 			// Sampling: Possibly disable detector during this function
 			memory_tracker->switch_sampling(data);
-			
+
 			// if lossy_flush, disable detector instead of changeing the instructions
 			if (params.lossy && !params.lossy_flush && MemoryTracker::pc_in_freq(data, call_ins)) {
 				data->enabled = false;
@@ -0,0 +1,144 @@
+#pragma once
+/*
+ * DRace, a dynamic data race detector
+ *
+ * Copyright 2018 Siemens AG
+ *
+ * Authors:
+ *   Felix Moessbauer <felix.moessbauer@siemens.com>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "../race-collector.h"
+#include "../module/Tracker.h"
+
+#include <report/BinaryFormat.h>
+
+#include <chrono>
+#include <limits>
+
+namespace drace {
+	namespace sink {
+		/**
+		* A race exporter which writes races as fixed-size binary records
+		* with unresolved stacks (see report/BinaryFormat.h).
+		* A snapshot of the module map is written whenever it changed
+		* since the last race. Symbols are resolved offline by drace-report.
+		*/
+		template<typename Stream = std::ofstream>
+		class Binary {
+		public:
+			using self_t = Binary<Stream>;
+			using TimePoint = std::chrono::system_clock::time_point;
+
+		private:
+			Stream & _stream;
+			const module::Tracker & _modules;
+			/// module generation of the last written snapshot
+			uint64_t _generation{ std::numeric_limits<uint64_t>::max() };
+
+			template<typename Record>
+			inline void write_record(const Record & rec) {
+				_stream.write(reinterpret_cast<const char*>(&rec), sizeof(Record));
+			}
+
+			static uint64_t to_ms(const TimePoint & tp) {
+				return std::chrono::duration_cast<std::chrono::milliseconds>(
+					tp.time_since_epoch()).count();
+			}
+
+			template<typename Access>
+			static void convert(const Access & ac, report::AccessRecord & rec) {
+				rec.accessed_memory = ac.accessed_memory;
+				rec.access_size = ac.access_size;
+				rec.heap_block_begin = ac.heap_block_begin;
+				rec.heap_block_size = ac.heap_block_size;
+				rec.thread_id = ac.thread_id;
+				rec.access_type = ac.access_type;
+				rec.write = ac.write;
+				rec.onheap = ac.onheap;
+				rec.pad[0] = rec.pad[1] = 0;
+				rec.stack_size = static_cast<uint32_t>(
+					std::min<size_t>(ac.stack_size, report::max_stack_size));
+				std::copy(ac.stack_trace, ac.stack_trace + rec.stack_size, rec.stack_trace);
+				std::fill(rec.stack_trace + rec.stack_size, rec.stack_trace + report::max_stack_size, 0);
+			}
+
+			/** Writes the currently loaded modules if the module map changed */
+			void write_snapshot() {
+				uint64_t gen = _modules.generation();
+				if (gen == _generation)
+					return;
+
+				std::vector<report::ModuleRecord> mods;
+				_modules.for_each_loaded([&mods](const module::Metadata & m) {
+					report::ModuleRecord rec;
+					rec.base = reinterpret_cast<uint64_t>(m.base);
+					rec.end = reinterpret_cast<uint64_t>(m.end);
+					report::copy_string(rec.path,
+						m.info != nullptr ? m.info->full_path : nullptr,
+						report::max_path_len);
+					mods.push_back(rec);
+				});
+
+				report::SnapshotRecord snap;
+				snap.num_modules = static_cast<uint32_t>(mods.size());
+				write_record(snap);
+				for (const auto & rec : mods) {
+					write_record(rec);
+				}
+				_generation = gen;
+			}
+
+		public:
+			Binary() = delete;
+			Binary(const self_t &) = delete;
+			Binary(self_t &&) = default;
+
+			Binary(Stream & stream,
+				const module::Tracker & modules,
+				const char * app,
+				TimePoint start)
+				: _stream(stream),
+				_modules(modules)
+			{
+				report::FileHeader header;
+				header.pid = dr_get_process_id();
+				header.start_time = to_ms(start);
+				report::copy_string(header.app, app, report::max_path_len);
+				write_record(header);
+				_stream.flush();
+			}
+
+			template<typename RaceEntry>
+			void process_single_race(const RaceEntry & race) {
+				write_snapshot();
+
+				report::RaceRecord rec;
+				rec.time = race.first;
+				convert(race.second.first, rec.first);
+				convert(race.second.second, rec.second);
+				write_record(rec);
+				// keep the report usable if the application crashes
+				_stream.flush();
+			}
+
+			template<typename RaceEntry>
+			void process_all(const RaceEntry & races) {
+				for (auto & r : races) {
+					process_single_race(r);
+				}
+			}
+
+			/** Marks the report as complete */
+			void finish(TimePoint stop) {
+				report::EndRecord rec;
+				rec.stop_time = to_ms(stop);
+				write_record(rec);
+				_stream.flush();
+			}
+		};
+
+	} // namespace sink
+} // namespace drace
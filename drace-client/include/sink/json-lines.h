@@ -0,0 +1,81 @@
+#pragma once
+/*
+ * DRace, a dynamic data race detector
+ *
+ * Copyright 2018 Siemens AG
+ *
+ * Authors:
+ *   Felix Moessbauer <felix.moessbauer@siemens.com>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "../race-collector.h"
+
+#include <report/JsonLines.h>
+
+namespace drace {
+	namespace sink {
+		/**
+		* A race exporter which writes one self-contained JSON object
+		* per line (JSON Lines, see report/JsonLines.h). Each race is
+		* flushed immediately, hence the file can be consumed while the
+		* application is running.
+		*/
+		template<typename Stream = std::ofstream>
+		class JsonLines {
+		public:
+			using self_t = JsonLines<Stream>;
+
+		private:
+			Stream &                _stream;
+			report::JsonLinesWriter _writer;
+
+			template<typename Access>
+			void append_access(const Access & ac, bool resolved) {
+				_writer.begin_access(ac);
+				// innermost frame first, as in the text output
+				if (resolved) {
+					size_t ssize = ac.resolved_stack.size();
+					for (size_t p = 0; p < ssize; ++p) {
+						_writer.frame(ac.resolved_stack[ssize - 1 - p]);
+					}
+				}
+				else {
+					for (size_t p = 0; p < ac.stack_size; ++p) {
+						_writer.frame_pc(ac.stack_trace[ac.stack_size - 1 - p]);
+					}
+				}
+				_writer.end_access();
+			}
+
+		public:
+			JsonLines() = delete;
+			JsonLines(const self_t &) = delete;
+			JsonLines(self_t &&) = default;
+
+			explicit JsonLines(Stream & stream)
+				: _stream(stream)
+			{ }
+
+			template<typename RaceEntry>
+			void process_single_race(const RaceEntry & race) {
+				_writer.begin_race(race.first);
+				append_access(race.second.first, race.second.is_resolved);
+				append_access(race.second.second, race.second.is_resolved);
+				_writer.end_race();
+
+				_stream.write(_writer.data(), _writer.size());
+				_stream.flush();
+			}
+
+			template<typename RaceEntry>
+			void process_all(const RaceEntry & races) {
+				for (auto & r : races) {
+					process_single_race(r);
+				}
+			}
+		};
+
+	} // namespace sink
+} // namespace drace
@@ -41,6 +41,8 @@ namespace drace {
 		ms_t time_in_flushes{ 0 };
 		unsigned long module_loads{ 0 };
 		ms_t module_load_duration{ 0 };
+		uint64_t module_cache_hits{ 0 };
+		uint64_t module_cache_misses{ 0 };
 		uint64_t proc_refs{ 0 };
 		uint64_t total_refs{ 0 };
 
@@ -81,7 +83,9 @@ namespace drace {
 				<< "analyzed-refs:\t\t" << std::dec << proc_refs << std::endl
 				<< "total-refs:\t\t" << std::dec << total_refs << std::endl
 				<< "module loads:\t\t" << std::dec << module_loads << std::endl
-				<< "mod. load time(total):\t" << std::dec << module_load_duration.count() << "ms" << std::endl;
+				<< "mod. load time(total):\t" << std::dec << module_load_duration.count() << "ms" << std::endl
+				<< "mod. cache hits:\t" << std::dec << module_cache_hits << std::endl
+				<< "mod. cache misses:\t" << std::dec << module_cache_misses << std::endl;
 			s << "top pages:\t\t";
 			for (const auto & p : freq_hits) {
 				s << "(" << std::hex << p.first << "," << std::dec << p.second << "),";
@@ -107,6 +111,8 @@ namespace drace {
 			time_in_flushes += other.time_in_flushes;
 			module_loads += other.module_loads;
 			module_load_duration += other.module_load_duration;
+			module_cache_hits += other.module_cache_hits;
+			module_cache_misses += other.module_cache_misses;
 			proc_refs += other.proc_refs;
 			total_refs += other.total_refs;
 			return *this;
@@ -96,6 +96,11 @@ namespace drace {
 		*/
 		SymbolLocation get_symbol_info(app_pc pc);
 
+		/** Resolve the managed pcs of a callstack at once (using the MSR),
+		*  so that subsequent calls to \ref get_symbol_info are served from the cache.
+		*/
+		void prefetch(const uint64_t * pcs, size_t count);
+
 		/** Returns true if debug info is available for this module
 		* Returns false if only exports are available
 		*/
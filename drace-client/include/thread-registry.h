@@ -0,0 +1,174 @@
+#pragma once
+/*
+ * DRace, a dynamic data race detector
+ *
+ * Copyright 2018 Siemens AG
+ *
+ * Authors:
+ *   Felix Moessbauer <felix.moessbauer@siemens.com>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <atomic>
+#include <memory>
+
+#include <dr_api.h>
+#include <drmgr.h>
+
+#include "globals.h"
+#include "epoch-domain.h"
+
+namespace drace {
+	/**
+	* Registry of the per-thread data of all running threads.
+	* Each thread occupies one slot, which is claimed and released
+	* without locking. Readers can iterate the slots while threads
+	* are inserted or removed concurrently.
+	*
+	* Memory reclamation uses per-thread reader epochs (\ref EpochDomain),
+	* the reader slot of a thread is its slot in this registry (\ref ReadGuard).
+	* A removing thread clears its slot and waits until no reader can hold
+	* a pointer to the removed data anymore. Afterwards it can be freed.
+	* Only removals serialize among each other during this grace period.
+	*
+	* Slots are allocated in chunks of N entries, which are added on demand
+	* and never freed before the registry is destroyed.
+	*/
+	template<typename T, unsigned N = 4096>
+	class ThreadRegistry {
+	public:
+		static constexpr unsigned MAX_CHUNKS = 64;
+		/// max number of concurrently registered threads
+		static constexpr unsigned capacity = N * MAX_CHUNKS;
+		/// slot of threads which could not be registered
+		static constexpr unsigned INVALID = capacity;
+
+	private:
+		std::atomic<std::atomic<T*>*> _chunks[MAX_CHUNKS];
+		/// slots [0, _high) might be in use
+		std::atomic<unsigned> _high{ 0 };
+
+		static_assert(capacity <= EpochDomain::capacity, "each slot requires a reader slot");
+
+		/// readers, indexed by the slot of the reading thread
+		EpochDomain _readers;
+
+	public:
+		/**
+		* Read-side critical section. Pointers obtained from the
+		* registry are valid until the guard is destroyed.
+		* Guards must not be held while removing a thread.
+		*/
+		class ReadGuard {
+			EpochDomain::Guard _guard;
+		public:
+			/// slot is the registry slot of the calling thread, see \ref current_registry_slot
+			ReadGuard(ThreadRegistry & reg, unsigned slot)
+				: _guard(reg._readers, slot) { }
+		};
+
+		ThreadRegistry()
+		{
+			for (unsigned c = 0; c < MAX_CHUNKS; ++c) {
+				_chunks[c].store(nullptr, std::memory_order_relaxed);
+			}
+		}
+
+		~ThreadRegistry() {
+			for (unsigned c = 0; c < MAX_CHUNKS; ++c) {
+				delete[] _chunks[c].load(std::memory_order_relaxed);
+			}
+		}
+
+		/**
+		* Publishes the data of a new thread, returns the claimed slot.
+		* If all slots are in use, the thread is not registered and \ref INVALID is returned.
+		*/
+		unsigned insert(T * data) {
+			for (unsigned i = 0; i < capacity; ++i) {
+				std::atomic<T*> & slot = get_slot(i);
+				T * expected = nullptr;
+				if (slot.load(std::memory_order_relaxed) == nullptr &&
+					slot.compare_exchange_strong(expected, data, std::memory_order_seq_cst))
+				{
+					unsigned high = _high.load(std::memory_order_relaxed);
+					while (high <= i && !_high.compare_exchange_weak(high, i + 1, std::memory_order_seq_cst)) {}
+					return i;
+				}
+			}
+			return INVALID;
+		}
+
+		/**
+		* Removes the data from the registry and waits until no reader
+		* can access it anymore. Afterwards the data can be freed.
+		*/
+		void remove(unsigned slot) {
+			if (slot == INVALID)
+				return;
+			get_slot(slot).store(nullptr, std::memory_order_seq_cst);
+			_readers.synchronize();
+		}
+
+		/**
+		* Calls f(T*) for each registered thread.
+		* \note a \ref ReadGuard has to be held
+		*/
+		template<typename F>
+		void for_each(F && f) const {
+			unsigned high = _high.load(std::memory_order_seq_cst);
+			for (unsigned i = 0; i < high; ++i) {
+				T * data = _chunks[i / N].load(std::memory_order_acquire)[i % N].load(std::memory_order_seq_cst);
+				if (data != nullptr)
+					f(data);
+			}
+		}
+
+		/**
+		* Returns the data of the thread, nullptr if not registered.
+		* \note a \ref ReadGuard has to be held
+		*/
+		T * find(thread_id_t tid) const {
+			T * result = nullptr;
+			for_each([&](T * data) {
+				if (data->tid == tid)
+					result = data;
+			});
+			return result;
+		}
+
+	private:
+		/** Returns the slot, allocates its chunk if required */
+		std::atomic<T*> & get_slot(unsigned i) {
+			std::atomic<std::atomic<T*>*> & chunk = _chunks[i / N];
+			std::atomic<T*> * slots = chunk.load(std::memory_order_acquire);
+			if (slots == nullptr) {
+				std::atomic<T*> * fresh = new std::atomic<T*>[N];
+				for (unsigned j = 0; j < N; ++j) {
+					fresh[j].store(nullptr, std::memory_order_relaxed);
+				}
+				if (chunk.compare_exchange_strong(slots, fresh, std::memory_order_acq_rel)) {
+					slots = fresh;
+				}
+				else {
+					// concurrently allocated by another thread
+					delete[] fresh;
+				}
+			}
+			return slots[i % N];
+		}
+	};
+
+	/**
+	* Returns the registry slot of the calling thread, which is its reader slot
+	* in epoch domains. Returns \ref EpochDomain::NO_SLOT if not registered.
+	*/
+	inline unsigned current_registry_slot() {
+		void * drcontext = dr_get_current_drcontext();
+		if (nullptr == drcontext)
+			return EpochDomain::NO_SLOT;
+		per_thread_t * data = (per_thread_t*)drmgr_get_tls_field(drcontext, tls_idx);
+		return (nullptr != data) ? data->registry_slot : EpochDomain::NO_SLOT;
+	}
+}
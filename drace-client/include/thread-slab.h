@@ -0,0 +1,135 @@
+#pragma once
+/*
+ * DRace, a dynamic data race detector
+ *
+ * Copyright 2018 Siemens AG
+ *
+ * Authors:
+ *   Felix Moessbauer <felix.moessbauer@siemens.com>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "globals.h"
+#include "statistics.h"
+
+#include <new>
+
+#include <dr_api.h>
+
+namespace drace {
+	/**
+	* Recycled global slab of thread blocks.
+	* Each block holds the per-thread data together with its statistics,
+	* memory buffer and shadow stack, each part starting at a cache line:
+	* @code
+	* | per_thread_t | Statistics | memory buffer | shadow stack |
+	* @endcode
+	* Blocks of exited threads are kept on a free list and handed out
+	* to new threads, hence thread start and exit usually do not allocate.
+	* \note The blocks are not thread-private, as they are reused by other threads.
+	*/
+	class ThreadSlab {
+	public:
+		static constexpr size_t CACHE_LINE = 64;
+		/// maximum number of blocks kept on the free list
+		static constexpr unsigned MAX_CACHED = 64;
+
+	private:
+		size_t _buf_size;
+		size_t _stack_size;
+
+		size_t _off_stats;
+		size_t _off_buf;
+		size_t _off_stack;
+		size_t _block_size;
+
+		/// singly linked list through the first word of the free blocks, guarded by _mx
+		void *   _free{ nullptr };
+		unsigned _num_free{ 0 };
+		void *   _mx;
+
+	public:
+		/**
+		* \param buf_size size of the memory buffer in bytes
+		* \param stack_size number of entries of the shadow stack
+		*/
+		ThreadSlab(size_t buf_size, size_t stack_size)
+			: _buf_size(buf_size),
+			_stack_size(stack_size)
+		{
+			_off_stats = align(sizeof(per_thread_t));
+			_off_buf = _off_stats + align(sizeof(Statistics));
+			_off_stack = _off_buf + align(_buf_size);
+			_block_size = _off_stack + align(_stack_size * sizeof(void*));
+			_mx = dr_mutex_create();
+		}
+
+		~ThreadSlab() {
+			while (_free != nullptr) {
+				void * block = _free;
+				_free = *(void**)block;
+				free_block(block);
+			}
+			dr_mutex_destroy(_mx);
+		}
+
+		/** Constructs the per-thread data of a new thread in a (recycled) block */
+		per_thread_t * acquire(thread_id_t tid) {
+			byte * block = nullptr;
+			dr_mutex_lock(_mx);
+			if (_free != nullptr) {
+				block = (byte*)_free;
+				_free = *(void**)block;
+				--_num_free;
+			}
+			dr_mutex_unlock(_mx);
+			if (block == nullptr) {
+				block = alloc_block();
+			}
+
+			per_thread_t * data = new (block) per_thread_t;
+			data->tid = tid;
+			data->stats = new (block + _off_stats) Statistics(tid);
+			data->mem_buf.assign(block + _off_buf, _buf_size);
+			data->stack.assign((void**)(block + _off_stack), _stack_size);
+			return data;
+		}
+
+		/** Destructs the per-thread data and recycles its block */
+		void release(per_thread_t * data) {
+			data->stats->~Statistics();
+			data->~per_thread_t();
+
+			void * block = (void*)data;
+			dr_mutex_lock(_mx);
+			if (_num_free < MAX_CACHED) {
+				*(void**)block = _free;
+				_free = block;
+				++_num_free;
+				block = nullptr;
+			}
+			dr_mutex_unlock(_mx);
+			if (block != nullptr) {
+				free_block(block);
+			}
+		}
+
+	private:
+		static inline size_t align(size_t size) {
+			return (size + CACHE_LINE - 1) & ~(CACHE_LINE - 1);
+		}
+
+		/** dr_global_alloc only guarantees pointer alignment, hence store the raw pointer in front */
+		byte * alloc_block() {
+			byte * raw = (byte*)dr_global_alloc(_block_size + CACHE_LINE + sizeof(void*));
+			byte * block = (byte*)align((size_t)(raw + sizeof(void*)));
+			*((void**)block - 1) = raw;
+			return block;
+		}
+
+		void free_block(void * block) {
+			dr_global_free(*((void**)block - 1), _block_size + CACHE_LINE + sizeof(void*));
+		}
+	};
+}
@@ -13,10 +13,22 @@
 #include "globals.h"
 #include "ipc/SMData.h"
 #include "ipc/MtSyncSHMDriver.h"
+#include "ipc/RingSHMDriver.h"
 
 #include <mutex>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <cstring>
+#include <new>
 
 namespace drace {
+	/**
+	* Resolved managed pcs. Protected by the lock of the shmdriver.
+	* \note jitted code might be unloaded, hence the cache is
+	*       cleared when symbols are unloaded.
+	*/
+	static std::unordered_map<uint64_t, ipc::SymbolInfo> sym_cache;
 
 	void MSR::wait_heart_beat() {
 		while (shmdriver->wait_receive(std::chrono::seconds(2)) && shmdriver->id() == ipc::SMDataID::WAIT)
@@ -39,8 +51,24 @@ namespace drace {
 				extcb = std::make_unique<ipc::SharedMemory<ipc::ClientCB, true>>(DRACE_SMR_CB_NAME, false);
 				DR_ASSERT(extcb->get() != nullptr);
 				// TODO: Error handling (rarely necessary)
-				// Initialize extcb
-				extcb->get()->sampling_rate.store(params.sampling_rate, std::memory_order_relaxed);
+				if (extcb->get()->version != ipc::ClientCB::current_version) {
+					LOG_WARN(0, "MSR control block has version %u, expected %u. External control disabled",
+						extcb->get()->version, ipc::ClientCB::current_version);
+					extcb.reset();
+				}
+				else {
+					// Initialize extcb with our settings, as they are not a change
+					// the generation is not incremented
+					extcb->get()->sampling_rate.store(params.sampling_rate, std::memory_order_relaxed);
+					extcb->get()->instr_rate.store(params.instr_rate, std::memory_order_relaxed);
+				}
+
+				// Pipelined requests, not available in older MSR versions
+				shmring = std::make_unique<ipc::RingSHMDriver<true, true>>(DRACE_SMR_RING_NAME, false);
+				if (!shmring->valid()) {
+					LOG_WARN(0, "MSR request ring not available, use synchronous requests");
+					shmring.reset();
+				}
 			}
 			else {
 				LOG_WARN(0, "MSR is not ready to connect");
@@ -94,20 +122,114 @@ namespace drace {
 		return static_cast<bool>(shmdriver);
 	}
 
+	/**
+	* Performs a request using the request ring if available,
+	* otherwise using the synchronous control channel.
+	* \param fill constructs the request in the message buffer
+	* \param read consumes the response (id and buffer)
+	* \return false if the MSR did not respond in time
+	*/
+	template<typename FillF, typename ReadF>
+	static bool transact(ipc::SMDataID mid, FillF && fill, ReadF && read) {
+		if (shmring) {
+			ipc::SMSlot * slot = shmring->acquire();
+			slot->id = mid;
+			fill(slot->buffer);
+			shmring->submit(slot);
+			// the MSR signals progress using the heartbeat counter
+			if (!shmring->await(slot, std::chrono::seconds(100))) {
+				LOG_WARN(0, "Timeout expired");
+				return false;
+			}
+			read(slot->id, (const char*)slot->buffer);
+			shmring->release(slot);
+			return true;
+		}
+
+		std::lock_guard<decltype(*shmdriver)> lg(*shmdriver);
+		shmdriver->id(mid);
+		fill(shmdriver->data<char>());
+		shmdriver->commit();
+		if (!shmdriver->wait_receive(std::chrono::seconds(100))) {
+			LOG_WARN(0, "Timeout expired");
+			return false;
+		}
+		if (shmdriver->id() == ipc::SMDataID::WAIT) {
+			shmdriver->id(ipc::SMDataID::CONFIRM);
+			shmdriver->commit();
+			MSR::wait_heart_beat();
+		}
+		read(shmdriver->id(), (const char*)shmdriver->data<char>());
+		return true;
+	}
+
+	/** Constructs a symbol search request in the buffer */
+	static void fill_search_request(
+		char * buffer,
+		const module_data_t * mod,
+		const std::string & match,
+		bool full_search,
+		size_t offset)
+	{
+		auto & sr = *(new (buffer) ipc::SymbolRequest());
+		sr.base = (uint64_t)mod->start;
+		sr.size = mod->module_internal_size;
+		sr.full = full_search;
+		sr.offset = offset;
+		strncpy(sr.path.data(), mod->full_path, sr.path.size());
+		DR_ASSERT(match.size() <= sr.match.size(), "Matchstr larger than buffer");
+		std::copy(match.begin(), match.end(), sr.match.begin());
+	}
+
+	/** Appends the matches of a search page, returns the total number of matches */
+	static size_t read_search_page(const ipc::SymbolResponse & sr, std::vector<uint64_t> & matches) {
+		if (sr.offset != matches.size()) {
+			// search was repeated by the MSR, start over
+			matches.resize(std::min(sr.offset, matches.size()));
+		}
+		matches.insert(matches.end(), sr.adresses.begin(), sr.adresses.begin() + sr.size);
+		return sr.total;
+	}
+
+	/** Fetch the remaining pages of a symbol search */
+	static void fetch_search_pages(
+		const module_data_t * mod,
+		const std::string & match,
+		bool full_search,
+		size_t total,
+		std::vector<uint64_t> & matches)
+	{
+		while (matches.size() < total) {
+			size_t fetched = matches.size();
+			bool ok = transact(ipc::SMDataID::SEARCHSYMS,
+				[&](char * buffer) { fill_search_request(buffer, mod, match, full_search, fetched); },
+				[&](ipc::SMDataID, const char * buffer) {
+				total = read_search_page(*reinterpret_cast<const ipc::SymbolResponse*>(buffer), matches);
+			});
+			if (!ok || (matches.size() <= fetched && matches.size() < total)) {
+				LOG_WARN(0, "Symbol search for %s incomplete, got %u of %u matches",
+					match.c_str(), matches.size(), total);
+				return;
+			}
+		}
+	}
+
 	bool MSR::request_symbols(const module_data_t * mod)
 	{
 		DR_ASSERT(shmdriver != nullptr);
-		std::lock_guard<decltype(*shmdriver)> lg(*shmdriver);
 		LOG_INFO(0, "MSR downloads the symbols from a symbol server (might take long)");
 		// TODO: Download Symbols for some other .Net dlls as well
-		auto & symreq = shmdriver->emplace<ipc::SymbolRequest>(ipc::SMDataID::LOADSYMS);
-		symreq.base = (uint64_t)mod->start;
-		symreq.size = mod->module_internal_size;
-		strncpy(symreq.path.data(), mod->full_path, symreq.path.size());
-		shmdriver->commit();
+		ipc::SMDataID result = ipc::SMDataID::EXIT;
+		transact(ipc::SMDataID::LOADSYMS,
+			[&](char * buffer) {
+			auto & symreq = *(new (buffer) ipc::SymbolRequest());
+			symreq.base = (uint64_t)mod->start;
+			symreq.size = mod->module_internal_size;
+			strncpy(symreq.path.data(), mod->full_path, symreq.path.size());
+		},
+			[&](ipc::SMDataID id, const char *) { result = id; });
 
-		MSR::wait_heart_beat();
-		if (shmdriver->id() == ipc::SMDataID::CONFIRM) {
+		if (result == ipc::SMDataID::CONFIRM) {
 			LOG_INFO(0, "Symbols downloaded");
 			return true;
 		}
@@ -118,47 +240,160 @@ namespace drace {
 
 	void MSR::unload_symbols(app_pc mod_start) {
 		DR_ASSERT(shmdriver != nullptr);
+		ipc::SMDataID result = ipc::SMDataID::EXIT;
+		transact(ipc::SMDataID::UNLOADSYMS,
+			[&](char * buffer) {
+			auto & sr = *(new (buffer) ipc::SymbolRequest());
+			sr.base = (uint64_t)mod_start;
+		},
+			[&](ipc::SMDataID id, const char *) { result = id; });
+		DR_ASSERT(result == ipc::SMDataID::CONFIRM);
+
 		std::lock_guard<decltype(*shmdriver)> lg(*shmdriver);
-		auto & sr = shmdriver->emplace<ipc::SymbolRequest>(ipc::SMDataID::UNLOADSYMS);
-		sr.base = (uint64_t)mod_start;
-		shmdriver->commit();
-		shmdriver->wait_receive();
-		DR_ASSERT(shmdriver->id() == ipc::SMDataID::CONFIRM);
+		sym_cache.clear();
 		LOG_NOTICE(-1, "Closed Symbols");
 	}
 
 	ipc::SymbolInfo MSR::lookup_address(app_pc pc) {
 		DR_ASSERT(shmdriver != nullptr);
-		std::lock_guard<decltype(*shmdriver)> lg(*shmdriver);
-		shmdriver->put<uint64_t>(ipc::SMDataID::IP, (uint64_t)pc);
-		shmdriver->commit();
-		if (shmdriver->wait_receive(std::chrono::seconds(100))) {
-			return shmdriver->get<ipc::SymbolInfo>();
+		{
+			std::lock_guard<decltype(*shmdriver)> lg(*shmdriver);
+			auto it = sym_cache.find((uint64_t)pc);
+			if (it != sym_cache.end()) {
+				return it->second;
+			}
+		}
+
+		ipc::SymbolInfo sym;
+		bool ok = transact(ipc::SMDataID::IP,
+			[&](char * buffer) { *reinterpret_cast<uint64_t*>(buffer) = (uint64_t)pc; },
+			[&](ipc::SMDataID, const char * buffer) {
+			sym = *reinterpret_cast<const ipc::SymbolInfo*>(buffer);
+		});
+		if (ok) {
+			std::lock_guard<decltype(*shmdriver)> lg(*shmdriver);
+			sym_cache.emplace((uint64_t)pc, sym);
+		}
+		return sym;
+	}
+
+	void MSR::lookup_addresses(const app_pc * pcs, size_t count) {
+		DR_ASSERT(shmdriver != nullptr);
+
+		std::vector<uint64_t> missing;
+		missing.reserve(count);
+		{
+			std::lock_guard<decltype(*shmdriver)> lg(*shmdriver);
+			for (size_t i = 0; i < count; ++i) {
+				uint64_t pc = (uint64_t)pcs[i];
+				if (sym_cache.count(pc) == 0 &&
+					std::find(missing.begin(), missing.end(), pc) == missing.end())
+				{
+					missing.push_back(pc);
+				}
+			}
+		}
+
+		size_t done = 0;
+		while (done < missing.size()) {
+			std::vector<ipc::SymbolInfo> syms;
+			bool ok = transact(ipc::SMDataID::IPBATCH,
+				[&](char * buffer) {
+				auto & req = *(new (buffer) ipc::IPBatchRequest());
+				req.count = (uint32_t)std::min<size_t>(missing.size() - done, ipc::IPBatchRequest::max_pcs);
+				std::copy(missing.begin() + done, missing.begin() + done + req.count, req.pcs);
+			},
+				[&](ipc::SMDataID id, const char * buffer) {
+				if (id != ipc::SMDataID::IPBATCH)
+					return;
+				// unpack symbol information
+				const auto & resp = *reinterpret_cast<const ipc::IPBatchResponse*>(buffer);
+				const char * data = resp.data;
+				syms.resize(resp.count);
+				for (auto & sym : syms) {
+					for (auto * field : { sym.module.data(), sym.function.data(), sym.path.data() }) {
+						size_t len = strlen(data);
+						memcpy(field, data, len + 1);
+						data += len + 1;
+					}
+					sym.line[0] = '\0';
+				}
+			});
+			if (!ok)
+				return;
+			if (syms.empty()) {
+				LOG_WARN(0, "Protocol error, empty batch response");
+				return;
+			}
+
+			std::lock_guard<decltype(*shmdriver)> lg(*shmdriver);
+			for (const auto & sym : syms) {
+				sym_cache.emplace(missing[done++], sym);
+			}
 		}
-		LOG_WARN(0, "Timeout expired");
-		return ipc::SymbolInfo();
 	}
 
-	ipc::SymbolResponse MSR::search_symbol(
+	std::vector<uint64_t> MSR::search_symbol(
 		const module_data_t * mod,
 		const std::string & match,
 		bool full_search)
 	{
 		DR_ASSERT(shmdriver != nullptr);
-		std::lock_guard<decltype(*shmdriver)> lg(*shmdriver);
-		auto & sr = shmdriver->emplace<ipc::SymbolRequest>(ipc::SMDataID::SEARCHSYMS);
-		sr.base = (uint64_t)mod->start;
-		sr.size = mod->module_internal_size;
-		sr.full = full_search;
-		strncpy(sr.path.data(), mod->full_path, sr.path.size());
-		DR_ASSERT(match.size() <= sr.match.size(), "Matchstr larger than buffer");
-		std::copy(match.begin(), match.end(), sr.match.begin());
-		shmdriver->commit();
-		if (shmdriver->wait_receive(std::chrono::seconds(100))) {
-			return shmdriver->get<ipc::SymbolResponse>();
+		std::vector<uint64_t> matches;
+		// the first page tells the total number of matches
+		fetch_search_pages(mod, match, full_search, 1, matches);
+		return matches;
+	}
+
+	std::vector<std::vector<uint64_t>> MSR::search_symbols(
+		const module_data_t * mod,
+		const std::vector<std::string> & matches,
+		bool full_search)
+	{
+		DR_ASSERT(shmdriver != nullptr);
+		std::vector<std::vector<uint64_t>> results(matches.size());
+		if (!shmring) {
+			for (size_t i = 0; i < matches.size(); ++i) {
+				results[i] = search_symbol(mod, matches[i], full_search);
+			}
+			return results;
+		}
+
+		// keep as many requests for the first page in flight as slots are available
+		std::vector<ipc::SMSlot*> inflight(matches.size(), nullptr);
+		std::vector<size_t> totals(matches.size(), 0);
+		size_t submitted = 0;
+		size_t completed = 0;
+		while (completed < matches.size()) {
+			ipc::SMSlot * slot;
+			while (submitted < matches.size() && (slot = shmring->try_acquire()) != nullptr) {
+				slot->id = ipc::SMDataID::SEARCHSYMS;
+				fill_search_request(slot->buffer, mod, matches[submitted], full_search, 0);
+				shmring->submit(slot);
+				inflight[submitted++] = slot;
+			}
+			if (completed == submitted) {
+				// all slots are used by other threads
+				dr_thread_yield();
+				continue;
+			}
+
+			slot = inflight[completed];
+			if (shmring->await(slot, std::chrono::seconds(100))) {
+				totals[completed] = read_search_page(shmring->get<ipc::SymbolResponse>(slot), results[completed]);
+				shmring->release(slot);
+			}
+			else {
+				LOG_WARN(0, "Timeout expired");
+			}
+			++completed;
+		}
+
+		// large results are paginated
+		for (size_t i = 0; i < matches.size(); ++i) {
+			fetch_search_pages(mod, matches[i], full_search, totals[i], results[i]);
 		}
-		LOG_WARN(0, "Timeout expired");
-		return ipc::SymbolResponse();
+		return results;
 	}
 
 	void MSR::getCurrentStack(int threadid, void* rbp, void* rsp, void* rip) {
@@ -28,6 +28,9 @@
 #include "globals.h"
 #include "drace-client.h"
 #include "race-collector.h"
+#include "page-ownership.h"
+#include "page-epochs.h"
+#include "thread-registry.h"
 #include "memory-tracker.h"
 #include "function-wrapper.h"
 #include "Module.h"
@@ -62,10 +65,10 @@ DR_EXPORT void dr_client_main(client_id_t id, int argc, const char *argv[])
         exit(1);
     }
 
-    TLS_buckets.reserve(128);
+    thread_registry = std::make_unique<thread_registry_t>();
 
     th_mutex = dr_mutex_create();
-    tls_rw_mutex = dr_rwlock_create();
+    stats_mutex = dr_mutex_create();
 
     // Init DRMGR, Reserve registers
     if (!drmgr_init() ||
@@ -90,12 +93,32 @@ DR_EXPORT void dr_client_main(client_id_t id, int argc, const char *argv[])
 
     // Setup Memory Tracing
     memory_tracker = std::make_unique<MemoryTracker>();
+    if (params.excl_private) {
+        page_ownership = std::make_unique<PageOwnership>();
+    }
+    if (params.excl_readonly) {
+        page_epochs = std::make_unique<PageEpochs>();
+    }
 
     // Setup Race Collector and bind lookup function
+    // the binary report is resolved offline, hence skip the lookup at runtime
     race_collector = std::make_unique<RaceCollector>(
-        params.delayed_sym_lookup,
+        params.delayed_sym_lookup || params.bin_file != "",
         symbol_table);
 
+    if (params.bin_file != "") {
+        if (!race_collector->open_binary_report(params.bin_file, *module_tracker,
+            dr_get_application_name(), std::chrono::system_clock::now()))
+        {
+            LOG_ERROR(-1, "cannot open binary report %s", params.bin_file.c_str());
+        }
+    }
+    if (params.json_file != "") {
+        if (!race_collector->open_json_report(params.json_file)) {
+            LOG_ERROR(-1, "cannot open json report %s", params.json_file.c_str());
+        }
+    }
+
     // Initialize Detector
     detector::init(argc, argv, race_collector_add_race);
 
@@ -126,6 +149,8 @@ namespace drace {
         // Cleanup all drace modules
         module_tracker.reset();
         memory_tracker.reset();
+        page_ownership.reset();
+        page_epochs.reset();
         stats.reset();
 
         funwrap::finalize();
@@ -137,8 +162,10 @@ namespace drace {
         // Finalize Detector
         detector::finalize();
 
+        thread_registry.reset();
+
         dr_mutex_destroy(th_mutex);
-        dr_rwlock_destroy(tls_rw_mutex);
+        dr_mutex_destroy(stats_mutex);
 
         if (drace::log_requires_close)
             dr_close_file(drace::log_target);
@@ -155,7 +182,9 @@ namespace drace {
         if (runtime_tid.compare_exchange_weak(empty_tid, tid, std::memory_order_relaxed)) {
             LOG_INFO(tid, "Runtime Thread tagged");
         }
-        num_threads_active.fetch_add(1, std::memory_order_relaxed);
+        num_threads_active.fetch_add(1);
+        // buffers started before this point are no longer single threaded
+        thread_phase.fetch_add(1);
 
         memory_tracker->event_thread_init(drcontext);
         LOG_INFO(tid, "Thread started");
@@ -165,9 +194,10 @@ namespace drace {
     {
         using namespace drace;
         thread_id_t tid = dr_get_thread_id(drcontext);
-        num_threads_active.fetch_sub(1, std::memory_order_relaxed);
 
+        // the final flush still belongs to the phase of this thread
         memory_tracker->event_thread_exit(drcontext);
+        num_threads_active.fetch_sub(1, std::memory_order_relaxed);
 
         LOG_INFO(tid, "Thread exited");
     }
@@ -185,20 +215,26 @@ namespace drace {
                 ) % "sampling options",
                 (
             (clipp::option("--lossy").set(params.lossy) % "dynamically exclude fragments using lossy counting") &
-                    (clipp::option("--lossy-flush").set(params.lossy_flush) % "de-instrument flushed segments (only with --lossy)"),
+                    (clipp::option("--lossy-flush").set(params.lossy_flush) % "skip frequent segments using an inline check instead of re-instrumenting (only with --lossy)"),
                     clipp::option("--excl-traces").set(params.excl_traces) % "exclude dynamorio traces",
                     clipp::option("--excl-stack").set(params.excl_stack) % "exclude stack accesses",
-                    clipp::option("--excl-master").set(params.exclude_master) % "exclude first thread"
+                    clipp::option("--excl-master").set(params.exclude_master) % "exclude first thread",
+                    clipp::option("--excl-single").set(params.excl_single) % "do not analyze memory accesses while only one thread exists",
+                    clipp::option("--excl-private").set(params.excl_private) % "do not analyze accesses to pages which are only used by one thread",
+                    clipp::option("--excl-readonly").set(params.excl_readonly) % "do not analyze reads of pages which were not written since all threads synchronized"
                     ) % "analysis scope",
                     (clipp::option("--stacksz") & clipp::integer("stacksz", params.stack_size)) %
             ("size of callstack used for race-detection (must be in [1,16], default: " + std::to_string(params.stack_size) + ")"),
 
             clipp::option("--delay-syms").set(params.delayed_sym_lookup) % "perform symbol lookup after application shutdown",
+            (clipp::option("--modcache") & clipp::value("filename", params.modcache_file)) % "cache per-module instrumentation decisions and symbol offsets in this file",
             clipp::option("--sync-mode").set(params.fastmode, false) % "flush all buffers on a sync event (instead of participating only)",
             clipp::option("--fast-mode").set(params.fastmode) % "DEPRECATED: inverse of sync-mode",
             (
             (clipp::option("--xml-file", "-x") & clipp::value("filename", params.xml_file)) % "log races in valkyries xml format in this file",
-                (clipp::option("--out-file", "-o") & clipp::value("filename", params.out_file)) % "log races in human readable format in this file"
+                (clipp::option("--out-file", "-o") & clipp::value("filename", params.out_file)) % "log races in human readable format in this file",
+                (clipp::option("--bin-file") & clipp::value("filename", params.bin_file)) % "log races with unresolved stacks in binary format in this file (see drace-report)",
+                (clipp::option("--json-file") & clipp::value("filename", params.json_file)) % "log races as JSON Lines in this file (written while running)"
                 ) % "data race reporting",
                 (clipp::option("--logfile", "-l") & clipp::value("filename", params.logfile)) % "write all logs to this file (can be null, stdout, stderr, or filename)",
             clipp::option("--extctrl").set(params.extctrl) % "use second process for symbol lookup and state-controlling (required for Dotnet)",
@@ -213,7 +249,8 @@ namespace drace {
         auto detector_cli = clipp::group(
             // we just name the options here to provide a well-defined cli.
             // The detector parses the argv itself
-            clipp::option("--heap-only") % "only analyze heap memory"
+            clipp::option("--heap-only") % "only analyze heap memory",
+            (clipp::option("--overflow") & clipp::value("block|drop|spill")) % "extsan: policy if an event queue is full, drop only drops memory accesses (default: drop)"
         );
         auto cli = (
             (drace_cli % "DRace Options"),
@@ -250,11 +287,17 @@ namespace drace {
             "< Exclude Traces:\t%s\n"
             "< Exclude Stack:\t%s\n"
             "< Exclude Master:\t%s\n"
+            "< Exclude Single:\t%s\n"
+            "< Exclude Private:\t%s\n"
+            "< Exclude Read-Only:\t%s\n"
             "< Delayed Sym Lookup:\t%s\n"
+            "< Module Cache:\t\t%s\n"
             "< Fast Mode:\t\t%s\n"
             "< Config File:\t\t%s\n"
             "< Output File:\t\t%s\n"
             "< XML File:\t\t%s\n"
+            "< Binary File:\t\t%s\n"
+            "< JSON File:\t\t%s\n"
             "< Stack-Size:\t\t%i\n"
             "< External Ctrl:\t%s\n"
             "< Log Target:\t\t%s\n"
@@ -266,11 +309,17 @@ namespace drace {
             params.excl_traces ? "ON" : "OFF",
             params.excl_stack ? "ON" : "OFF",
             params.exclude_master ? "ON" : "OFF",
+            params.excl_single ? "ON" : "OFF",
+            params.excl_private ? "ON" : "OFF",
+            params.excl_readonly ? "ON" : "OFF",
             params.delayed_sym_lookup ? "ON" : "OFF",
+            params.modcache_file != "" ? params.modcache_file.c_str() : "OFF",
             params.fastmode ? "ON" : "OFF",
             params.config_file.c_str(),
             params.out_file != "" ? params.out_file.c_str() : "OFF",
             params.xml_file != "" ? params.xml_file.c_str() : "OFF",
+            params.bin_file != "" ? params.bin_file.c_str() : "OFF",
+            params.json_file != "" ? params.json_file.c_str() : "OFF",
             params.stack_size,
             params.extctrl ? "ON" : "OFF",
             params.logfile,
@@ -279,7 +328,13 @@ namespace drace {
 
     static void generate_summary() {
         using namespace drace;
-        race_collector->resolve_all();
+        race_collector->close_binary_report(app_stop);
+        race_collector->close_json_report();
+
+        // only the text based reports require symbols
+        if (params.out_file != "" || params.xml_file != "") {
+            race_collector->resolve_all();
+        }
 
         if (params.out_file != "") {
             std::ofstream races_hr_file(params.out_file, std::ofstream::out);
@@ -13,6 +13,7 @@
 #include "function-wrapper.h"
 #include "memory-tracker.h"
 #include "config.h"
+#include "Module.h"
 #include "MSR.h"
 
 #include <vector>
@@ -49,28 +50,53 @@ namespace drace {
 		wrapcb_post_t post)
 	{
 		std::string modname(dr_module_preferred_name(mod));
-		for (const auto & name : syms) {
-			LOG_NOTICE(-1, "Search for %s", name.c_str());
-			if (method == Method::EXTERNAL_MPCR) {
-				std::string symname = (modname + '!') + name;
-				auto sr = MSR::search_symbol(mod, symname.c_str(), full_search);
-				for (int i = 0; i < sr.size; ++i) {
+		if (method == Method::EXTERNAL_MPCR) {
+			// issue all searches at once, the MSR processes them pipelined
+			std::vector<std::string> symnames;
+			symnames.reserve(syms.size());
+			for (const auto & name : syms) {
+				LOG_NOTICE(-1, "Search for %s", name.c_str());
+				symnames.push_back((modname + '!') + name);
+			}
+			auto results = MSR::search_symbols(mod, symnames, full_search);
+			for (size_t i = 0; i < results.size(); ++i) {
+				LOG_INFO(0, "MSR found %u matches for %s", results[i].size(), syms[i].c_str());
+				for (auto addr : results[i]) {
 					wrap_info_t info{ mod, pre, post };
 					internal::wrap_function_clbck(
 						"<unknown>",
-						sr.adresses[i] - (size_t)mod->start,
+						addr - (size_t)mod->start,
 						(void*)(&info));
 				}
 			}
-			else if (method == Method::DBGSYMS)
+			return;
+		}
+		for (const auto & name : syms) {
+			LOG_NOTICE(-1, "Search for %s", name.c_str());
+			if (method == Method::DBGSYMS)
 			{
 				wrap_info_t info{ mod, pre, post };
-				drsym_error_t err = drsym_search_symbols(
-					mod->full_path,
-					name.c_str(),
-					false,
-					(drsym_enumerate_cb)internal::wrap_function_clbck,
-					(void*)&info);
+				std::vector<size_t> offsets;
+				const auto & decisions = module_tracker->decisions;
+				if (decisions && decisions->lookup_symbol(mod, name, offsets)) {
+					// unchanged module, skip symbol search
+					for (auto offs : offsets) {
+						internal::wrap_function_clbck(name.c_str(), offs, (void*)&info);
+					}
+				}
+				else {
+					internal::search_info_t search{ &info, &offsets };
+					drsym_error_t err = drsym_search_symbols(
+						mod->full_path,
+						name.c_str(),
+						false,
+						(drsym_enumerate_cb)internal::wrap_and_record_clbck,
+						(void*)&search);
+					// only cache complete results, otherwise search again at next start
+					if (decisions && (err == DRSYM_SUCCESS || err == DRSYM_ERROR_NOT_FOUND)) {
+						decisions->store_symbol(mod, name, offsets);
+					}
+				}
 			}
 			else if (method == Method::EXPORTS)
 			{
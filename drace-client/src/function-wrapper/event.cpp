@@ -15,6 +15,8 @@
 #include "memory-tracker.h"
 #include "symbols.h"
 #include "statistics.h"
+#include "page-epochs.h"
+#include "thread-registry.h"
 #include <detector/detector_if.h>
 
 #include <dr_api.h>
@@ -37,12 +39,24 @@ namespace drace {
 			MemoryTracker::enable_scope(data);
 		}
 
+		/**
+		* Deallocations are not buffered, as the allocator can hand out the
+		* block to another thread immediately. Its allocation must not be
+		* processed before this deallocation. Only the buffer of this thread
+		* is processed before, as its accesses precede the deallocation.
+		*/
+		static inline void deallocate(per_thread_t * data, void * addr) {
+			MemoryTracker::process_buffer();
+
+			// to avoid high pressure on the internal spinlock,
+			// we lock externally using a os lock
+			dr_mutex_lock(th_mutex);
+			detector::deallocate(data->detector_data, addr);
+			dr_mutex_unlock(th_mutex);
+		}
+
 		// TODO: On Linux size is arg 0
 		void event::alloc_pre(void *wrapctx, void **user_data) {
-			app_pc drcontext = drwrap_get_drcontext(wrapctx);
-			per_thread_t * data = (per_thread_t*)drmgr_get_tls_field(drcontext, tls_idx);
-
-			MemoryTracker::flush_all_threads(data);
 			// Save allocate size to user_data
 			// we use the pointer directly to avoid an allocation
 			//per_thread_t * data = (per_thread_t*)drmgr_get_tls_field(drcontext, tls_idx);
@@ -58,18 +72,11 @@ namespace drace {
 			per_thread_t * data = (per_thread_t*)drmgr_get_tls_field(drcontext, tls_idx);
 			DR_ASSERT(nullptr != data);
 
-			//MemoryTracker::flush_all_threads(data);
-
 			// allocations with size 0 are valid if they come from
 			// reallocate (in fact, that's a free)
 			if (size != 0) {
-				// to avoid high pressure on the internal spinlock,
-				// we lock externally using a os lock
-				// TODO: optimize tsan wrapper internally
-				dr_mutex_lock(th_mutex);
-				//detector::happens_after(data->tid, retval);
-				detector::allocate(data->detector_data, pc, retval, size);
-				dr_mutex_unlock(th_mutex);
+				// processed in order with the accesses of this thread
+				MemoryTracker::buffer_event(data, MemoryTracker::mem_ref_t::ALLOC, retval, size, pc);
 			}
 		}
 
@@ -77,18 +84,9 @@ namespace drace {
 			app_pc drcontext = drwrap_get_drcontext(wrapctx);
 			per_thread_t * data = (per_thread_t*)drmgr_get_tls_field(drcontext, tls_idx);
 
-			MemoryTracker::flush_all_threads(data);
-
 			// first deallocate, then allocate again
 			void* old_addr = drwrap_get_arg(wrapctx, 2);
-
-			// to avoid high pressure on the internal spinlock,
-			// we lock externally using a os lock
-			// TODO: optimize tsan wrapper internally
-			dr_mutex_lock(th_mutex);
-			detector::deallocate(data->detector_data, old_addr);
-			//detector::happens_before(data->tid, old_addr);
-			dr_mutex_unlock(th_mutex);
+			deallocate(data, old_addr);
 
 			*user_data = drwrap_get_arg(wrapctx, 3);
 			//LOG_INFO(data->tid, "reallocate, new blocksize %u at %p", (SIZE_T)*user_data, old_addr);
@@ -101,14 +99,7 @@ namespace drace {
 			DR_ASSERT(nullptr != data);
 
 			void * addr = drwrap_get_arg(wrapctx, 2);
-
-			MemoryTracker::flush_all_threads(data);
-
-			// TODO: optimize tsan wrapper internally (see comment in alloc_post)
-			dr_mutex_lock(th_mutex);
-			detector::deallocate(data->detector_data, addr);
-			//detector::happens_before(data->tid, addr);
-			dr_mutex_unlock(th_mutex);
+			deallocate(data, addr);
 		}
 
 		void event::free_post(void *wrapctx, void *user_data) {
@@ -137,14 +128,13 @@ namespace drace {
 			end_excl_region(data);
 			// Enable recently started thread
 			auto last_th = last_th_start.load(std::memory_order_relaxed);
-			// TLS is already updated, hence read lock is sufficient
-			dr_rwlock_read_lock(tls_rw_mutex);
-			if (TLS_buckets.count(last_th) == 1) {
-				auto & other_tls = TLS_buckets[last_th];
-				if (other_tls->event_cnt == 0)
-					MemoryTracker::enable(TLS_buckets[last_th]);
+			// TLS is already updated, the guard keeps it alive
+			{
+				thread_registry_t::ReadGuard guard(*thread_registry, data->registry_slot);
+				per_thread_t * other_tls = thread_registry->find(last_th);
+				if (nullptr != other_tls && other_tls->event_cnt == 0)
+					MemoryTracker::enable(other_tls);
 			}
-			dr_rwlock_read_unlock(tls_rw_mutex);
 			LOG_INFO(data->tid, "new thread created: %i", last_th_start.load());
 		}
 
@@ -157,18 +147,17 @@ namespace drace {
 
 			//app_pc drcontext = drwrap_get_drcontext(wrapctx);
 			//per_thread_t * data = (per_thread_t*)drmgr_get_tls_field(drcontext, tls_idx);
-			dr_rwlock_read_lock(tls_rw_mutex);
+			thread_registry_t::ReadGuard guard(*thread_registry, current_registry_slot());
 			auto other_th = last_th_start.load(std::memory_order_acquire);
 			// There are some spurious failures where the thread init event
 			// is not called but the system call has already returned
 			// Hence, skip the fork here and rely on fallback-fork in
 			// analyze_access
-			if (TLS_buckets.count(other_th) == 1) {
-				auto other_tls = TLS_buckets[other_th];
+			per_thread_t * other_tls = thread_registry->find(other_th);
+			if (nullptr != other_tls) {
 				//MemoryTracker::flush_all_threads(data, false);
 				//detector::fork(dr_get_thread_id(drcontext), other_tls->tid, &(other_tls->detector_data));
 			}
-			dr_rwlock_read_unlock(tls_rw_mutex);
 		}
 
 		void event::begin_excl(void *wrapctx, void **user_data) {
@@ -224,8 +213,14 @@ namespace drace {
 
 			LOG_TRACE(data->tid, "Mutex book size: %i, count: %i, mutex: %p\n", data->mutex_book.size(), cnt, mutex);
 
+			// buffered writes have to be marked in the current epoch before it is synced
+			if (page_epochs)
+				MemoryTracker::flush_all_threads(data);
+
 			detector::acquire(data->detector_data, mutex, cnt, write);
 			//detector::happens_after(data->tid, mutex);
+			if (page_epochs)
+				page_epochs->sync(data->epoch_seen);
 
 			data->stats->mutex_ops++;
 		}
@@ -244,13 +239,13 @@ namespace drace {
 			void* mutex = drwrap_get_arg(wrapctx, 0);
 			//detector::happens_before(data->tid, mutex);
 
-			if (!data->mutex_book.count((uint64_t)mutex)) {
+			unsigned * cnt = data->mutex_book.find((uint64_t)mutex);
+			if (nullptr == cnt) {
 				LOG_TRACE(data->tid, "Mutex Error %p at : %s", mutex, module_tracker->_syms->get_symbol_info(drwrap_get_func(wrapctx)).sym_name.c_str());
 				// mutex not in book
 				return;
 			}
-			auto & cnt = --(data->mutex_book[(uint64_t)mutex]);
-			if (cnt == 0) {
+			if (--(*cnt) == 0) {
 				data->mutex_book.erase((uint64_t)mutex);
 			}
 
@@ -260,6 +255,8 @@ namespace drace {
 			MemoryTracker::flush_all_threads(data);
 			LOG_TRACE(data->tid, "Release %p : %s", mutex, module_tracker->_syms->get_symbol_info(drwrap_get_func(wrapctx)).sym_name.c_str());
 			detector::release(data->detector_data, mutex, write);
+			if (page_epochs)
+				page_epochs->sync(data->epoch_seen);
 		}
 
 		void event::get_arg(void *wrapctx, OUT void **user_data) {
@@ -400,8 +397,14 @@ namespace drace {
 
 			LOG_TRACE(data->tid, "barrier passed");
 
+			// buffered writes have to be marked in the current epoch before it is synced
+			if (page_epochs)
+				MemoryTracker::flush_all_threads(data);
+
 			// each thread leaves individually, but only after all barrier_enters have been called
 			detector::happens_after(data->tid, addr);
+			if (page_epochs)
+				page_epochs->sync(data->epoch_seen);
 		}
 
 		void event::barrier_leave_or_cancel(void *wrapctx, void *addr) {
@@ -433,7 +436,13 @@ namespace drace {
 			per_thread_t * data = (per_thread_t*)drmgr_get_tls_field(drcontext, tls_idx);
 			DR_ASSERT(nullptr != data);
 
+			// buffered writes have to be marked in the current epoch before it is synced
+			if (page_epochs)
+				MemoryTracker::flush_all_threads(data);
+
 			detector::happens_after(data->tid, identifier);
+			if (page_epochs)
+				page_epochs->sync(data->epoch_seen);
 			LOG_TRACE(data->tid, "happens-after  @ %p", identifier);
 		}
 #endif
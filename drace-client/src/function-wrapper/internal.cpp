@@ -33,5 +33,11 @@ namespace drace {
 			// Exact matches only, hence quit after each symbol
 			return false;
 		}
+
+		bool internal::wrap_and_record_clbck(const char *name, size_t modoffs, void *data) {
+			search_info_t * search = (search_info_t*)data;
+			search->offsets->push_back(modoffs);
+			return wrap_function_clbck(name, modoffs, (void*)search->info);
+		}
 	} // namespace funwrap
 } // namespace drace
\ No newline at end of file
@@ -14,24 +14,29 @@
 #include "Module.h"
 #include "symbols.h"
 #include "race-collector.h"
+#include "page-ownership.h"
+#include "page-epochs.h"
+#include "thread-registry.h"
 #include "statistics.h"
 #include "ipc/SharedMemory.h"
 #include "ipc/MtSyncSHMDriver.h"
+#include "ipc/RingSHMDriver.h"
 
 namespace drace {
 	/**
 	* Thread local storage metadata has to be globally accessable
 	*/
 	int      tls_idx;
-	std::unordered_map<thread_id_t, per_thread_t*> TLS_buckets;
+	std::unique_ptr<thread_registry_t> thread_registry;
 
 	void *th_mutex;
-	void *tls_rw_mutex;
+	void *stats_mutex;
 
 	// Global Config Object
 	drace::Config config;
 
 	std::atomic<int> num_threads_active{ 0 };
+	std::atomic<uint32_t> thread_phase{ 0 };
 	std::atomic<uint> runtime_tid{ 0 };
 	std::atomic<thread_id_t> last_th_start{ 0 };
 	std::atomic<bool> th_start_pending{ false };
@@ -42,8 +47,11 @@ namespace drace {
 	std::unique_ptr<MemoryTracker> memory_tracker;
 	std::unique_ptr<module::Tracker> module_tracker;
 	std::unique_ptr<RaceCollector> race_collector;
+	std::unique_ptr<PageOwnership> page_ownership;
+	std::unique_ptr<PageEpochs> page_epochs;
 	std::unique_ptr<Statistics> stats;
 	std::unique_ptr<ipc::MtSyncSHMDriver<true, true>> shmdriver;
+	std::unique_ptr<ipc::RingSHMDriver<true, true>> shmring;
 	std::unique_ptr<ipc::SharedMemory<ipc::ClientCB, true>> extcb;
 
 	/* Runtime parameters */
@@ -34,7 +34,8 @@ void MemoryTracker::instrument_mem_fast(void *drcontext, instrlist_t *ilist, ins
 	if (drreg_reserve_register(drcontext, ilist, where, &allowed_xcx, &reg2) !=
 		DRREG_SUCCESS ||
 		drreg_reserve_register(drcontext, ilist, where, NULL, &reg1) != DRREG_SUCCESS ||
-		drreg_reserve_register(drcontext, ilist, where, NULL, &reg3) != DRREG_SUCCESS) {
+		drreg_reserve_register(drcontext, ilist, where, NULL, &reg3) != DRREG_SUCCESS ||
+		(params.excl_stack && drreg_reserve_aflags(drcontext, ilist, where) != DRREG_SUCCESS)) {
 		DR_ASSERT(false); /* cannot recover */
 		return;
 	}
@@ -47,10 +48,13 @@ void MemoryTracker::instrument_mem_fast(void *drcontext, instrlist_t *ilist, ins
 	drutil_insert_get_mem_addr(drcontext, ilist, where, ref, reg1, reg2);
 
 	/* The following assembly performs the following instructions
-	* if(!enabled){
+	* if(region disabled || !enabled){
 	*   jmp .restore
 	*}
-	* buf_ptr->write = write;
+	* if(excl_stack && addr in stack){
+	*   jmp .restore
+	*}
+	* buf_ptr->kind  = write;
 	* buf_ptr->addr  = addr;
 	* buf_ptr->size  = size;
 	* buf_ptr->pc    = pc;
@@ -69,7 +73,7 @@ void MemoryTracker::instrument_mem_fast(void *drcontext, instrlist_t *ilist, ins
 	/* Jump if tracing is disabled */
 	/* load enabled flag into reg2 */
 	opnd1 = opnd_create_reg(reg2);
-	opnd2 = OPND_CREATE_MEMPTR(reg3, offsetof(per_thread_t, enabled));
+	opnd2 = OPND_CREATE_MEMPTR(reg3, enabled_offset());
 	instr = INSTR_CREATE_mov_ld(drcontext, opnd1, opnd2);
 	instrlist_meta_preinsert(ilist, where, instr);
 
@@ -78,14 +82,20 @@ void MemoryTracker::instrument_mem_fast(void *drcontext, instrlist_t *ilist, ins
 	instr = INSTR_CREATE_jecxz(drcontext, opnd1);
 	instrlist_meta_preinsert(ilist, where, instr);
 
+	/* Skip accesses to the stack of this thread */
+	if (params.excl_stack) {
+		insert_stack_check(drcontext, ilist, where, reg1, reg3,
+			INSTR_CREATE_jmp(drcontext, opnd_create_instr(restore)));
+	}
+
 	/* Load data->buf_ptr into reg2 */
 	opnd1 = opnd_create_reg(reg2);
 	opnd2 = OPND_CREATE_MEMPTR(reg3, offsetof(per_thread_t, buf_ptr));
 	instr = INSTR_CREATE_mov_ld(drcontext, opnd1, opnd2);
 	instrlist_meta_preinsert(ilist, where, instr);
 
-	/* Move write/read to write field */
-	opnd1 = OPND_CREATE_MEM32(reg2, offsetof(mem_ref_t, write));
+	/* Move write/read to kind field */
+	opnd1 = OPND_CREATE_MEM32(reg2, offsetof(mem_ref_t, kind));
 	opnd2 = OPND_CREATE_INT32(write);
 	instr = INSTR_CREATE_mov_imm(drcontext, opnd1, opnd2);
 	instrlist_meta_preinsert(ilist, where, instr);
@@ -179,7 +189,215 @@ void MemoryTracker::instrument_mem_fast(void *drcontext, instrlist_t *ilist, ins
 	instrlist_meta_preinsert(ilist, where, restore);
 
 	if (drreg_unreserve_register(drcontext, ilist, where, reg1) != DRREG_SUCCESS ||
+		drreg_unreserve_register(drcontext, ilist, where, reg2) != DRREG_SUCCESS ||
+		drreg_unreserve_register(drcontext, ilist, where, reg3) != DRREG_SUCCESS ||
+		(params.excl_stack && drreg_unreserve_aflags(drcontext, ilist, where) != DRREG_SUCCESS))
+		DR_ASSERT(false);
+}
+
+/* reserve buffer space for all references of a block */
+void MemoryTracker::insert_block_header(void *drcontext, instrlist_t *ilist, instr_t *where,
+	reg_id_t reg_buf, unsigned num_refs)
+{
+	instr_t *instr;
+	opnd_t   opnd1, opnd2;
+	// reg2 is XCX, reg3 holds the TLS pointer
+	reg_id_t reg2, reg3;
+	drvector_t allowed_buf;
+
+	/* reg_buf is not used by the application in this block,
+	* hence it can be kept reserved until the last reference is written
+	*/
+	drreg_init_and_fill_vector(&allowed_buf, false);
+	drreg_set_vector_entry(&allowed_buf, reg_buf, true);
+	if (drreg_reserve_register(drcontext, ilist, where, &allowed_buf, &reg_buf) != DRREG_SUCCESS ||
+		drreg_reserve_register(drcontext, ilist, where, &allowed_xcx, &reg2) != DRREG_SUCCESS ||
+		drreg_reserve_register(drcontext, ilist, where, NULL, &reg3) != DRREG_SUCCESS ||
+		drreg_reserve_aflags(drcontext, ilist, where) != DRREG_SUCCESS) {
+		DR_ASSERT(false); /* cannot recover */
+		drvector_delete(&allowed_buf);
+		return;
+	}
+	drvector_delete(&allowed_buf);
+
+	/* Create ASM lables */
+	instr_t *retry = INSTR_CREATE_label(drcontext);
+	instr_t *flush = INSTR_CREATE_label(drcontext);
+	instr_t *disabled = INSTR_CREATE_label(drcontext);
+	instr_t *done = INSTR_CREATE_label(drcontext);
+
+	/* The following assembly performs the following instructions
+	* if(region disabled || !enabled){
+	*   reg_buf = sink;
+	*   jmp .done
+	*}
+	* .retry
+	* reg_buf = buf_ptr;
+	* if (buf_ptr + num_refs >= buf_end_ptr){
+	*    clean_call();
+	*    jmp .retry
+	*}
+	* buf_ptr += num_refs;
+	* reg_buf[0..num_refs]->kind = RESERVED;
+	* .done
+	*/
+
+	drmgr_insert_read_tls_field(drcontext, tls_idx, ilist, where, reg3);
+
+	/* ==== .retry ==== */
+	instrlist_meta_preinsert(ilist, where, retry);
+
+	/* Jump if tracing is disabled */
+	opnd1 = opnd_create_reg(reg2);
+	opnd2 = OPND_CREATE_MEMPTR(reg3, enabled_offset());
+	instr = INSTR_CREATE_mov_ld(drcontext, opnd1, opnd2);
+	instrlist_meta_preinsert(ilist, where, instr);
+
+	opnd1 = opnd_create_instr(disabled);
+	instr = INSTR_CREATE_jecxz(drcontext, opnd1);
+	instrlist_meta_preinsert(ilist, where, instr);
+
+	/* Load data->buf_ptr into reg_buf */
+	opnd1 = opnd_create_reg(reg_buf);
+	opnd2 = OPND_CREATE_MEMPTR(reg3, offsetof(per_thread_t, buf_ptr));
+	instr = INSTR_CREATE_mov_ld(drcontext, opnd1, opnd2);
+	instrlist_meta_preinsert(ilist, where, instr);
+
+	/* reg2 = buf_ptr + num_refs - buf_end_ptr (buf_end is stored negated) */
+	opnd1 = opnd_create_reg(reg2);
+	opnd2 = opnd_create_base_disp(reg_buf, DR_REG_NULL, 0,
+		num_refs * sizeof(mem_ref_t), OPSZ_lea);
+	instr = INSTR_CREATE_lea(drcontext, opnd1, opnd2);
+	instrlist_meta_preinsert(ilist, where, instr);
+
+	opnd1 = opnd_create_reg(reg2);
+	opnd2 = OPND_CREATE_MEMPTR(reg3, offsetof(per_thread_t, buf_end));
+	instr = INSTR_CREATE_add(drcontext, opnd1, opnd2);
+	instrlist_meta_preinsert(ilist, where, instr);
+
+	/* Jump if references do not fit into buffer.
+	* Flush if the end is reached as well, as the per-reference
+	* instrumentation only flushes if buf_ptr equals the end (jecxz)
+	*/
+	opnd1 = opnd_create_instr(flush);
+	instr = INSTR_CREATE_jcc(drcontext, OP_jnl, opnd1);
+	instrlist_meta_preinsert(ilist, where, instr);
+
+	/* Update the data->buf_ptr */
+	opnd1 = opnd_create_reg(reg2);
+	opnd2 = opnd_create_base_disp(reg_buf, DR_REG_NULL, 0,
+		num_refs * sizeof(mem_ref_t), OPSZ_lea);
+	instr = INSTR_CREATE_lea(drcontext, opnd1, opnd2);
+	instrlist_meta_preinsert(ilist, where, instr);
+
+	opnd1 = OPND_CREATE_MEMPTR(reg3, offsetof(per_thread_t, buf_ptr));
+	opnd2 = opnd_create_reg(reg2);
+	instr = INSTR_CREATE_mov_st(drcontext, opnd1, opnd2);
+	instrlist_meta_preinsert(ilist, where, instr);
+
+	/* Invalidate the reserved entries, as a clean call inside this block
+	* might process the buffer before all references are written
+	*/
+	for (unsigned i = 0; i < num_refs; ++i) {
+		opnd1 = OPND_CREATE_MEM32(reg_buf, i * sizeof(mem_ref_t) + offsetof(mem_ref_t, kind));
+		opnd2 = OPND_CREATE_INT32(mem_ref_t::RESERVED);
+		instr = INSTR_CREATE_mov_imm(drcontext, opnd1, opnd2);
+		instrlist_meta_preinsert(ilist, where, instr);
+	}
+
+	opnd1 = opnd_create_instr(done);
+	instr = INSTR_CREATE_jmp(drcontext, opnd1);
+	instrlist_meta_preinsert(ilist, where, instr);
+
+	/* ==== .flush ==== */
+	instrlist_meta_preinsert(ilist, where, flush);
+
+	/* return to .retry from lean procedure */
+	opnd1 = opnd_create_reg(reg2);
+	opnd2 = opnd_create_instr(retry);
+	instr = INSTR_CREATE_mov_imm(drcontext, opnd1, opnd2);
+	instrlist_meta_preinsert(ilist, where, instr);
+
+	opnd1 = opnd_create_pc(cc_flush);
+	instr = INSTR_CREATE_jmp(drcontext, opnd1);
+	instrlist_meta_preinsert(ilist, where, instr);
+
+	/* ==== .disabled ==== */
+	/* write to the sink behind the buffer end */
+	instrlist_meta_preinsert(ilist, where, disabled);
+
+	opnd1 = opnd_create_reg(reg_buf);
+	opnd2 = OPND_CREATE_MEMPTR(reg3, offsetof(per_thread_t, buf_end));
+	instr = INSTR_CREATE_mov_ld(drcontext, opnd1, opnd2);
+	instrlist_meta_preinsert(ilist, where, instr);
+
+	opnd1 = opnd_create_reg(reg_buf);
+	instr = INSTR_CREATE_neg(drcontext, opnd1);
+	instrlist_meta_preinsert(ilist, where, instr);
+
+	/* ==== .done ==== */
+	instrlist_meta_preinsert(ilist, where, done);
+
+	if (drreg_unreserve_aflags(drcontext, ilist, where) != DRREG_SUCCESS ||
 		drreg_unreserve_register(drcontext, ilist, where, reg2) != DRREG_SUCCESS ||
 		drreg_unreserve_register(drcontext, ilist, where, reg3) != DRREG_SUCCESS)
 		DR_ASSERT(false);
-}
\ No newline at end of file
+}
+
+/* write a single reference into the reserved block buffer */
+void MemoryTracker::instrument_mem_block(void *drcontext, instrlist_t *ilist, instr_t *where,
+	opnd_t ref, bool write, reg_id_t reg_buf, unsigned index)
+{
+	instr_t *instr;
+	opnd_t   opnd1, opnd2;
+	reg_id_t reg1, reg2;
+	int      offset = index * sizeof(mem_ref_t);
+
+	if (drreg_reserve_register(drcontext, ilist, where, NULL, &reg1) != DRREG_SUCCESS ||
+		drreg_reserve_register(drcontext, ilist, where, NULL, &reg2) != DRREG_SUCCESS ||
+		(params.excl_stack && drreg_reserve_aflags(drcontext, ilist, where) != DRREG_SUCCESS)) {
+		DR_ASSERT(false); /* cannot recover */
+		return;
+	}
+
+	/* use drutil to get mem address */
+	drutil_insert_get_mem_addr(drcontext, ilist, where, ref, reg1, reg2);
+
+	/* The entry is already reserved, hence replace stack addresses
+	* by an address outside of the process address space, which is skipped
+	* during analysis
+	*/
+	if (params.excl_stack) {
+		drmgr_insert_read_tls_field(drcontext, tls_idx, ilist, where, reg2);
+		insert_stack_check(drcontext, ilist, where, reg1, reg2,
+			INSTR_CREATE_mov_imm(drcontext, opnd_create_reg(reg1), OPND_CREATE_INT32(-1)));
+	}
+
+	/* Move write/read to kind field */
+	opnd1 = OPND_CREATE_MEM32(reg_buf, offset + offsetof(mem_ref_t, kind));
+	opnd2 = OPND_CREATE_INT32(write);
+	instr = INSTR_CREATE_mov_imm(drcontext, opnd1, opnd2);
+	instrlist_meta_preinsert(ilist, where, instr);
+
+	/* Store address in memory ref */
+	opnd1 = OPND_CREATE_MEMPTR(reg_buf, offset + offsetof(mem_ref_t, addr));
+	opnd2 = opnd_create_reg(reg1);
+	instr = INSTR_CREATE_mov_st(drcontext, opnd1, opnd2);
+	instrlist_meta_preinsert(ilist, where, instr);
+
+	/* Store size in memory ref */
+	opnd1 = OPND_CREATE_MEMPTR(reg_buf, offset + offsetof(mem_ref_t, size));
+	opnd2 = OPND_CREATE_INT32(drutil_opnd_mem_size_in_bytes(ref, where));
+	instr = INSTR_CREATE_mov_st(drcontext, opnd1, opnd2);
+	instrlist_meta_preinsert(ilist, where, instr);
+
+	/* Store pc in memory ref */
+	opnd1 = OPND_CREATE_MEMPTR(reg_buf, offset + offsetof(mem_ref_t, pc));
+	instrlist_insert_mov_immed_ptrsz(drcontext, (ptr_int_t)instr_get_app_pc(where), opnd1,
+		ilist, where, NULL, NULL);
+
+	if (drreg_unreserve_register(drcontext, ilist, where, reg1) != DRREG_SUCCESS ||
+		drreg_unreserve_register(drcontext, ilist, where, reg2) != DRREG_SUCCESS ||
+		(params.excl_stack && drreg_unreserve_aflags(drcontext, ilist, where) != DRREG_SUCCESS))
+		DR_ASSERT(false);
+}
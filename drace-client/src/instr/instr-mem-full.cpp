@@ -36,6 +36,111 @@ void MemoryTracker::insert_jmp_on_flush(void *drcontext, instrlist_t *ilist, ins
 	instrlist_meta_preinsert(ilist, where, instr);
 }
 
+/*
+* Combines the detector state and the region state of the block
+*/
+void MemoryTracker::insert_region_header(void *drcontext, instrlist_t *ilist, instr_t *where, app_pc pc)
+{
+	instr_t *instr;
+	opnd_t   opnd1, opnd2;
+	reg_id_t reg2, reg3;
+
+	if (drreg_reserve_register(drcontext, ilist, where, &allowed_xcx, &reg2) != DRREG_SUCCESS ||
+		drreg_reserve_register(drcontext, ilist, where, NULL, &reg3) != DRREG_SUCCESS)
+	{
+		DR_ASSERT(false); /* cannot recover */
+		return;
+	}
+
+	instr_t *store = INSTR_CREATE_label(drcontext);
+	// the address of the flag is known at instrumentation time
+	uint8_t * flag = region_flag(pc);
+
+	/* The following assembly performs the following instructions
+	* block_enabled = region_enabled[pc] ? enabled : 0;
+	* Neither mov nor movzx touch the eflags.
+	*/
+	drmgr_insert_read_tls_field(drcontext, tls_idx, ilist, where, reg3);
+
+	if (flag != nullptr) {
+		opnd1 = opnd_create_reg(reg2);
+		opnd2 = OPND_CREATE_INTPTR(flag);
+		instr = INSTR_CREATE_mov_imm(drcontext, opnd1, opnd2);
+		instrlist_meta_preinsert(ilist, where, instr);
+
+		opnd1 = opnd_create_reg(reg_resize_to_opsz(reg2, OPSZ_4));
+		opnd2 = OPND_CREATE_MEM8(reg2, 0);
+		instr = INSTR_CREATE_movzx(drcontext, opnd1, opnd2);
+		instrlist_meta_preinsert(ilist, where, instr);
+
+		/* region disabled, store 0 */
+		opnd1 = opnd_create_instr(store);
+		instr = INSTR_CREATE_jecxz(drcontext, opnd1);
+		instrlist_meta_preinsert(ilist, where, instr);
+	}
+
+	opnd1 = opnd_create_reg(reg2);
+	opnd2 = OPND_CREATE_MEMPTR(reg3, offsetof(per_thread_t, enabled));
+	instr = INSTR_CREATE_mov_ld(drcontext, opnd1, opnd2);
+	instrlist_meta_preinsert(ilist, where, instr);
+
+	/* ==== .store ==== */
+	instrlist_meta_preinsert(ilist, where, store);
+
+	opnd1 = OPND_CREATE_MEMPTR(reg3, offsetof(per_thread_t, block_enabled));
+	opnd2 = opnd_create_reg(reg2);
+	instr = INSTR_CREATE_mov_st(drcontext, opnd1, opnd2);
+	instrlist_meta_preinsert(ilist, where, instr);
+
+	if (drreg_unreserve_register(drcontext, ilist, where, reg2) != DRREG_SUCCESS ||
+		drreg_unreserve_register(drcontext, ilist, where, reg3) != DRREG_SUCCESS)
+		DR_ASSERT(false);
+}
+
+/*
+* Inserts action if address is in stack range
+*/
+void MemoryTracker::insert_stack_check(void *drcontext, instrlist_t *ilist, instr_t *where,
+	reg_id_t reg_addr, reg_id_t regtls, instr_t *action)
+{
+	instr_t *instr;
+	opnd_t   opnd1, opnd2;
+
+	if (!params.excl_stack) {
+		// callers should not create the action in this case
+		instr_destroy(drcontext, action);
+		return;
+	}
+
+	//if(addr > appstack_beg && addr < appstack_end)
+	// action
+	//
+	instr_t *outside = INSTR_CREATE_label(drcontext);
+
+	opnd1 = opnd_create_reg(reg_addr);
+	opnd2 = OPND_CREATE_MEMPTR(regtls, offsetof(per_thread_t, appstack_beg));
+	instr = INSTR_CREATE_cmp(drcontext, opnd1, opnd2);
+	instrlist_meta_preinsert(ilist, where, instr);
+
+	opnd1 = opnd_create_instr(outside);
+	instr = INSTR_CREATE_jcc(drcontext, OP_jbe, opnd1);
+	instrlist_meta_preinsert(ilist, where, instr);
+
+	opnd1 = opnd_create_reg(reg_addr);
+	opnd2 = OPND_CREATE_MEMPTR(regtls, offsetof(per_thread_t, appstack_end));
+	instr = INSTR_CREATE_cmp(drcontext, opnd1, opnd2);
+	instrlist_meta_preinsert(ilist, where, instr);
+
+	opnd1 = opnd_create_instr(outside);
+	instr = INSTR_CREATE_jcc(drcontext, OP_jnb, opnd1);
+	instrlist_meta_preinsert(ilist, where, instr);
+
+	instrlist_meta_preinsert(ilist, where, action);
+
+	/* ==== .outside ==== */
+	instrlist_meta_preinsert(ilist, where, outside);
+}
+
 /* insert inline code to add a memory reference info entry into the buffer */
 void MemoryTracker::instrument_mem_full(void *drcontext, instrlist_t *ilist, instr_t *where,
 	opnd_t ref, bool write)
@@ -59,7 +164,8 @@ void MemoryTracker::instrument_mem_full(void *drcontext, instrlist_t *ilist, ins
 	if (drreg_reserve_register(drcontext, ilist, where, &allowed_xcx, &reg2) !=
 		DRREG_SUCCESS ||
 		drreg_reserve_register(drcontext, ilist, where, NULL, &reg1) != DRREG_SUCCESS ||
-		drreg_reserve_register(drcontext, ilist, where, NULL, &reg3) != DRREG_SUCCESS)
+		drreg_reserve_register(drcontext, ilist, where, NULL, &reg3) != DRREG_SUCCESS ||
+		(params.excl_stack && drreg_reserve_aflags(drcontext, ilist, where) != DRREG_SUCCESS))
 	{
 		DR_ASSERT(false); /* cannot recover */
 		return;
@@ -76,11 +182,13 @@ void MemoryTracker::instrument_mem_full(void *drcontext, instrlist_t *ilist, ins
 	drutil_insert_get_mem_addr(drcontext, ilist, where, ref, reg1, reg2);
 
 	/* The following assembly performs the following instructions
-	* if (disabled)
+	* if (disabled || region disabled)
+	*   jmp .restore;
+	* if (excl_stack && addr in stack)
 	*   jmp .restore;
 	* if (flush)
 	*   jmp .call
-	* buf_ptr->write = write;
+	* buf_ptr->kind  = write;
 	* buf_ptr->addr  = addr;
 	* buf_ptr->size  = size;
 	* buf_ptr->pc    = pc;
@@ -99,7 +207,7 @@ void MemoryTracker::instrument_mem_full(void *drcontext, instrlist_t *ilist, ins
 	/* Jump if tracing is disabled */
 	/* load enabled flag into reg2 */
 	opnd1 = opnd_create_reg(reg2);
-	opnd2 = OPND_CREATE_MEMPTR(reg3, offsetof(per_thread_t, enabled));
+	opnd2 = OPND_CREATE_MEMPTR(reg3, enabled_offset());
 	instr = INSTR_CREATE_mov_ld(drcontext, opnd1, opnd2);
 	instrlist_meta_preinsert(ilist, where, instr);
 
@@ -108,6 +216,12 @@ void MemoryTracker::instrument_mem_full(void *drcontext, instrlist_t *ilist, ins
 	instr = INSTR_CREATE_jecxz(drcontext, opnd1);
 	instrlist_meta_preinsert(ilist, where, instr);
 
+	/* Skip accesses to the stack of this thread */
+	if (params.excl_stack) {
+		insert_stack_check(drcontext, ilist, where, reg1, reg3,
+			INSTR_CREATE_jmp(drcontext, opnd_create_instr(restore)));
+	}
+
 	/* Jump if flush is pending, finally return to .after_flush */
 	insert_jmp_on_flush(drcontext, ilist, where, reg2, reg3, call_flush);
 
@@ -120,8 +234,8 @@ void MemoryTracker::instrument_mem_full(void *drcontext, instrlist_t *ilist, ins
 	instr = INSTR_CREATE_mov_ld(drcontext, opnd1, opnd2);
 	instrlist_meta_preinsert(ilist, where, instr);
 
-	/* Move write/read to write field */
-	opnd1 = OPND_CREATE_MEM32(reg2, offsetof(mem_ref_t, write));
+	/* Move write/read to kind field */
+	opnd1 = OPND_CREATE_MEM32(reg2, offsetof(mem_ref_t, kind));
 	opnd2 = OPND_CREATE_INT32(write);
 	instr = INSTR_CREATE_mov_imm(drcontext, opnd1, opnd2);
 	instrlist_meta_preinsert(ilist, where, instr);
@@ -236,6 +350,7 @@ void MemoryTracker::instrument_mem_full(void *drcontext, instrlist_t *ilist, ins
 
 	if (drreg_unreserve_register(drcontext, ilist, where, reg1) != DRREG_SUCCESS ||
 		drreg_unreserve_register(drcontext, ilist, where, reg2) != DRREG_SUCCESS || 
-		drreg_unreserve_register(drcontext, ilist, where, reg3) != DRREG_SUCCESS)
+		drreg_unreserve_register(drcontext, ilist, where, reg3) != DRREG_SUCCESS ||
+		(params.excl_stack && drreg_unreserve_aflags(drcontext, ilist, where) != DRREG_SUCCESS))
 		DR_ASSERT(false);
 }
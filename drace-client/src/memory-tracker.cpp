@@ -26,9 +26,16 @@
 #include "shadow-stack.h"
 #include "function-wrapper.h"
 #include "statistics.h"
+#include "race-collector.h"
+#include "page-ownership.h"
+#include "page-epochs.h"
+#include "thread-registry.h"
+#include "thread-slab.h"
 #include "ipc/SharedMemory.h"
 #include "ipc/SMData.h"
 
+#include <algorithm>
+
 
 namespace drace {
 	MemoryTracker::MemoryTracker()
@@ -43,6 +50,9 @@ namespace drace {
 		static_assert(
 			sizeof(no_flush_t) == sizeof(no_flush_t::value_type)
 			, "atomic uint64 size differs from uint64 size");
+		static_assert(
+			offsetof(per_thread_t, sampling_pos) < ThreadSlab::CACHE_LINE
+			, "fields used by the instrumentation do not fit into a cache line");
 
 		DR_ASSERT(drreg_init(&ops) == DRREG_SUCCESS);
 		page_size = dr_page_size();
@@ -57,6 +67,14 @@ namespace drace {
 		// Initialize Code Caches
 		code_cache_init();
 
+		_region_mx = dr_mutex_create();
+
+		// the entries behind the buffer end are used as sink by the block instrumentation,
+		// the ShadowStack has max_size + 1 Element for PC of access
+		_slab = std::make_unique<ThreadSlab>(
+			MEM_BUF_SIZE + sizeof(mem_ref_t) * MAX_BLOCK_REFS,
+			ShadowStack::max_size + 1);
+
 		// setup sampling
 		update_sampling();
 
@@ -69,6 +87,7 @@ namespace drace {
 
 	MemoryTracker::~MemoryTracker() {
 		dr_nonheap_free(cc_flush, page_size);
+		dr_mutex_destroy(_region_mx);
 
 		drvector_delete(&allowed_xcx);
 
@@ -78,12 +97,6 @@ namespace drace {
 			DR_ASSERT(false);
 	}
 
-	inline void flush_region(void* drcontext, uint64_t pc) {
-		// Flush this area from the code cache
-		dr_delay_flush_region((app_pc)(pc << MemoryTracker::HIST_PC_RES), 1 << MemoryTracker::HIST_PC_RES, 0, NULL);
-		LOG_NOTICE(dr_get_thread_id(drcontext), "Flushed %p", pc << MemoryTracker::HIST_PC_RES);
-	}
-
 	inline std::vector<uint64_t> get_pcs_from_hist(const Statistics::hist_t & hist) {
 		std::vector<uint64_t> result;
 		result.reserve(hist.size());
@@ -101,25 +114,65 @@ namespace drace {
 		const auto & new_freq = data->stats->pc_hits.computeOutput<Statistics::hist_t>();
 		LOG_NOTICE(data->tid, "Flush Cache with size %i", new_freq.size());
 		if (params.lossy_flush) {
-			void * drcontext = dr_get_current_drcontext();
 			const auto & pc_new = get_pcs_from_hist(new_freq);
 			const auto & pc_old = data->stats->freq_pcs;
 
-			std::vector<uint64_t> difference;
-			difference.reserve(pc_new.size() + pc_old.size());
+			std::vector<uint64_t> hot, cold;
+			hot.reserve(pc_new.size());
+			cold.reserve(pc_old.size());
 
 			// get difference between both histograms
-			std::set_symmetric_difference(pc_new.begin(), pc_new.end(), pc_old.begin(), pc_old.end(), std::back_inserter(difference));
+			std::set_difference(pc_new.begin(), pc_new.end(), pc_old.begin(), pc_old.end(), std::back_inserter(hot));
+			std::set_difference(pc_old.begin(), pc_old.end(), pc_new.begin(), pc_new.end(), std::back_inserter(cold));
 
-			// Flush new fragments
-			for (const auto pc : difference) {
-				flush_region(drcontext, pc);
+			// switch regions instead of flushing the code cache
+			for (const auto pc : hot) {
+				memory_tracker->disable_region(pc);
+				LOG_NOTICE(data->tid, "Disabled region %p", pc << MemoryTracker::HIST_PC_RES);
+			}
+			for (const auto pc : cold) {
+				memory_tracker->enable_region(pc);
+				LOG_NOTICE(data->tid, "Enabled region %p", pc << MemoryTracker::HIST_PC_RES);
 			}
 			data->stats->freq_pcs = pc_new;
 		}
 		data->stats->freq_pc_hist = new_freq;
 	}
 
+	void MemoryTracker::disable_region(uint64_t region) {
+		module::Metadata * mod = module_tracker->find_module((app_pc)(region << HIST_PC_RES));
+		if (mod == nullptr || !mod->region_enabled)
+			return;
+		size_t idx = mod->region_index(region, HIST_PC_RES);
+		dr_mutex_lock(_region_mx);
+		if (mod->region_refs[idx]++ == 0) {
+			mod->region_enabled[idx] = 0;
+		}
+		dr_mutex_unlock(_region_mx);
+	}
+
+	void MemoryTracker::enable_region(uint64_t region) {
+		module::Metadata * mod = module_tracker->find_module((app_pc)(region << HIST_PC_RES));
+		if (mod == nullptr || !mod->region_enabled)
+			return;
+		size_t idx = mod->region_index(region, HIST_PC_RES);
+		dr_mutex_lock(_region_mx);
+		if (mod->region_refs[idx] > 0 && --mod->region_refs[idx] == 0) {
+			mod->region_enabled[idx] = 1;
+		}
+		dr_mutex_unlock(_region_mx);
+	}
+
+	uint8_t * MemoryTracker::region_flag(app_pc pc) {
+		if (!params.lossy_flush)
+			return nullptr;
+		// modules are never removed from the tracker, hence the flag stays valid
+		module::Metadata * mod = module_tracker->find_module(pc);
+		if (mod == nullptr || !mod->region_enabled)
+			return nullptr;
+		return &mod->region_enabled[mod->region_index((ptr_uint_t)pc >> HIST_PC_RES, HIST_PC_RES)];
+	}
+
 	bool MemoryTracker::pc_in_freq(per_thread_t * data, void* bb) {
 		const auto & freq_pcs = data->stats->freq_pcs;
 		return std::binary_search(freq_pcs.begin(), freq_pcs.end(), ((uint64_t)bb >> MemoryTracker::HIST_PC_RES));
@@ -144,7 +197,19 @@ namespace drace {
 			memory_tracker->handle_ext_state(data);
 		}
 
-		if (data->enabled) {
+		// Accesses while this is the only thread cannot race (excl-single):
+		// A thread is counted before it executes application code,
+		// hence accesses of the single threaded phase happen before it.
+		// The buffer is single threaded if it was started by the only thread
+		// and no thread started since, independent of later thread exits.
+		bool single = params.excl_single && data->buf_single
+			&& data->buf_phase == thread_phase.load();
+
+		if (!data->enabled || single) {
+			// accesses are discarded, but the allocation state has to be kept
+			discard_buffer(data);
+		}
+		else {
 			mem_ref_t * mem_ref = (mem_ref_t *)data->mem_buf.data;
 			uint64_t num_refs = (uint64_t)((mem_ref_t *)data->buf_ptr - mem_ref);
 
@@ -171,27 +236,62 @@ namespace drace {
 					}
 				}
 
+				// pages which are already summarized in this flush (excl-private)
+				constexpr unsigned num_owned_pages = 16;
+				uint64_t owned_pages[num_owned_pages];
+				std::fill_n(owned_pages, num_owned_pages, ~0ull);
+
 				for (uint64_t i = 0; i < num_refs; ++i) {
 					// todo: better use iterator like access
 					mem_ref = &((mem_ref_t *)data->mem_buf.data)[i];
-					if (params.excl_stack &&
-						((ULONG_PTR)mem_ref->addr > data->appstack_beg) && 
-						((ULONG_PTR)mem_ref->addr < data->appstack_end))
-					{
-						// this reference points into the stack range, skip
+					if (mem_ref->kind >= mem_ref_t::ALLOC) {
+						analyze_alloc(data, mem_ref);
 						continue;
 					}
+					// stack references are filtered inline (excl-stack) or
+					// replaced by an address outside the process address space
 					if ((uint64_t)mem_ref->addr > PROC_ADDR_LIMIT) {
 						// outside process address space
 						continue;
 					}
+					// skip reads of pages which are read-only since the last epoch
+					if (page_epochs) {
+						if (mem_ref->kind == mem_ref_t::WRITE) {
+							page_epochs->write((uint64_t)mem_ref->addr, mem_ref->size);
+						}
+						else if (page_epochs->is_read_only((uint64_t)mem_ref->addr, mem_ref->size)) {
+							continue;
+						}
+					}
+					// pages used by a single thread cannot race, the owner
+					// summarizes its accesses once per page and flush
+					if (page_ownership) {
+						uint64_t addr = (uint64_t)mem_ref->addr;
+						uint64_t page = PageOwnership::page_begin(addr);
+						switch (page_ownership->access(data->tid, addr, mem_ref->size)) {
+						case PageOwnership::State::OWNED:
+						{
+							uint64_t & summarized = owned_pages[(page >> PageOwnership::PAGE_BITS) & (num_owned_pages - 1)];
+							if (summarized != page) {
+								summarized = page;
+								detector::own_range(data->detector_data, mem_ref->pc, (void*)page, 1 << PageOwnership::PAGE_BITS);
+							}
+							continue;
+						}
+						case PageOwnership::State::TRANSFERRED:
+							detector::transfer_range(data->detector_data, mem_ref->pc, (void*)page, 1 << PageOwnership::PAGE_BITS);
+							break;
+						default:
+							break;
+						}
+					}
 					// this is a mem-ref candidate
 					//if (!memory_tracker->sample_ref(data)) {
 					//	continue;
 					//}
 
 					stack->data[stack->entries - 1] = mem_ref->pc;
-					if (mem_ref->write) {
+					if (mem_ref->kind == mem_ref_t::WRITE) {
 						detector::write(data->detector_data, stack->data + offset, size, mem_ref->addr, mem_ref->size);
 						//printf("[%i] WRITE %p, PC: %p\n", data->tid, mem_ref->addr, mem_ref->pc);
 					}
@@ -207,7 +307,12 @@ namespace drace {
 				data->stats->total_refs += num_refs;
 			}
 		}
-		data->buf_ptr = data->mem_buf.data;
+		begin_buffer(data);
+
+		if (params.fastmode && data->ext_flush_req.load(std::memory_order_relaxed)) {
+			LOG_TRACE(data->tid, "externally requested flush done");
+			data->ext_flush_req.store(false, std::memory_order_relaxed);
+		}
 
 		if (!params.fastmode && !data->no_flush.load(std::memory_order_relaxed)) {
 			uint64_t expect = 0;
@@ -215,27 +320,51 @@ namespace drace {
 		}
 	}
 
+	void MemoryTracker::analyze_alloc(per_thread_t * data, const mem_ref_t * mem_ref) {
+		if (mem_ref->kind == mem_ref_t::ALLOC) {
+			detector::allocate(data->detector_data, mem_ref->pc, mem_ref->addr, mem_ref->size);
+		}
+	}
+
+	void MemoryTracker::discard_buffer(per_thread_t * data) {
+		mem_ref_t * mem_ref = (mem_ref_t *)data->mem_buf.data;
+		mem_ref_t * end = (mem_ref_t *)data->buf_ptr;
+		for (; mem_ref < end; ++mem_ref) {
+			if (mem_ref->kind >= mem_ref_t::ALLOC)
+				analyze_alloc(data, mem_ref);
+		}
+		begin_buffer(data);
+	}
+
+	void MemoryTracker::begin_buffer(per_thread_t * data) {
+		data->buf_ptr = data->mem_buf.data;
+		// read the phase first, as it is incremented after the thread count
+		data->buf_phase = thread_phase.load();
+		data->buf_single = num_threads_active.load() <= 1;
+	}
+
+	void MemoryTracker::invalidate_accesses(per_thread_t * data) {
+		mem_ref_t * mem_ref = (mem_ref_t *)data->mem_buf.data;
+		mem_ref_t * end = (mem_ref_t *)data->buf_ptr;
+		for (; mem_ref < end; ++mem_ref) {
+			if (mem_ref->kind <= mem_ref_t::WRITE)
+				mem_ref->kind = mem_ref_t::RESERVED;
+		}
+	}
+
 	/*
 	 * Thread init Event
 	 */
 	void MemoryTracker::event_thread_init(void *drcontext)
 	{
-		/* allocate thread private data */
-		void * tls_buffer = dr_thread_alloc(drcontext, sizeof(per_thread_t));
-		drmgr_set_tls_field(drcontext, tls_idx, tls_buffer);
+		/* construct thread data, buffers and statistics in a (recycled) block */
+		per_thread_t * data = _slab->acquire(dr_get_thread_id(drcontext));
+		drmgr_set_tls_field(drcontext, tls_idx, data);
 
-		// Initialize struct at given location (placement new)
-		per_thread_t * data = new (tls_buffer) per_thread_t;
-
-		data->mem_buf.resize(MEM_BUF_SIZE, drcontext);
-		data->buf_ptr = data->mem_buf.data;
+		begin_buffer(data);
 		/* set buf_end to be negative of address of buffer end for the lea later */
 		data->buf_end = -(ptr_int_t)(data->mem_buf.data + MEM_BUF_SIZE);
-		data->tid = dr_get_thread_id(drcontext);
-		// Init ShadowStack with max_size + 1 Element for PC of access
-		data->stack.resize(ShadowStack::max_size + 1, drcontext);
 
-		data->mutex_book.reserve(MUTEX_MAP_SIZE);
 		// set first sampling period
 		data->sampling_pos = params.sampling_rate;
 
@@ -253,12 +382,11 @@ namespace drace {
 			disable_scope(data);
 		}
 
-		data->stats = std::make_unique<Statistics>(data->tid);
-
-		dr_rwlock_write_lock(tls_rw_mutex);
-		TLS_buckets.emplace(data->tid, data);
-		data->th_towait.reserve(TLS_buckets.bucket_count());
-		dr_rwlock_write_unlock(tls_rw_mutex);
+		data->registry_slot = thread_registry->insert(data);
+		if (data->registry_slot == thread_registry_t::INVALID) {
+			LOG_WARN(data->tid, "too many concurrent threads, thread is not flushed by others");
+		}
+		data->th_towait.reserve(num_threads_active.load(std::memory_order_relaxed));
 
 		flush_all_threads(data, false, false);
 
@@ -275,31 +403,27 @@ namespace drace {
 
 		flush_all_threads(data, true, false);
 
+		// release the regions disabled by this thread, as the refcounts are global
+		if (params.lossy_flush) {
+			for (const auto pc : data->stats->freq_pcs) {
+				enable_region(pc);
+			}
+		}
+
 		detector::join(runtime_tid.load(std::memory_order_relaxed), data->tid, data->detector_data);
 
-		dr_rwlock_write_lock(tls_rw_mutex);
-		// as this is a exclusive lock and this is the only place
-		// where stats are combined, we use it
-		*stats |= *(data->stats);
+		// Other threads might still flush this thread,
+		// hence wait until no reader can access this tls anymore
+		thread_registry->remove(data->registry_slot);
 
-		// As TLS_buckets stores a pointer to this tls,
-		// we cannot release the lock until the deallocation
-		// is finished. Otherwise a second thread might
-		// read a local copy of the tls while holding
-		// a read lock on TLS_buckets during deallocation
-		DR_ASSERT(TLS_buckets.count(data->tid) == 1);
-		TLS_buckets.erase(data->tid);
-		dr_rwlock_write_unlock(tls_rw_mutex);
+		dr_mutex_lock(stats_mutex);
+		*stats |= *(data->stats);
+		dr_mutex_unlock(stats_mutex);
 
 		data->stats->print_summary(drace::log_target);
 
-		// Cleanup TLS
-		// As we cannot rely on current drcontext here, use provided one
-		data->stack.deallocate(drcontext);
-		data->mem_buf.deallocate(drcontext);
-		// deconstruct struct
-		data->~per_thread_t();
-		dr_thread_free(drcontext, data, sizeof(per_thread_t));
+		// Cleanup TLS, the block is reused by the next thread
+		_slab->release(data);
 	}
 
 
@@ -315,6 +439,99 @@ namespace drace {
 		return DR_EMIT_DEFAULT;
 	}
 
+	/** Returns true if the memory references of this instruction are instrumented */
+	static bool is_mem_candidate(instr_t * instr) {
+		if (!instr_is_app(instr))
+			return false;
+
+		if (!instr_reads_memory(instr) && !instr_writes_memory(instr))
+			return false;
+
+		if (params.excl_stack) {
+			// exclude pop and push
+			int opcode = instr_get_opcode(instr);
+			if (opcode == OP_pop || opcode == OP_popa || opcode == OP_popf ||
+				opcode == OP_push || opcode == OP_pusha || opcode == OP_pushf) {
+				return false;
+			}
+
+			// exclude other modifications of stackptr
+			if (instr_reads_from_reg(instr, DR_REG_XSP, DR_QUERY_DEFAULT) ||
+				instr_writes_to_reg(instr, DR_REG_XSP, DR_QUERY_DEFAULT) ||
+				instr_reads_from_reg(instr, DR_REG_XBP, DR_QUERY_DEFAULT) ||
+				instr_writes_to_reg(instr, DR_REG_XBP, DR_QUERY_DEFAULT))
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+	/** Number of memory operands of this instruction */
+	static unsigned num_mem_refs(instr_t * instr) {
+		unsigned refs = 0;
+		for (int i = 0; i < instr_num_srcs(instr); i++) {
+			if (opnd_is_memory_reference(instr_get_src(instr, i)))
+				++refs;
+		}
+		for (int i = 0; i < instr_num_dsts(instr); i++) {
+			if (opnd_is_memory_reference(instr_get_dst(instr, i)))
+				++refs;
+		}
+		return refs;
+	}
+
+	/**
+	* A final cti is instrumented individually, as the shadow stack
+	* analyzes the buffer right before it.
+	*/
+	static inline bool is_block_instr(instrlist_t * bb, instr_t * instr) {
+		return !(instr == instrlist_last(bb) && instr_is_cti(instr));
+	}
+
+	/** Number of references which are written by the block instrumentation before this instruction */
+	static unsigned block_refs_before(instrlist_t * bb, instr_t * where) {
+		unsigned refs = 0;
+		for (instr_t * instr = instrlist_first(bb); instr != where; instr = instr_get_next(instr)) {
+			if (is_mem_candidate(instr))
+				refs += num_mem_refs(instr);
+		}
+		return refs;
+	}
+
+	/**
+	* Checks if all references of this block can be written using a single buffer update.
+	* This requires a straight-line block and a register which is not used by the application.
+	* \return encoded as (reg << 8 | number of refs), 0 if each reference is instrumented individually
+	*/
+	static ptr_uint_t plan_block(instrlist_t * bb) {
+		unsigned refs = 0;
+		for (instr_t * instr = instrlist_first(bb); instr != nullptr; instr = instr_get_next(instr)) {
+			if (!is_block_instr(bb, instr))
+				break;
+			// exits in the middle of the block (e.g. traces, expanded string loops)
+			if (instr_is_cti(instr))
+				return 0;
+			if (is_mem_candidate(instr))
+				refs += num_mem_refs(instr);
+		}
+		if (refs == 0 || refs > (unsigned)MemoryTracker::MAX_BLOCK_REFS)
+			return 0;
+
+		// XCX is used as scratch register by the block header
+		for (reg_id_t reg = DR_REG_START_GPR; reg <= DR_REG_STOP_GPR; ++reg) {
+			if (reg == DR_REG_XSP || reg == DR_REG_XCX)
+				continue;
+			bool used = false;
+			for (instr_t * instr = instrlist_first(bb); instr != nullptr && !used; instr = instr_get_next(instr)) {
+				used = instr_uses_reg(instr, reg);
+			}
+			if (!used)
+				return ((ptr_uint_t)reg << 8) | refs;
+		}
+		return 0;
+	}
+
 	dr_emit_flags_t MemoryTracker::event_app_analysis(void *drcontext, void *tag, instrlist_t *bb,
 		bool for_trace, bool translating, OUT void **user_data) {
 		using INSTR_FLAGS = module::Metadata::INSTR_FLAGS;
@@ -330,38 +547,46 @@ namespace drace {
 		auto instrument_bb = INSTR_FLAGS::MEMORY;
 		app_pc bb_addr = dr_fragment_app_pc(tag);
 
-		// Lookup module from cache, hit is very likely as adiacent bb's 
-		// are mostly in the same module
-		module::Metadata * modptr = mc.lookup(bb_addr);
+		per_thread_t * data = (per_thread_t*)drmgr_get_tls_field(drcontext, tls_idx);
+
+		// Lookup module from thread-local cache, hit is very likely as adiacent bb's
+		// are mostly in the same few modules
+		module::Metadata * modptr = data->mod_cache.lookup(bb_addr, module_tracker->generation());
 		if (nullptr != modptr) {
-			instrument_bb = modptr->instrument;
+			instrument_bb = modptr->effective_instrument();
+			data->stats->module_cache_hits++;
 		}
 		else {
-			module_tracker->lock_read();
-			modptr = (module_tracker->get_module_containing(bb_addr)).get();
+			data->stats->module_cache_misses++;
+			// lock-free lookup in current module snapshot
+			modptr = module_tracker->find_module(bb_addr);
 			if (modptr) {
 				// bb in known module
-				instrument_bb = modptr->instrument;
-				mc.update(modptr);
+				instrument_bb = modptr->effective_instrument();
+				data->mod_cache.update(modptr, modptr->base, modptr->end);
 			}
 			else {
 				// Module not known
 				LOG_TRACE(0, "Module unknown, probably JIT code (%p)", bb_addr);
 				instrument_bb = (INSTR_FLAGS)(INSTR_FLAGS::MEMORY | INSTR_FLAGS::STACK);
 			}
-			module_tracker->unlock_read();
 		}
 
-		// Do not instrument if block is frequent
-		if (for_trace && instrument_bb) {
-			per_thread_t * data = (per_thread_t*)drmgr_get_tls_field(drcontext, tls_idx);
+		// Do not instrument if block is frequent.
+		// With lossy-flush, frequent regions are skipped by an inline check
+		if (for_trace && instrument_bb && !params.lossy_flush) {
 			if (pc_in_freq(data, bb_addr)) {
 				instrument_bb = INSTR_FLAGS::NONE;
 			}
 		}
 
 		// Avoid temporary allocation by using ptr-value directly
-		*user_data = (void*)instrument_bb;
+		// Layout: |--reg--|--refs--|--flags--|
+		ptr_uint_t bb_info = instrument_bb;
+		if (params.fastmode && (instrument_bb & INSTR_FLAGS::MEMORY) && params.instr_rate == 1) {
+			bb_info |= (plan_block(bb) << 8);
+		}
+		*user_data = (void*)bb_info;
 		return DR_EMIT_DEFAULT;
 	}
 
@@ -377,6 +602,10 @@ namespace drace {
 		// we treat all atomic accesses as reads
 		bool instr_is_atomic{ false };
 
+		// With lossy-flush, the state of the code region is checked once per block
+		if (params.lossy_flush && (instrument_instr & INSTR_FLAGS::MEMORY) && drmgr_is_first_instr(drcontext, instr))
+			insert_region_header(drcontext, bb, instr, dr_fragment_app_pc(tag));
+
 		if (!instr_is_app(instr))
 			return DR_EMIT_DEFAULT;
 
@@ -388,31 +617,38 @@ namespace drace {
 		if (!(instrument_instr & INSTR_FLAGS::MEMORY))
 			return DR_EMIT_DEFAULT;
 
-		if (!instr_reads_memory(instr) && !instr_writes_memory(instr))
+		if (!is_mem_candidate(instr))
 			return DR_EMIT_DEFAULT;
 
-		if (params.excl_stack) {
-			// exclude pop and push
-			int opcode = instr_get_opcode(instr);
-			if (opcode == OP_pop || opcode == OP_popa || opcode == OP_popf ||
-				opcode == OP_push || opcode == OP_pusha || opcode == OP_pushf) {
-				return DR_EMIT_DEFAULT;
-			}
-
-			// exclude other modifications of stackptr
-			if (instr_reads_from_reg(instr, DR_REG_XSP, DR_QUERY_DEFAULT) ||
-				instr_writes_to_reg(instr, DR_REG_XSP, DR_QUERY_DEFAULT) ||
-				instr_reads_from_reg(instr, DR_REG_XBP, DR_QUERY_DEFAULT) ||
-				instr_writes_to_reg(instr, DR_REG_XBP, DR_QUERY_DEFAULT))
-			{
-				return DR_EMIT_DEFAULT;
-			}
-		}
-
 		// atomic instruction
 		if (instr_get_prefix_flag(instr, PREFIX_LOCK))
 			instr_is_atomic = true;
 
+		// Block mode: all references of the block share one buffer update.
+		// The decision was made during analysis, hence do not sample here
+		unsigned block_refs = ((ptr_uint_t)user_data >> 8) & 0xFF;
+		if (block_refs > 0 && is_block_instr(bb, instr)) {
+			reg_id_t reg_buf = (reg_id_t)(((ptr_uint_t)user_data >> 16) & 0xFF);
+			unsigned index = block_refs_before(bb, instr);
+			if (index == 0)
+				insert_block_header(drcontext, bb, instr, reg_buf, block_refs);
+
+			for (int i = 0; i < instr_num_srcs(instr); i++) {
+				opnd_t src = instr_get_src(instr, i);
+				if (opnd_is_memory_reference(src))
+					instrument_mem_block(drcontext, bb, instr, src, false, reg_buf, index++);
+			}
+			for (int i = 0; i < instr_num_dsts(instr); i++) {
+				opnd_t dst = instr_get_dst(instr, i);
+				if (opnd_is_memory_reference(dst))
+					instrument_mem_block(drcontext, bb, instr, dst, !instr_is_atomic, reg_buf, index++);
+			}
+
+			if (index == block_refs && drreg_unreserve_register(drcontext, bb, instr, reg_buf) != DRREG_SUCCESS)
+				DR_ASSERT(false);
+			return DR_EMIT_DEFAULT;
+		}
+
 		// Sampling: Only instrument some instructions
 		// This is a racy increment, but we do not rely on exact numbers
 		auto cnt = ++instrum_count;
@@ -467,7 +703,7 @@ namespace drace {
 
 		data->stats->proc_refs += num_refs;
 		data->stats->flushes++;
-		data->buf_ptr = data->mem_buf.data;
+		discard_buffer(data);
 		data->no_flush.store(true, std::memory_order_relaxed);
 	}
 
@@ -499,24 +735,24 @@ namespace drace {
 
 		data->th_towait.clear();
 
-		// Preserve state by copying tls pointers to local array
-		dr_rwlock_read_lock(tls_rw_mutex);
-
+		// Preserve state by copying tls pointers to local array.
+		// The guard keeps the tls of exiting threads alive until we are done
+		thread_registry_t::ReadGuard guard(*thread_registry, current_registry_slot());
 
 		// Get threads and notify them
-		for (const auto & td : TLS_buckets) {
-			if (td.first != data->tid && td.second->enabled && td.second->no_flush.load(std::memory_order_relaxed))
+		thread_registry->for_each([data](per_thread_t * other) {
+			if (other->tid != data->tid && other->enabled && other->no_flush.load(std::memory_order_relaxed))
 			{
-				uint64_t refs = (td.second->buf_ptr - td.second->mem_buf.data) / sizeof(mem_ref_t);
+				uint64_t refs = (other->buf_ptr - other->mem_buf.data) / sizeof(mem_ref_t);
 				if (refs > 0) {
 					//printf("[%.5i] Flush thread %.5i, ~numrefs, %u\n",
-					//	data->tid, td.first, refs);
+					//	data->tid, other->tid, refs);
 					// TODO: check if memory_order_relaxed is sufficient
-					td.second->no_flush.store(false, std::memory_order_relaxed);
-					data->th_towait.push_back(td);
+					other->no_flush.store(false, std::memory_order_relaxed);
+					data->th_towait.emplace_back(other->tid, other);
 				}
 			}
-		}
+		});
 
 		// wait until all threads flushed
 		// this is a hacky half-barrier implementation
@@ -538,15 +774,15 @@ namespace drace {
 							td.second->external_flush.store(false, std::memory_order_release);
 						}
 					}
-					// Here we might loose some refs, clear them
-					td.second->buf_ptr = td.second->mem_buf.data;
+					// Here we might loose some refs, clear them.
+					// Allocations are processed by the thread itself at its next flush
+					invalidate_accesses(td.second);
 					td.second->no_flush.store(true, std::memory_order_relaxed);
 					break;
 				}
 			}
 		}
 		memory_tracker->flush_active.store(false, std::memory_order_relaxed);
-		dr_rwlock_read_unlock(tls_rw_mutex);
 
 		auto duration = std::chrono::system_clock::now() - start;
 		data->stats->time_in_flushes += std::chrono::duration_cast<std::chrono::milliseconds>(duration);
@@ -579,26 +815,87 @@ namespace drace {
 	}
 
 	void MemoryTracker::handle_ext_state(per_thread_t * data) {
-		if (shmdriver) {
-			bool external_state = extcb->get()->enabled.load(std::memory_order_relaxed);
-			if (data->enable_external != external_state) {
-				{
-					LOG_INFO(0, "externally switched state: %s", external_state ? "ON" : "OFF");
-					data->enable_external = external_state;
-					if (!external_state) {
-						funwrap::event::beg_excl_region(data);
-					}
-					else {
-						funwrap::event::end_excl_region(data);
-					}
-				}
+		if (!extcb)
+			return;
+		const ipc::ClientCB & cb = *(extcb->get());
+		uint32_t generation = cb.generation.load(std::memory_order_acquire);
+		if (generation == data->ext_generation)
+			return;
+		data->ext_generation = generation;
+
+		bool external_state = cb.enabled.load(std::memory_order_relaxed)
+			&& !cb.thread_disabled(data->tid);
+		if (data->enable_external != external_state) {
+			LOG_INFO(data->tid, "externally switched state: %s", external_state ? "ON" : "OFF");
+			data->enable_external = external_state;
+			if (!external_state) {
+				funwrap::event::beg_excl_region(data);
+			}
+			else {
+				funwrap::event::end_excl_region(data);
 			}
-			// set sampling rate
-			unsigned sampling_rate = extcb->get()->sampling_rate.load(std::memory_order_relaxed);
-			if (sampling_rate != params.sampling_rate) {
-				LOG_INFO(0, "externally changed sampling rate to: %i", sampling_rate);
-				params.sampling_rate = sampling_rate;
-				update_sampling();
+		}
+
+		// process-wide settings are applied by the first thread which observes the change.
+		// Skip if this thread is flushed by another thread, as the settings might require a flush
+		uint32_t applied = _ext_generation.load(std::memory_order_relaxed);
+		if (applied != generation
+			&& data->tid == dr_get_thread_id(dr_get_current_drcontext())
+			&& _ext_generation.compare_exchange_strong(applied, generation, std::memory_order_relaxed))
+		{
+			apply_ext_config(data, cb);
+		}
+	}
+
+	void MemoryTracker::apply_ext_config(per_thread_t * data, const ipc::ClientCB & cb) {
+		// set sampling rate
+		unsigned sampling_rate = cb.sampling_rate.load(std::memory_order_relaxed);
+		if (sampling_rate != params.sampling_rate) {
+			LOG_INFO(0, "externally changed sampling rate to: %i", sampling_rate);
+			params.sampling_rate = sampling_rate;
+			update_sampling();
+		}
+
+		race_collector->set_dedup(cb.dedup.load(std::memory_order_relaxed));
+
+		// changes of the instrumentation only take effect after the code is flushed
+		unsigned instr_rate = std::max(cb.instr_rate.load(std::memory_order_relaxed), 1u);
+		bool reinstrument_all = (instr_rate != params.instr_rate);
+		if (reinstrument_all) {
+			LOG_INFO(0, "externally changed instrumentation rate to: %i", instr_rate);
+			params.instr_rate = instr_rate;
+		}
+		module_tracker->for_each_loaded([&](module::Metadata & mod) {
+			if (mod.info == nullptr)
+				return;
+			bool disabled = cb.module_disabled(dr_module_preferred_name(mod.info));
+			if (disabled != mod.ext_disabled.load(std::memory_order_relaxed)) {
+				LOG_INFO(0, "externally %s module %s", disabled ? "disabled" : "enabled",
+					dr_module_preferred_name(mod.info));
+				mod.ext_disabled.store(disabled, std::memory_order_relaxed);
+			}
+			else if (!reinstrument_all) {
+				return;
+			}
+			dr_delay_flush_region(mod.base, mod.end - mod.base, 0, NULL);
+		});
+
+		// analyze the buffered accesses of all threads
+		uint32_t flush_seq = cb.flush_seq.load(std::memory_order_relaxed);
+		if (flush_seq != _ext_flush_seq) {
+			LOG_INFO(0, "externally requested flush");
+			_ext_flush_seq = flush_seq;
+			if (params.fastmode) {
+				// in fast-mode, only the thread itself may analyze its buffer.
+				// The buffer of this thread is analyzed by the caller
+				thread_registry_t::ReadGuard guard(*thread_registry, current_registry_slot());
+				thread_registry->for_each([data](per_thread_t * other) {
+					if (other != data)
+						other->ext_flush_req.store(true, std::memory_order_relaxed);
+				});
+			}
+			else {
+				flush_all_threads(data, false, true);
 			}
 		}
 	}
@@ -0,0 +1,207 @@
+/*
+ * DRace, a dynamic data race detector
+ *
+ * Copyright 2018 Siemens AG
+ *
+ * Authors:
+ *   Felix Moessbauer <felix.moessbauer@siemens.com>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "globals.h"
+#include "module/DecisionCache.h"
+
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+
+namespace drace {
+	namespace module {
+		/*
+		* File format (text, one record per line):
+		*   drace-modcache <version> <config-hash>
+		*   module <key-len> <key> <instrument> <modtype> <debug_info>
+		*   sym <offs1>,<offs2>,...\t<pattern>
+		* sym lines belong to the preceding module line.
+		*/
+		static constexpr int cache_version = 1;
+
+		DecisionCache::DecisionCache(const std::string & filename, uint64_t config_hash)
+			: _filename(filename),
+			_config_hash(config_hash)
+		{
+			_mx = dr_mutex_create();
+			load();
+		}
+
+		DecisionCache::~DecisionCache() {
+			dr_mutex_destroy(_mx);
+		}
+
+		std::string DecisionCache::make_key(const module_data_t * mod) {
+			std::stringstream key;
+			std::string path(mod->full_path);
+			std::transform(path.begin(), path.end(), path.begin(), ::tolower);
+			key << std::hex;
+#ifdef WINDOWS
+			key << mod->timestamp << ':' << mod->checksum << ':';
+#endif
+			key << (mod->end - mod->start) << ':' << path;
+			return key.str();
+		}
+
+		uint64_t DecisionCache::hash(const std::vector<std::string> & items, uint64_t seed) {
+			uint64_t h = seed;
+			for (const auto & item : items) {
+				for (unsigned char c : item) {
+					h ^= c;
+					h *= 0x100000001b3ull;
+				}
+				// separator
+				h ^= 0xff;
+				h *= 0x100000001b3ull;
+			}
+			return h;
+		}
+
+		void DecisionCache::load() {
+			std::ifstream file(_filename);
+			if (!file.good()) {
+				LOG_NOTICE(-1, "module cache %s not found, create new one", _filename.c_str());
+				return;
+			}
+
+			std::string line;
+			std::getline(file, line);
+			{
+				std::stringstream ss(line);
+				std::string magic;
+				int version;
+				uint64_t config_hash;
+				ss >> magic >> version >> std::hex >> config_hash;
+				if (magic != "drace-modcache" || version != cache_version || config_hash != _config_hash) {
+					LOG_NOTICE(-1, "module cache %s is outdated, discard", _filename.c_str());
+					_dirty = true;
+					return;
+				}
+			}
+
+			Entry * current = nullptr;
+			while (std::getline(file, line)) {
+				if (line.compare(0, 7, "module ") == 0) {
+					std::stringstream ss(line.substr(7));
+					size_t keylen;
+					ss >> keylen;
+					ss.get();
+					std::string key(keylen, '\0');
+					ss.read(&key[0], keylen);
+					unsigned instr, modtype, debug_info;
+					ss >> instr >> modtype >> debug_info;
+					if (!ss) {
+						current = nullptr;
+						continue;
+					}
+					current = &_entries[key];
+					current->has_decision = true;
+					current->decision.instrument = (Metadata::INSTR_FLAGS)instr;
+					current->decision.modtype = (Metadata::MOD_TYPE_FLAGS)modtype;
+					current->decision.debug_info = (debug_info != 0);
+				}
+				else if (line.compare(0, 4, "sym ") == 0 && current != nullptr) {
+					auto tab = line.find('\t');
+					if (tab == std::string::npos)
+						continue;
+					std::vector<size_t> offsets;
+					std::stringstream ss(line.substr(4, tab - 4));
+					std::string offs;
+					while (std::getline(ss, offs, ',')) {
+						if (!offs.empty())
+							offsets.push_back(std::stoull(offs, nullptr, 16));
+					}
+					current->symbols[line.substr(tab + 1)] = std::move(offsets);
+				}
+			}
+			LOG_NOTICE(-1, "loaded %i modules from module cache %s", _entries.size(), _filename.c_str());
+		}
+
+		void DecisionCache::save() {
+			dr_mutex_lock(_mx);
+			if (_dirty) {
+				std::ofstream file(_filename, std::ofstream::out | std::ofstream::trunc);
+				if (file.good()) {
+					file << "drace-modcache " << cache_version << " " << std::hex << _config_hash << "\n";
+					for (const auto & e : _entries) {
+						file << "module " << std::dec << e.first.size() << " " << e.first << " "
+							<< (unsigned)e.second.decision.instrument << " "
+							<< (unsigned)e.second.decision.modtype << " "
+							<< (e.second.decision.debug_info ? 1 : 0) << "\n";
+						for (const auto & sym : e.second.symbols) {
+							file << "sym " << std::hex;
+							for (auto offs : sym.second) {
+								file << offs << ",";
+							}
+							file << "\t" << sym.first << "\n";
+						}
+					}
+					_dirty = false;
+				}
+				else {
+					LOG_WARN(-1, "could not write module cache %s", _filename.c_str());
+				}
+			}
+			dr_mutex_unlock(_mx);
+		}
+
+		bool DecisionCache::lookup(const module_data_t * mod, Decision & dec) const {
+			bool found = false;
+			auto key = make_key(mod);
+			dr_mutex_lock(_mx);
+			auto it = _entries.find(key);
+			if (it != _entries.end() && it->second.has_decision) {
+				dec = it->second.decision;
+				found = true;
+			}
+			dr_mutex_unlock(_mx);
+			return found;
+		}
+
+		void DecisionCache::store(const module_data_t * mod, const Decision & dec) {
+			auto key = make_key(mod);
+			dr_mutex_lock(_mx);
+			auto & entry = _entries[key];
+			entry.has_decision = true;
+			entry.decision = dec;
+			_dirty = true;
+			dr_mutex_unlock(_mx);
+		}
+
+		bool DecisionCache::lookup_symbol(const module_data_t * mod, const std::string & pattern,
+			std::vector<size_t> & offsets) const
+		{
+			bool found = false;
+			auto key = make_key(mod);
+			dr_mutex_lock(_mx);
+			auto it = _entries.find(key);
+			if (it != _entries.end()) {
+				auto sym = it->second.symbols.find(pattern);
+				if (sym != it->second.symbols.end()) {
+					offsets = sym->second;
+					found = true;
+				}
+			}
+			dr_mutex_unlock(_mx);
+			return found;
+		}
+
+		void DecisionCache::store_symbol(const module_data_t * mod, const std::string & pattern,
+			const std::vector<size_t> & offsets)
+		{
+			auto key = make_key(mod);
+			dr_mutex_lock(_mx);
+			_entries[key].symbols[pattern] = offsets;
+			_dirty = true;
+			dr_mutex_unlock(_mx);
+		}
+	} // namespace module
+} // namespace drace
@@ -11,6 +11,7 @@
 
 #include "globals.h"
 #include "Module.h"
+#include "memory-tracker.h"
 
 #include "function-wrapper.h"
 #include "statistics.h"
@@ -48,6 +49,13 @@ namespace drace {
 				std::transform(prefix.begin(), prefix.end(), prefix.begin(), ::tolower);
 			}
 
+			if (params.modcache_file != "") {
+				// cached decisions are only valid for the same exclusion rules
+				uint64_t config_hash = DecisionCache::hash(excluded_path_prefix,
+					DecisionCache::hash(excluded_mods));
+				decisions = std::make_unique<DecisionCache>(params.modcache_file, config_hash);
+			}
+
 			if (!drmgr_register_module_load_event(event_module_load) ||
 				!drmgr_register_module_unload_event(event_module_unload)) {
 				DR_ASSERT(false);
@@ -60,7 +68,33 @@ namespace drace {
 				DR_ASSERT(false);
 			}
 
+			if (decisions) {
+				decisions->save();
+			}
+
 			dr_rwlock_destroy(mod_lock);
+
+			delete _snapshot.load(std::memory_order_relaxed);
+		}
+
+		void Tracker::publish_snapshot()
+		{
+			Snapshot * snap = new Snapshot();
+			snap->generation = _generation.load(std::memory_order_relaxed) + 1;
+			snap->entries.reserve(_modules_idx.size());
+			// map is sorted in descending order
+			for (auto it = _modules_idx.rbegin(); it != _modules_idx.rend(); ++it) {
+				snap->entries.push_back({ it->first, it->second->end, it->second.get() });
+			}
+
+			const Snapshot * old = _snapshot.exchange(snap, std::memory_order_seq_cst);
+			_generation.store(snap->generation, std::memory_order_release);
+			if (nullptr == old)
+				return;
+
+			// wait until no reader can access the old snapshot anymore
+			_readers.synchronize();
+			delete old;
 		}
 
 		Tracker::PMetadata Tracker::get_module_containing(const app_pc pc) const
@@ -85,6 +119,9 @@ namespace drace {
 			if (modptr) {
 				if (!modptr->loaded && (modptr->info == mod)) {
 					modptr->loaded = true;
+					lock_write();
+					publish_snapshot();
+					unlock_write();
 					return modptr;
 				}
 			}
@@ -100,6 +137,23 @@ namespace drace {
 			// Module not already registered
 			modptr->set_info(mod);
 			modptr->instrument = def_instr_flags;
+			if (params.lossy_flush) {
+				// frequent regions are switched using flags, see MemoryTracker::update_cache
+				modptr->init_regions(MemoryTracker::HIST_PC_RES);
+			}
+
+			DecisionCache::Decision decision;
+			if (decisions && decisions->lookup(mod, decision)) {
+				// unchanged module, reuse decisions of last run
+				modptr->instrument = decision.instrument;
+				modptr->modtype = decision.modtype;
+				modptr->debug_info = decision.debug_info;
+
+				lock_write();
+				publish_snapshot();
+				unlock_write();
+				return modptr;
+			}
 
 			std::string mod_path(mod->full_path);
 			std::string mod_name(dr_module_preferred_name(mod));
@@ -125,9 +179,31 @@ namespace drace {
 				modptr->debug_info = _syms->debug_info_available(mod);
 			}
 
+			if (decisions) {
+				decisions->store(mod, { modptr->instrument, modptr->modtype, modptr->debug_info });
+			}
+
+			// make module visible to lock-free readers
+			lock_write();
+			publish_snapshot();
+			unlock_write();
+
 			return modptr;
 		}
 
+		void Tracker::unregister_module(const module_data_t * mod)
+		{
+			lock_read();
+			auto modptr = get_module_containing(mod->start);
+			unlock_read();
+			if (modptr) {
+				modptr->loaded = false;
+				lock_write();
+				publish_snapshot();
+				unlock_write();
+			}
+		}
+
 		/* Module load event implementation.
 		* To get clean call-stacks, we add the shadow-stack instrumentation
 		* to all modules (even the excluded ones).
@@ -249,12 +325,7 @@ namespace drace {
 			LOG_INFO(-1, "Unload module: % 20s, beg : %p, end : %p, full path : %s",
 				dr_module_preferred_name(mod), mod->start, mod->end, mod->full_path);
 
-			module_tracker->lock_read();
-			auto modptr = module_tracker->get_module_containing(mod->start);
-			module_tracker->unlock_read();
-			if (modptr) {
-				modptr->loaded = false;
-			}
+			module_tracker->unregister_module(mod);
 		}
 	} // namespace module
 } // namespace drace
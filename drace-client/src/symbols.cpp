@@ -18,11 +18,12 @@
 #include <string>
 #include <sstream>
 #include <algorithm>
+#include <vector>
 
 namespace drace {
 
 	std::string Symbols::get_bb_symbol(app_pc pc) {
-		auto modptr = module_tracker->get_module_containing(pc);
+		module::Metadata * modptr = module_tracker->find_module(pc);
 
 		if (modptr) {
 			// Reverse search from pc until symbol can be decoded
@@ -42,7 +43,7 @@ namespace drace {
 		SymbolLocation sloc;
 		sloc.pc = pc;
 
-		auto modptr = module_tracker->get_module_containing(pc);
+		module::Metadata * modptr = module_tracker->find_module(pc);
 		// Not (Jitted PC or PC is in managed module)
 		// OR managed module, but MSR is not attached
 		if (modptr && ((modptr->modtype == module::Metadata::MOD_TYPE_FLAGS::NATIVE)
@@ -92,6 +93,23 @@ namespace drace {
 		return sloc;
 	}
 
+	void Symbols::prefetch(const uint64_t * pcs, size_t count) {
+		if (!shmdriver)
+			return;
+
+		std::vector<app_pc> managed;
+		for (size_t i = 0; i < count; ++i) {
+			module::Metadata * modptr = module_tracker->find_module((app_pc)pcs[i]);
+			// same condition as in get_symbol_info
+			if (!modptr || modptr->modtype != module::Metadata::MOD_TYPE_FLAGS::NATIVE) {
+				managed.push_back((app_pc)pcs[i]);
+			}
+		}
+		if (!managed.empty()) {
+			MSR::lookup_addresses(managed.data(), managed.size());
+		}
+	}
+
 	bool Symbols::debug_info_available(const module_data_t *mod) const {
 		drsym_debug_kind_t flags;
 		drsym_error_t error;
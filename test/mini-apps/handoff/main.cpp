@@ -0,0 +1,51 @@
+/*
+ * DRace, a dynamic data race detector
+ *
+ * Copyright 2018 Siemens AG
+ *
+ * Authors:
+ *   Felix Moessbauer <felix.moessbauer@siemens.com>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <thread>
+#include <chrono>
+#include <iostream>
+#include <cstdint>
+
+#define PAGE_SIZE 4096
+
+/*
+* A single unsynchronized handoff: the writer is the first thread
+* which touches the page, the reader accesses it later without
+* synchronization. Exactly one race is expected.
+*/
+
+void writer(int * x) {
+	*x = 42;
+}
+
+void reader(int * x, int * result) {
+	// order the accesses in time, but not in happens-before
+	std::this_thread::sleep_for(std::chrono::milliseconds(500));
+	*result = *x;
+}
+
+int main() {
+	// use a page which is not touched by the main thread
+	char * mem = new char[3 * PAGE_SIZE];
+	int * x = (int*)(((uintptr_t)mem + 2 * PAGE_SIZE - 1) & ~(uintptr_t)(PAGE_SIZE - 1));
+	int result = 0;
+
+	auto ta = std::thread(&writer, x);
+	auto tb = std::thread(&reader, x, &result);
+
+	ta.join();
+	tb.join();
+
+	std::cout << "EXPECTED: " << 42 << ", "
+		<< "ACTUAL: " << result << std::endl;
+	delete[] mem;
+	return 0;
+}
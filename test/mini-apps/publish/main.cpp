@@ -0,0 +1,98 @@
+/*
+ * DRace, a dynamic data race detector
+ *
+ * Copyright 2018 Siemens AG
+ *
+ * Authors:
+ *   Felix Moessbauer <felix.moessbauer@siemens.com>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <iostream>
+#include <cstdint>
+
+#define PAGE_SIZE 4096
+#define NUM_PAGES 4
+#define ROUNDS 200
+
+/*
+* Publish-then-read: the main thread fills a table and publishes it
+* under a mutex, afterwards the reader only reads it. Both threads
+* synchronize on private mutexes, which completes the epochs of
+* excl-readonly without ordering the threads.
+* If PUBLISH_RACY is set, the main thread writes the table again
+* after the publication, which races with the reader.
+*/
+
+static std::mutex mx;
+static bool published = false;
+
+void reader(const int * table, long * result) {
+	static std::mutex reader_mx;
+	long sum = 0;
+
+	// wait for the publication
+	while (true) {
+		{
+			std::lock_guard<std::mutex> lock(mx);
+			if (published)
+				break;
+		}
+		std::this_thread::yield();
+	}
+
+	for (int r = 0; r < ROUNDS; ++r) {
+		for (int i = 0; i < NUM_PAGES * PAGE_SIZE / (int)sizeof(int); ++i) {
+			sum += table[i];
+		}
+		{
+			std::lock_guard<std::mutex> lock(reader_mx);
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(2));
+	}
+	*result = sum;
+}
+
+int main() {
+	static std::mutex main_mx;
+	const int num_entries = NUM_PAGES * PAGE_SIZE / (int)sizeof(int);
+	long result = 0;
+
+	// use pages which are only accessed through the table
+	char * mem = new char[(NUM_PAGES + 1) * PAGE_SIZE];
+	int * table = (int*)(((uintptr_t)mem + PAGE_SIZE - 1) & ~(uintptr_t)(PAGE_SIZE - 1));
+
+	auto ta = std::thread(&reader, table, &result);
+
+	for (int i = 0; i < num_entries; ++i) {
+		table[i] = 1;
+	}
+	{
+		std::lock_guard<std::mutex> lock(mx);
+		published = true;
+	}
+
+	for (int r = 0; r < ROUNDS; ++r) {
+#ifdef PUBLISH_RACY
+		// write after the publication, while the reader is active
+		if (r == ROUNDS / 4) {
+			table[0] = 2;
+		}
+#endif
+		{
+			std::lock_guard<std::mutex> lock(main_mx);
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(2));
+	}
+
+	ta.join();
+
+	std::cout << "EXPECTED: " << (long)ROUNDS * num_entries << ", "
+		<< "ACTUAL: " << result << std::endl;
+	delete[] mem;
+	return 0;
+}
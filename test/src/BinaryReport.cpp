@@ -0,0 +1,170 @@
+/*
+ * DRace, a dynamic data race detector
+ *
+ * Copyright 2018 Siemens AG
+ *
+ * Authors:
+ *   Felix Moessbauer <felix.moessbauer@siemens.com>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "gtest/gtest.h"
+
+#include <report/BinaryFormat.h>
+#include "ReportReader.h"
+#include "SymbolResolver.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+/**
+* Writes reports in the same way as the binary sink of the drace client
+* and reads them back using drace-report.
+*/
+class BinaryReport : public ::testing::Test {
+protected:
+	const char *  filename = "binary-report-test.drrp";
+	std::ofstream out;
+
+	void SetUp() override {
+		out.open(filename, std::ofstream::out | std::ofstream::binary | std::ofstream::trunc);
+		report::FileHeader header;
+		header.pid = 42;
+		header.start_time = 1000;
+		report::copy_string(header.app, "C:\\test\\app.exe", report::max_path_len);
+		write_record(header);
+	}
+
+	void TearDown() override {
+		if (out.is_open())
+			out.close();
+		std::remove(filename);
+	}
+
+	template<typename Record>
+	void write_record(const Record & rec) {
+		out.write(reinterpret_cast<const char*>(&rec), sizeof(Record));
+	}
+
+	void write_snapshot(const std::vector<report::ModuleRecord> & mods) {
+		report::SnapshotRecord snap;
+		snap.num_modules = static_cast<uint32_t>(mods.size());
+		write_record(snap);
+		for (const auto & mod : mods) {
+			write_record(mod);
+		}
+	}
+
+	static report::ModuleRecord module(uint64_t base, uint64_t end, const char * path) {
+		report::ModuleRecord mod;
+		mod.base = base;
+		mod.end = end;
+		report::copy_string(mod.path, path, report::max_path_len);
+		return mod;
+	}
+
+	/** race with the given stacks (caller first) */
+	static report::RaceRecord race(uint64_t time, const std::vector<uint64_t> & stack1, const std::vector<uint64_t> & stack2) {
+		report::RaceRecord rec;
+		rec.time = time;
+		fill_access(rec.first, 1, true, stack1);
+		fill_access(rec.second, 2, false, stack2);
+		return rec;
+	}
+
+	static void fill_access(report::AccessRecord & ac, uint32_t tid, bool write, const std::vector<uint64_t> & stack) {
+		std::memset(&ac, 0, sizeof(ac));
+		ac.accessed_memory = 0x1000;
+		ac.access_size = 8;
+		ac.thread_id = tid;
+		ac.write = write;
+		ac.stack_size = static_cast<uint32_t>(stack.size());
+		std::copy(stack.begin(), stack.end(), ac.stack_trace);
+	}
+
+	/** reads the report and returns the races */
+	std::vector<report::Race> read(uint64_t * stop_time = nullptr) {
+		out.close();
+		report::SymbolResolver resolver("");
+		report::ReportReader reader(filename, resolver);
+		EXPECT_EQ(reader.header().pid, 42u);
+		EXPECT_EQ(reader.header().start_time, 1000u);
+		EXPECT_STREQ(reader.header().app, "C:\\test\\app.exe");
+
+		std::vector<report::Race> races;
+		size_t num_races = reader.process([&races](const report::Race & r) { races.push_back(r); });
+		EXPECT_EQ(num_races, races.size());
+		if (stop_time != nullptr)
+			*stop_time = reader.stop_time();
+		return races;
+	}
+};
+
+TEST_F(BinaryReport, RoundTrip) {
+	write_snapshot({ module(0x10000, 0x20000, "C:\\test\\first.dll"), module(0x30000, 0x40000, "C:\\test\\second.dll") });
+	write_record(race(10, { 0x10010, 0x30020 }, { 0x50000 }));
+	// the module map changed
+	write_snapshot({ module(0x50000, 0x60000, "C:\\test\\third.dll") });
+	write_record(race(20, { 0x50010 }, { 0x10010 }));
+	report::EndRecord end;
+	end.stop_time = 2000;
+	write_record(end);
+
+	uint64_t stop_time = 0;
+	auto races = read(&stop_time);
+	EXPECT_EQ(stop_time, 2000u);
+	ASSERT_EQ(races.size(), 2u);
+
+	const auto & first = races[0];
+	EXPECT_EQ(first.time, 10u);
+	EXPECT_EQ(first.first.raw.thread_id, 1u);
+	EXPECT_TRUE(first.first.raw.write);
+	EXPECT_EQ(first.second.raw.thread_id, 2u);
+	EXPECT_FALSE(first.second.raw.write);
+	// innermost frame first
+	ASSERT_EQ(first.first.stack.size(), 2u);
+	EXPECT_EQ(first.first.stack[0].pc, 0x30020u);
+	EXPECT_EQ(first.first.stack[0].mod_name, "second.dll");
+	EXPECT_EQ(first.first.stack[1].pc, 0x10010u);
+	EXPECT_EQ(first.first.stack[1].mod_name, "first.dll");
+	// not part of the first snapshot
+	ASSERT_EQ(first.second.stack.size(), 1u);
+	EXPECT_TRUE(first.second.stack[0].mod_name.empty());
+
+	const auto & second = races[1];
+	EXPECT_EQ(second.time, 20u);
+	ASSERT_EQ(second.first.stack.size(), 1u);
+	EXPECT_EQ(second.first.stack[0].mod_name, "third.dll");
+	ASSERT_EQ(second.second.stack.size(), 1u);
+	EXPECT_TRUE(second.second.stack[0].mod_name.empty());
+}
+
+TEST_F(BinaryReport, Incomplete) {
+	write_record(race(10, { 0x10010 }, { 0x10020 }));
+	// truncated race record
+	report::RaceRecord rec = race(20, { 0x10010 }, { 0x10020 });
+	out.write(reinterpret_cast<const char*>(&rec), sizeof(rec) / 2);
+
+	uint64_t stop_time = 1;
+	auto races = read(&stop_time);
+	EXPECT_EQ(stop_time, 0u);
+	EXPECT_EQ(races.size(), 1u);
+}
+
+TEST_F(BinaryReport, CorruptSnapshot) {
+	write_record(race(10, { 0x10010 }, { 0x10020 }));
+	// the count exceeds the remaining size of the file
+	report::SnapshotRecord snap;
+	snap.num_modules = 0xFFFFFFFF;
+	write_record(snap);
+	write_record(module(0x10000, 0x20000, "C:\\test\\first.dll"));
+	write_record(race(20, { 0x10010 }, { 0x10020 }));
+
+	auto races = read();
+	ASSERT_EQ(races.size(), 1u);
+	EXPECT_EQ(races[0].time, 10u);
+}
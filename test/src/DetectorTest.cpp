@@ -171,4 +171,25 @@ TEST_F(DetectorTest, ResetRange) {
 	detector::write(tls81, stack, 1, (void*)0x0082, 8);
 	detector::deallocate(tls81, (void*)0x0080);
 	EXPECT_EQ(num_races, 0);
-}
\ No newline at end of file
+}
+TEST_F(DetectorTest, TransferRange) {
+	detector::tls_t tls90;
+	detector::tls_t tls91;
+	detector::tls_t tls92;
+
+	detector::fork(1, 90, &tls90);
+	detector::fork(1, 91, &tls91);
+	detector::fork(1, 92, &tls92);
+
+	// handoff after synchronization
+	detector::own_range(tls90, (void*)0x0090, (void*)0x9000, 0x1000);
+	detector::happens_before(90, (void*)0x0090);
+	detector::happens_after(91, (void*)0x0090);
+	detector::transfer_range(tls91, (void*)0x0091, (void*)0x9000, 0x1000);
+	EXPECT_EQ(num_races, 0);
+
+	// unsynchronized handoff
+	detector::own_range(tls90, (void*)0x0090, (void*)0xA000, 0x1000);
+	detector::transfer_range(tls92, (void*)0x0092, (void*)0xA000, 0x1000);
+	EXPECT_EQ(num_races, 1);
+}
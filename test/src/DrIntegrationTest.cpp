@@ -38,6 +38,15 @@ TEST_P(FlagMode, Atomics) {
 //TEST_P(FlagMode, RacyAtomics) {
 //	run(GetParam(), "mini-apps/atomics/gp-atomics.exe racy", 1, 10);
 //}
+TEST_P(FlagMode, Handoff) {
+	run(GetParam(), "mini-apps/handoff/gp-handoff.exe", 1, 1);
+}
+TEST_P(FlagMode, Publish) {
+	run(GetParam(), "mini-apps/publish/gp-publish.exe", 0, 0);
+}
+TEST_P(FlagMode, PublishRacy) {
+	run(GetParam(), "mini-apps/publish/gp-publish-racy.exe", 1, 2);
+}
 TEST_P(FlagMode, Annotations) {
 	run(GetParam(), "mini-apps/annotations/gp-annotations.exe", 0, 0);
 }
@@ -51,6 +60,30 @@ TEST_F(DrIntegration, ExclStack) {
 	run("--excl-stack", "mini-apps/concurrent-inc/gp-concurrent-inc.exe", 1, 10);
 }
 
+TEST_F(DrIntegration, ExclSingle) {
+	run("--excl-single", "mini-apps/concurrent-inc/gp-concurrent-inc.exe", 1, 10);
+}
+
+TEST_F(DrIntegration, ExclPrivate) {
+	run("--excl-private", "mini-apps/concurrent-inc/gp-concurrent-inc.exe", 1, 10);
+}
+
+TEST_F(DrIntegration, ExclPrivateHandoff) {
+	run("--excl-private", "mini-apps/handoff/gp-handoff.exe", 1, 1);
+}
+
+TEST_F(DrIntegration, ExclReadonly) {
+	run("--excl-readonly", "mini-apps/concurrent-inc/gp-concurrent-inc.exe", 1, 10);
+}
+
+TEST_F(DrIntegration, ExclReadonlyPublish) {
+	run("--excl-readonly", "mini-apps/publish/gp-publish.exe", 0, 0);
+}
+
+TEST_F(DrIntegration, ExclReadonlyPublishRacy) {
+	run("--excl-readonly", "mini-apps/publish/gp-publish-racy.exe", 1, 2);
+}
+
 TEST_F(DrIntegration, ExcludeRaces) {
 	run("-c test/data/drace_excl.ini", "mini-apps/concurrent-inc/gp-concurrent-inc.exe", 0, 0);
 }
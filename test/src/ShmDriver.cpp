@@ -12,6 +12,10 @@
 #include "gtest/gtest.h"
 
 #include "ipc/SyncSHMDriver.h"
+#include "ipc/RingSHMDriver.h"
+
+#include <thread>
+#include <vector>
 
 TEST(SyncShmDriver, InitFinalize) {
 	ipc::SyncSHMDriver<true, false> sender("test-shm", true);
@@ -51,4 +55,49 @@ TEST(SyncShmDriver, Emplace) {
 	ASSERT_EQ(receiver.id(), ipc::SMDataID::SYMBOL);
 	ASSERT_EQ(ret.a, 10);
 	ASSERT_FALSE(ret.b);
-}
\ No newline at end of file
+}
+
+TEST(RingShmDriver, Pipelined) {
+	ipc::RingSHMDriver<false, false> server("test-ring", true);
+	ipc::RingSHMDriver<true, false> client("test-ring", false);
+
+	// submit more requests than a synchronous driver could handle
+	std::vector<ipc::SMSlot*> slots;
+	for (int i = 0; i < 4; ++i) {
+		ipc::SMSlot * slot = client.acquire();
+		client.emplace<int>(slot, ipc::SMDataID::IP, i);
+		client.submit(slot);
+		slots.push_back(slot);
+	}
+
+	std::thread msr([&]() {
+		for (int i = 0; i < 4; ++i) {
+			ipc::SMSlot * slot;
+			while ((slot = server.next_request()) == nullptr) {
+				server.wait_request(std::chrono::milliseconds(10));
+			}
+			// requests are processed in order of submission,
+			// respond in any case to not block the client
+			int val = server.get<int>(slot);
+			EXPECT_EQ(val, i);
+			server.emplace<int>(slot, ipc::SMDataID::CONFIRM, val * 2);
+			server.respond(slot);
+		}
+	});
+	// a failed assertion returns early, join the server on all paths
+	struct Joiner {
+		std::thread & t;
+		~Joiner() {
+			if (t.joinable())
+				t.join();
+		}
+	} joiner{ msr };
+
+	// await in reverse order
+	for (int i = 3; i >= 0; --i) {
+		ASSERT_TRUE(client.await(slots[i], std::chrono::seconds(10)));
+		ASSERT_EQ(slots[i]->id, ipc::SMDataID::CONFIRM);
+		ASSERT_EQ(client.get<int>(slots[i]), i * 2);
+		client.release(slots[i]);
+	}
+}